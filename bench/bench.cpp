@@ -0,0 +1,323 @@
+#include <sandbox.hpp>
+#include <machine_instance.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <thread>
+/**
+ * Benchmarks of the sandbox layer, without the network stack.
+ *
+ * Micro-benchmarks time a single operation at a time: forking,
+ * forkcall through the sandbox pool, calling into a fork, the page
+ * fault and read-fault handlers, and gathering guest buffers. The
+ * cost of recording the per-request metrics is compared to a forkcall,
+ * for one tenant and for more tenants than a thread keeps shards for.
+ * The driver then serves the /z logic from 1 to N threads. Startup is
+ * timed with an empty and with a warm translation cache.
+ *
+ * Results are written to stdout as JSON, and progress to stderr.
+ *
+ * ./dvm_bench [program] [threads] [seconds]
+**/
+using clock_type = std::chrono::steady_clock;
+static constexpr size_t PAGE_SIZE = 4096;
+
+struct Result {
+	std::string name;
+	size_t  iterations;
+	double  mean_ns;
+	double  p50_ns;
+	double  p99_ns;
+};
+
+static double percentile(const std::vector<uint64_t>& sorted, double p)
+{
+	if (sorted.empty()) return 0.0;
+	return sorted[std::min(sorted.size() - 1, size_t(sorted.size() * p))];
+}
+
+static Result summarize(std::string name, std::vector<uint64_t> samples, uint64_t total_ns, size_t ops)
+{
+	std::sort(samples.begin(), samples.end());
+	fprintf(stderr, "%-24s %10.1f ns/op\n", name.c_str(), total_ns / double(ops));
+	return {
+		std::move(name), ops,
+		total_ns / double(ops),
+		percentile(samples, 0.50),
+		percentile(samples, 0.99)
+	};
+}
+
+/* Times op() one call at a time, ops_per_call operations each time */
+template <typename Setup, typename Op>
+static Result measure(const char* name, size_t iterations, size_t ops_per_call, Setup setup, Op op)
+{
+	std::vector<uint64_t> samples;
+	samples.reserve(iterations);
+	uint64_t total = 0;
+	for (size_t i = 0; i < iterations; i++) {
+		setup();
+		const auto t0 = clock_type::now();
+		op();
+		const auto t1 = clock_type::now();
+		const uint64_t ns = std::chrono::nanoseconds(t1 - t0).count();
+		samples.push_back(ns / ops_per_call);
+		total += ns;
+	}
+	return summarize(name, std::move(samples), total, iterations * ops_per_call);
+}
+
+static std::vector<Result> micro_benchmarks(TenantInstance& tenant, size_t iterations)
+{
+	std::vector<Result> results;
+	auto program = tenant.current_program();
+	const auto entry = program->entry_address;
+
+	results.push_back(measure("vmfork", iterations, 1, [] {},
+		[&] {
+			delete tenant.vmfork();
+		}));
+
+	results.push_back(measure("forkcall", iterations, 1, [] {},
+		[&] {
+			auto fc = tenant.forkcall();
+		}));
+
+	/* Calls into a fork that is reset in between */
+	Script fork {program->script, &tenant, *program};
+	results.push_back(measure("script_call", iterations, 1,
+		[&] { fork.reset(); },
+		[&] {
+			fork.call(entry);
+		}));
+
+	/* Every page of the main VM, read from a fresh fork */
+	std::vector<Script::gaddr_t> parent_pages;
+	for (const auto& it : program->script.machine().memory.pages())
+		parent_pages.push_back(it.first);
+	auto& mem = fork.machine().memory;
+	results.push_back(measure("page_readf", iterations, parent_pages.size(),
+		[&] { fork.reset(); },
+		[&] {
+			for (const auto pageno : parent_pages)
+				mem.get_readable_pageno(pageno);
+		}));
+
+	/* New zeroed pages, above anything the program has mapped */
+	static constexpr size_t FAULT_PAGES = 64;
+	results.push_back(measure("page_fault", iterations, FAULT_PAGES,
+		[&] { fork.reset(); },
+		[&] {
+			const auto first = mem.mmap_address() / PAGE_SIZE;
+			for (size_t i = 0; i < FAULT_PAGES; i++)
+				mem.create_writable_pageno(first + i);
+		}));
+
+	/* A 64KB body spread over as many pages as possible */
+	static constexpr size_t BODY_SIZE = 65536;
+	fork.reset();
+	const auto body = fork.guest_alloc(BODY_SIZE);
+	fork.machine().memory.memset(body, 'x', BODY_SIZE);
+	std::array<riscv::vBuffer, BODY_SIZE / PAGE_SIZE + 1> buffers;
+	results.push_back(measure("gather_buffers", iterations, 1, [] {},
+		[&] {
+			mem.gather_buffers_from_range(buffers.size(), buffers.data(), body, BODY_SIZE);
+		}));
+	return results;
+}
+
+struct MetricsResult {
+	double record_ns;
+	double record_many_ns;
+	double overhead_percent;
+};
+
+/* Recording is done once per request, so its cost is relative to the
+   cheapest request there is, a forkcall of the same program */
+static MetricsResult metrics_overhead(TenantInstance& tenant, const std::vector<Result>& micro,
+	size_t iterations)
+{
+	static constexpr size_t BATCH = 100;
+	const TenantMetrics::Sample sample {
+		.fork_ticks = 2000, .exec_ticks = 20000, .instructions = 50000,
+		.page_faults = 4, .cow_reads = 8,
+	};
+	const auto one = measure("metrics_record", iterations, BATCH, [] {},
+		[&] {
+			for (size_t i = 0; i < BATCH; i++)
+				tenant.metrics.record(sample);
+		});
+
+	/* Every record gives up the shard of another tenant */
+	std::vector<TenantMetrics> many(4 * TenantMetrics::MAX_LOCAL_SHARDS);
+	size_t next = 0;
+	const auto spread = measure("metrics_record_many", iterations, BATCH, [] {},
+		[&] {
+			for (size_t i = 0; i < BATCH; i++)
+				many[next++ % many.size()].record(sample);
+		});
+
+	double forkcall_ns = 0.0;
+	for (const auto& r : micro)
+		if (r.name == "forkcall") forkcall_ns = r.mean_ns;
+	const MetricsResult result {
+		one.mean_ns, spread.mean_ns,
+		(forkcall_ns > 0.0) ? 100.0 * one.mean_ns / forkcall_ns : 0.0
+	};
+	fprintf(stderr, "metrics: %.1f%% of a forkcall\n", result.overhead_percent);
+	return result;
+}
+
+struct StartupResult {
+	double cold_ms;
+	double warm_ms;
+};
+
+/* Creates the tenant from scratch, with and without cached translations */
+static StartupResult startup_benchmark(const TenantConfig& config, size_t iterations)
+{
+	namespace fs = std::filesystem;
+	char dir[] = "/tmp/dvm_bench-XXXXXX";
+	if (mkdtemp(dir) == nullptr) {
+		fprintf(stderr, "Could not create a translation cache directory\n");
+		exit(1);
+	}
+	TranslationCache::configure({ .directory = dir });
+
+	auto create = [&] {
+		const auto t0 = clock_type::now();
+		TenantInstance tenant {config};
+		const auto t1 = clock_type::now();
+		return std::chrono::duration<double, std::milli>(t1 - t0).count();
+	};
+	std::vector<double> cold, warm;
+	for (size_t i = 0; i < iterations; i++) {
+		for (const auto& entry : fs::directory_iterator(dir))
+			fs::remove(entry.path());
+		cold.push_back(create());
+		warm.push_back(create());
+	}
+	TranslationCache::configure({});
+	fs::remove_all(dir);
+
+	std::sort(cold.begin(), cold.end());
+	std::sort(warm.begin(), warm.end());
+	const StartupResult result { cold[cold.size() / 2], warm[warm.size() / 2] };
+	fprintf(stderr, "startup: cold %.1f ms  warm %.1f ms\n", result.cold_ms, result.warm_ms);
+	return result;
+}
+
+struct DriverResult {
+	size_t threads;
+	double req_per_sec;
+	double p50_ns;
+	double p99_ns;
+};
+
+/* Serves /z on every thread, the same way as the server does */
+static DriverResult drive(const TenantRegistry& registry, size_t nthreads, double seconds)
+{
+	std::atomic<bool> stop = false;
+	std::vector<std::vector<uint64_t>> samples(nthreads);
+	std::vector<std::thread> threads;
+
+	for (size_t t = 0; t < nthreads; t++)
+	threads.emplace_back([&, t] {
+		auto& latencies = samples[t];
+		latencies.reserve(1'000'000);
+		while (!stop.load(std::memory_order_relaxed)) {
+			const auto t0 = clock_type::now();
+			{
+				auto guard = registry.read();
+				TenantInstance* tenant = registry.find("localhost:8080", "/z");
+				auto fc = tenant->forkcall();
+				std::string body;
+				body.reserve(fc->length);
+				for (size_t i = 0; i < fc->cnt; i++)
+					body.append(fc->buffers[i].ptr, fc->buffers[i].len);
+			}
+			const auto t1 = clock_type::now();
+			latencies.push_back(std::chrono::nanoseconds(t1 - t0).count());
+		}
+	});
+
+	std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+	stop = true;
+	for (auto& thread : threads)
+		thread.join();
+
+	std::vector<uint64_t> all;
+	for (auto& latencies : samples)
+		all.insert(all.end(), latencies.begin(), latencies.end());
+	std::sort(all.begin(), all.end());
+
+	const DriverResult result {
+		nthreads, all.size() / seconds,
+		percentile(all, 0.50), percentile(all, 0.99)
+	};
+	fprintf(stderr, "%3zu threads: %12.0f req/s  p50: %.0f ns  p99: %.0f ns\n",
+		nthreads, result.req_per_sec, result.p50_ns, result.p99_ns);
+	return result;
+}
+
+int main(int argc, char** argv)
+{
+	if (argc < 2) {
+		fprintf(stderr, "%s [program] [threads] [seconds]\n", argv[0]);
+		exit(1);
+	}
+	const size_t max_threads = (argc > 2) ? atoi(argv[2]) : std::thread::hardware_concurrency();
+	const double seconds     = (argc > 3) ? atof(argv[3]) : 2.0;
+
+	const TenantConfig config {
+		.name = "Pythran",
+		.group = "Tenants",
+		.filename = std::string(argv[1]),
+		.max_instructions = 2'000'000ull,
+		.max_memory = 64'000'000ull,
+		.max_heap   = 8'000'000ull
+	};
+	auto tenant = std::make_shared<TenantInstance>(config);
+	if (tenant->no_program_loaded()) {
+		fprintf(stderr, "Could not load program: %s\n", argv[1]);
+		exit(1);
+	}
+
+	const auto startup = startup_benchmark(config, 5);
+
+	const auto micro = micro_benchmarks(*tenant, 20'000);
+	const auto metrics = metrics_overhead(*tenant, micro, 2'000);
+
+	TenantRegistry registry;
+	registry.insert("/z", tenant);
+	std::vector<DriverResult> driver;
+	std::vector<size_t> thread_counts;
+	for (size_t n = 1; n < max_threads; n *= 2)
+		thread_counts.push_back(n);
+	thread_counts.push_back(max_threads);
+	for (const size_t n : thread_counts)
+		driver.push_back(drive(registry, n, seconds));
+
+	printf("{\n\t\"program\": \"%s\",\n", argv[1]);
+	printf("\t\"startup\": {\"cold_ms\": %.1f, \"warm_ms\": %.1f},\n",
+		startup.cold_ms, startup.warm_ms);
+	printf("\t\"micro\": [\n");
+	for (size_t i = 0; i < micro.size(); i++) {
+		const auto& r = micro[i];
+		printf("\t\t{\"name\": \"%s\", \"iterations\": %zu, \"mean_ns\": %.1f, \"p50_ns\": %.0f, \"p99_ns\": %.0f}%s\n",
+			r.name.c_str(), r.iterations, r.mean_ns, r.p50_ns, r.p99_ns,
+			(i + 1 < micro.size()) ? "," : "");
+	}
+	printf("\t],\n\t\"metrics\": {\"record_ns\": %.1f, \"record_many_tenants_ns\": %.1f, \"overhead_percent\": %.2f},\n",
+		metrics.record_ns, metrics.record_many_ns, metrics.overhead_percent);
+	printf("\t\"driver\": [\n");
+	for (size_t i = 0; i < driver.size(); i++) {
+		const auto& r = driver[i];
+		printf("\t\t{\"threads\": %zu, \"req_per_sec\": %.0f, \"p50_ns\": %.0f, \"p99_ns\": %.0f}%s\n",
+			r.threads, r.req_per_sec, r.p50_ns, r.p99_ns,
+			(i + 1 < driver.size()) ? "," : "");
+	}
+	printf("\t]\n}\n");
+}
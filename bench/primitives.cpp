@@ -0,0 +1,163 @@
+#include <sandbox.hpp>
+#include <machine_instance.hpp>
+#include <machine/syscalls.h>
+#include <crc32.hpp>
+#include <primitives.hpp>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+/**
+ * Cost per byte of the native primitives, compared to doing the same
+ * work in the guest. Each primitive is timed three ways:
+ *
+ *   emulated: a guest function, from machine/bench_primitives.hpp,
+ *             skipped when the program doesn't export it
+ *   syscall:  the system call handler, reading and writing guest
+ *             memory, as the guest would call it
+ *   native:   the host function, on host memory
+ *
+ * over inputs of 64 bytes, 4KB and 64KB of HTML-like text. Results
+ * are written to stdout as JSON, and progress to stderr.
+ *
+ * ./dvm_primitives_bench [program]
+**/
+using clock_type = std::chrono::steady_clock;
+using gaddr_t = Script::gaddr_t;
+static constexpr size_t SIZES[] = { 64, 4096, 65536 };
+static constexpr size_t MAX_SIZE = 65536;
+/* Keeps the results of pure functions from being optimized out */
+static volatile size_t sink;
+
+struct Result {
+	std::string name;
+	size_t bytes;
+	double emulated_ns;   /* Per byte, negative when not measured */
+	double instructions;  /* Per byte, emulated */
+	double syscall_ns;
+	double native_ns;
+};
+
+/* Repeats op() for about 50ms, and returns the time per byte */
+static double per_byte(size_t bytes, const std::function<void()>& op)
+{
+	op();
+	size_t rounds = 0;
+	const auto t0 = clock_type::now();
+	auto t1 = t0;
+	do {
+		for (size_t i = 0; i < 16; i++)
+			op();
+		rounds += 16;
+		t1 = clock_type::now();
+	} while (t1 - t0 < std::chrono::milliseconds(50));
+	return std::chrono::duration<double, std::nano>(t1 - t0).count() / (rounds * bytes);
+}
+
+/* Calls the handler of a system call, with the arguments in A0.. */
+template <typename... Args>
+static void system_call(Script::machine_t& machine, int number, Args... args)
+{
+	int reg = 10;
+	((machine.cpu.reg(reg++) = args), ...);
+	machine.system_call(number);
+}
+
+static std::string sample_text(size_t len)
+{
+	static const std::string line =
+		"<li class=\"item\"><a href=\"/search?q=caf%C3%A9&amp;page=2\">Tom's caf\xC3\xA9</a></li>\n";
+	std::string text;
+	while (text.size() < len)
+		text += line;
+	text.resize(len);
+	return text;
+}
+
+int main(int argc, char** argv)
+{
+	if (argc < 2) {
+		fprintf(stderr, "%s [program]\n", argv[0]);
+		exit(1);
+	}
+	const TenantConfig config {
+		.name = "Primitives",
+		.group = "Tenants",
+		.filename = std::string(argv[1]),
+		.max_instructions = 100'000'000ull,
+		.max_memory = 64'000'000ull,
+		.max_heap   = 8'000'000ull
+	};
+	TenantInstance tenant {config};
+	if (tenant.no_program_loaded()) {
+		fprintf(stderr, "Could not load program: %s\n", argv[1]);
+		exit(1);
+	}
+	auto program = tenant.current_program();
+	Script fork {program->script, &tenant, *program};
+	fork.reset();
+	auto& machine = fork.machine();
+	const gaddr_t src = fork.guest_alloc(MAX_SIZE);
+	const gaddr_t dst = fork.guest_alloc(6 * MAX_SIZE);
+	const gaddr_t needle = fork.guest_alloc(16);
+	machine.copy_to_guest(needle, "</never>", 8);
+
+	struct Primitive {
+		const char* name;
+		std::function<void(gaddr_t, size_t)> syscall;
+		std::function<void(std::string_view, std::string&)> native;
+	};
+	const Primitive benchmarks[] = {
+		{"find",
+			[&] (gaddr_t a, size_t n) { system_call(machine, ECALL_FIND, a, n, needle, 8); },
+			[] (std::string_view s, std::string&) { sink = primitives::find(s, "</never>"); }},
+		{"crc32",
+			[&] (gaddr_t a, size_t n) { system_call(machine, ECALL_CRC32, CRC32_C, a, n, 0); },
+			[] (std::string_view s, std::string&) { sink = crc32<0x82F63B78>(s.data(), s.size()); }},
+		{"base64_encode",
+			[&] (gaddr_t a, size_t n) { system_call(machine, ECALL_BASE64_ENCODE, a, n, dst, 6 * MAX_SIZE); },
+			[] (std::string_view s, std::string& out) { out.clear(); primitives::base64_encode(s, out); }},
+		{"url_decode",
+			[&] (gaddr_t a, size_t n) { system_call(machine, ECALL_URL_DECODE, a, n, dst, 6 * MAX_SIZE, 0); },
+			[] (std::string_view s, std::string& out) { out.clear(); primitives::url_decode(s, out); }},
+		{"escape_html",
+			[&] (gaddr_t a, size_t n) { system_call(machine, ECALL_ESCAPE, ESCAPE_HTML, a, n, dst, 6 * MAX_SIZE); },
+			[] (std::string_view s, std::string& out) { out.clear(); primitives::escape_html(s, out); }},
+	};
+
+	std::vector<Result> results;
+	std::string out;
+	for (const auto& p : benchmarks) {
+		const auto func = tenant.lookup(("bench_" + std::string(p.name)).c_str());
+		for (const size_t bytes : SIZES) {
+			const std::string text = sample_text(bytes);
+			machine.copy_to_guest(src, text.data(), text.size());
+
+			Result r { p.name, bytes, -1.0, 0.0, 0.0, 0.0 };
+			if (func != 0x0) {
+				r.emulated_ns = per_byte(bytes, [&] { fork.call(func, src, bytes); });
+				fork.call(func, src, bytes);
+				r.instructions = machine.instruction_counter() / double(bytes);
+			}
+			r.syscall_ns = per_byte(bytes, [&] { p.syscall(src, bytes); });
+			r.native_ns = per_byte(bytes, [&] { p.native(text, out); });
+
+			fprintf(stderr, "%-14s %6zu B  emulated %8.3f ns/B (%5.1f instr/B)  syscall %7.3f ns/B  native %7.3f ns/B\n",
+				r.name.c_str(), bytes, r.emulated_ns, r.instructions, r.syscall_ns, r.native_ns);
+			results.push_back(std::move(r));
+		}
+		if (func == 0x0)
+			fprintf(stderr, "%-14s the program does not export bench_%s\n", p.name, p.name);
+	}
+
+	printf("{\n\t\"program\": \"%s\",\n\t\"results\": [\n", argv[1]);
+	for (size_t i = 0; i < results.size(); i++) {
+		const auto& r = results[i];
+		char emulated[64] = "null";
+		if (r.emulated_ns >= 0.0)
+			snprintf(emulated, sizeof(emulated), "%.4f", r.emulated_ns);
+		printf("\t\t{\"name\": \"%s\", \"bytes\": %zu, \"emulated_ns_per_byte\": %s, \"instructions_per_byte\": %.2f, \"syscall_ns_per_byte\": %.4f, \"native_ns_per_byte\": %.4f}%s\n",
+			r.name.c_str(), r.bytes, emulated, r.instructions, r.syscall_ns, r.native_ns,
+			(i + 1 < results.size()) ? "," : "");
+	}
+	printf("\t]\n}\n");
+}
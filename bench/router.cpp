@@ -0,0 +1,98 @@
+#include <sandbox.hpp>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+/**
+ * Measures requests per second through the tenant registry with
+ * 1, 100 and 10'000 registered tenants. Every route points to the
+ * same program, so that the difference is only the routing cost.
+ *
+ * ./dvm_router_bench [program] [threads] [seconds]
+**/
+using clock_type = std::chrono::steady_clock;
+
+struct Result {
+	double req_per_sec;
+	double lookup_ns;
+};
+
+static Result run(const TenantRegistry& registry,
+	const std::vector<std::string>& hosts, size_t nthreads, double seconds)
+{
+	std::atomic<bool> stop = false;
+	std::atomic<uint64_t> requests = 0;
+	std::atomic<uint64_t> lookup_ns = 0;
+	std::vector<std::thread> threads;
+
+	for (size_t t = 0; t < nthreads; t++)
+	threads.emplace_back([&, t] {
+		uint64_t count = 0;
+		uint64_t lookup_time = 0;
+		size_t idx = t * 7919;
+
+		while (!stop.load(std::memory_order_relaxed)) {
+			const auto& host = hosts[idx++ % hosts.size()];
+			auto guard = registry.read();
+			const auto t0 = clock_type::now();
+			TenantInstance* tenant = registry.find(host, "/z");
+			const auto t1 = clock_type::now();
+			lookup_time += std::chrono::nanoseconds(t1 - t0).count();
+
+			auto fc = tenant->forkcall();
+			count++;
+		}
+		requests += count;
+		lookup_ns += lookup_time;
+	});
+
+	std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+	stop = true;
+	for (auto& thread : threads)
+		thread.join();
+
+	return {
+		requests.load() / seconds,
+		lookup_ns.load() / double(requests.load())
+	};
+}
+
+int main(int argc, char** argv)
+{
+	if (argc < 2) {
+		fprintf(stderr, "%s [program] [threads] [seconds]\n", argv[0]);
+		exit(1);
+	}
+	const size_t nthreads = (argc > 2) ? atoi(argv[2]) : std::thread::hardware_concurrency();
+	const double seconds  = (argc > 3) ? atof(argv[3]) : 2.0;
+
+	auto tenant = std::make_shared<TenantInstance>(TenantConfig{
+		.name = "Pythran",
+		.group = "Tenants",
+		.filename = std::string(argv[1]),
+		.max_instructions = 2'000'000ull,
+		.max_memory = 64'000'000ull,
+		.max_heap   = 8'000'000ull
+	});
+	if (tenant->no_program_loaded()) {
+		fprintf(stderr, "Could not load program: %s\n", argv[1]);
+		exit(1);
+	}
+
+	printf("Threads: %zu, duration: %.1fs\n", nthreads, seconds);
+	for (const size_t count : {1ul, 100ul, 10'000ul})
+	{
+		TenantRegistry registry;
+		std::vector<std::pair<std::string, TenantRegistry::SharedTenant>> routes;
+		std::vector<std::string> hosts;
+		for (size_t i = 0; i < count; i++) {
+			hosts.push_back("tenant" + std::to_string(i) + ".example.com:8080");
+			routes.push_back({"tenant" + std::to_string(i) + ".example.com", tenant});
+		}
+		registry.insert(routes);
+
+		const auto result = run(registry, hosts, nthreads, seconds);
+		printf("%6zu tenants: %12.0f req/s  lookup: %.1f ns\n",
+			count, result.req_per_sec, result.lookup_ns);
+	}
+}
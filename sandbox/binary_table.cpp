@@ -0,0 +1,141 @@
+#include "binary_table.hpp"
+
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <tuple>
+#include <unordered_map>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "sha256.hpp"
+
+/* Where a mapping came from, to avoid reading the same file again */
+using FileIdentity = std::tuple<dev_t, ino_t, off_t, time_t, long>;
+
+static std::mutex table_mtx;
+static std::unordered_map<std::string, std::weak_ptr<const ElfBinary>> by_content;
+static std::map<FileIdentity, std::weak_ptr<const ElfBinary>> by_file;
+static uint64_t table_loads  = 0;
+static uint64_t table_shared = 0;
+
+ElfBinary::~ElfBinary()
+{
+	munmap((void*)data, size);
+}
+
+static std::string content_key(const uint8_t* data, size_t size)
+{
+	return SHA256::hex(SHA256::hash(data, size));
+}
+
+/* Pages of a private file mapping that were never written still show
+   changes made to the file, so only files nobody can write are mapped */
+static void* map_file(int fd, size_t size)
+{
+	void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	/* Reading everything once is needed for the key anyway */
+	if (data != MAP_FAILED)
+		madvise(data, size, MADV_WILLNEED);
+	return data;
+}
+/* Writable files are read into anonymous memory, which a write to
+   the file in-place cannot change */
+static void* copy_file(int fd, size_t size)
+{
+	void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (data == MAP_FAILED)
+		return data;
+	for (size_t done = 0; done < size; ) {
+		const ssize_t len = pread(fd, (char*)data + done, size - done, done);
+		if (len <= 0) {
+			munmap(data, size);
+			return MAP_FAILED;
+		}
+		done += len;
+	}
+	mprotect(data, size, PROT_READ);
+	return data;
+}
+
+/* Drops the entries of programs that have been unmapped */
+template <typename Map>
+static void prune(Map& map)
+{
+	for (auto it = map.begin(); it != map.end(); ) {
+		if (it->second.expired())
+			it = map.erase(it);
+		else
+			++it;
+	}
+}
+
+BinaryTable::SharedBinary BinaryTable::load(const std::string& filename)
+{
+	const int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) throw std::runtime_error("Could not open file: " + filename);
+
+	struct stat st {};
+	if (fstat(fd, &st) < 0 || st.st_size == 0) {
+		close(fd);
+		throw std::runtime_error("Error when reading from file: " + filename);
+	}
+	const FileIdentity identity { st.st_dev, st.st_ino, st.st_size,
+		st.st_mtim.tv_sec, st.st_mtim.tv_nsec };
+	{
+		std::lock_guard<std::mutex> lock(table_mtx);
+		table_loads++;
+		auto it = by_file.find(identity);
+		if (it != by_file.end()) {
+			if (auto binary = it->second.lock()) {
+				close(fd);
+				table_shared++;
+				return binary;
+			}
+		}
+	}
+
+	const size_t size = st.st_size;
+	void* data = (st.st_mode & (S_IWUSR | S_IWGRP | S_IWOTH))
+		? copy_file(fd, size) : map_file(fd, size);
+	close(fd);
+	if (data == MAP_FAILED)
+		throw std::runtime_error("Could not map file: " + filename);
+	auto binary = std::make_shared<const ElfBinary>(
+		(const uint8_t*)data, size, content_key((const uint8_t*)data, size));
+
+	std::lock_guard<std::mutex> lock(table_mtx);
+	auto it = by_content.find(binary->key);
+	if (it != by_content.end()) {
+		auto existing = it->second.lock();
+		if (existing != nullptr && existing->size == size
+			&& memcmp(existing->data, binary->data, size) == 0)
+		{
+			/* Our own mapping is released on return */
+			by_file[identity] = existing;
+			table_shared++;
+			return existing;
+		}
+	}
+	prune(by_content);
+	prune(by_file);
+	by_content[binary->key] = binary;
+	by_file[identity] = binary;
+	return binary;
+}
+
+BinaryTable::Stats BinaryTable::stats()
+{
+	std::lock_guard<std::mutex> lock(table_mtx);
+	Stats stats { table_loads, table_shared, 0, 0 };
+	for (const auto& it : by_content) {
+		if (auto binary = it.second.lock()) {
+			stats.binaries++;
+			stats.bytes += binary->size;
+		}
+	}
+	return stats;
+}
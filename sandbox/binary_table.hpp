@@ -0,0 +1,57 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+
+/**
+ * A tenant program, mapped read-only from its file, or copied into
+ * read-only memory when the file is writable.
+ *
+ * The key identifies the contents: the SHA-256 of the whole file, in
+ * hex. It also names the native code translated from the program, so
+ * it must be infeasible to make another file with the same key.
+**/
+struct ElfBinary
+{
+	std::string_view view() const noexcept { return {(const char*)data, size}; }
+
+	const uint8_t* data = nullptr;
+	size_t size = 0;
+	std::string key;
+
+	ElfBinary(const uint8_t* d, size_t s, std::string k)
+		: data{d}, size{s}, key{std::move(k)} {}
+	~ElfBinary();
+	ElfBinary(const ElfBinary&) = delete;
+	ElfBinary& operator=(const ElfBinary&) = delete;
+};
+
+/**
+ * Global table of loaded programs, addressed by content.
+ *
+ * Tenants loading identical programs share one mapping, even when
+ * the files are copies of each other. Loading a file that is already
+ * mapped, by device, inode, size and modification time, neither maps
+ * nor reads it again. A program is unmapped when the last machine
+ * using it is gone.
+ *
+ * Only files without write permissions are mapped directly. Other
+ * files are copied, so that a program that is rewritten in-place does
+ * not change under the machines using it before it is reloaded.
+**/
+class BinaryTable
+{
+public:
+	using SharedBinary = std::shared_ptr<const ElfBinary>;
+	struct Stats {
+		uint64_t loads;    /* Calls to load() */
+		uint64_t shared;   /* Loads that found the program already mapped */
+		uint64_t binaries; /* Distinct programs mapped */
+		uint64_t bytes;    /* Bytes mapped */
+	};
+
+	/* Throws on errors, like a missing or empty file */
+	static SharedBinary load(const std::string& filename);
+	static Stats stats();
+};
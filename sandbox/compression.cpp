@@ -0,0 +1,342 @@
+#include "compression.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstdlib>
+#include <zlib.h>
+#ifdef DVM_BROTLI
+#include <brotli/encode.h>
+#endif
+#ifdef DVM_ZSTD
+#include <zstd.h>
+#endif
+
+static constexpr size_t CHUNK = 16384;
+
+static std::atomic<size_t> min_body_length { 1024 };
+static std::atomic<uint64_t> stat_bodies { 0 };
+static std::atomic<uint64_t> stat_bytes_in { 0 };
+static std::atomic<uint64_t> stat_bytes_out { 0 };
+static std::atomic<uint64_t> stat_precompressed { 0 };
+static std::atomic<uint64_t> stat_failed { 0 };
+
+void Compression::configure(const Config& config)
+{
+	min_body_length = config.min_length;
+}
+size_t Compression::min_length() noexcept
+{
+	return min_body_length.load(std::memory_order_relaxed);
+}
+
+bool Compression::available(Encoding encoding) noexcept
+{
+	switch (encoding) {
+	case Encoding::Gzip:
+		return true;
+#ifdef DVM_BROTLI
+	case Encoding::Brotli:
+		return true;
+#endif
+#ifdef DVM_ZSTD
+	case Encoding::Zstd:
+		return true;
+#endif
+	default:
+		return false;
+	}
+}
+
+const char* Compression::name(Encoding encoding) noexcept
+{
+	switch (encoding) {
+	case Encoding::Brotli: return "br";
+	case Encoding::Zstd:   return "zstd";
+	case Encoding::Gzip:   return "gzip";
+	default:               return "identity";
+	}
+}
+
+static std::string_view trim(std::string_view s)
+{
+	while (!s.empty() && (s.front() == ' ' || s.front() == '\t'))
+		s.remove_prefix(1);
+	while (!s.empty() && (s.back() == ' ' || s.back() == '\t'))
+		s.remove_suffix(1);
+	return s;
+}
+static bool iequals(std::string_view a, std::string_view b)
+{
+	return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(),
+		[] (char x, char y) { return std::tolower(x) == std::tolower(y); });
+}
+
+/* The q-value of one element, in thousandths */
+static int qvalue(std::string_view params)
+{
+	while (!params.empty()) {
+		const size_t end = std::min(params.find(';'), params.size());
+		const auto param = trim(params.substr(0, end));
+		if (param.size() >= 2 && (param[0] == 'q' || param[0] == 'Q') && param[1] == '=') {
+			const std::string value(param.substr(2));
+			return std::clamp(int(std::strtod(value.c_str(), nullptr) * 1000.0), 0, 1000);
+		}
+		params.remove_prefix(std::min(end + 1, params.size()));
+	}
+	return 1000;
+}
+
+Encoding Compression::negotiate(std::string_view header) noexcept
+{
+	static constexpr size_t N = size_t(Encoding::Count);
+	/* -1 is not mentioned */
+	int q[N];
+	std::fill(q, q + N, -1);
+	int wildcard = -1;
+
+	while (!header.empty()) {
+		const size_t end = std::min(header.find(','), header.size());
+		const auto element = header.substr(0, end);
+		header.remove_prefix(std::min(end + 1, header.size()));
+
+		const size_t semi = std::min(element.find(';'), element.size());
+		const auto coding = trim(element.substr(0, semi));
+		const int value = qvalue(element.substr(std::min(semi + 1, element.size())));
+		if (coding == "*")
+			wildcard = value;
+		else if (iequals(coding, "br"))
+			q[size_t(Encoding::Brotli)] = value;
+		else if (iequals(coding, "zstd"))
+			q[size_t(Encoding::Zstd)] = value;
+		else if (iequals(coding, "gzip") || iequals(coding, "x-gzip"))
+			q[size_t(Encoding::Gzip)] = value;
+	}
+
+	Encoding best = Encoding::Identity;
+	int best_q = 0;
+	for (size_t i = 1; i < N; i++) {
+		const int value = (q[i] >= 0) ? q[i] : wildcard;
+		if (value > best_q && available(Encoding(i))) {
+			best = Encoding(i);
+			best_q = value;
+		}
+	}
+	return best;
+}
+
+bool Compression::compressible(std::string_view type) noexcept
+{
+	type = trim(type.substr(0, std::min(type.find(';'), type.size())));
+	auto ends_with = [&type] (std::string_view suffix) {
+		return type.size() >= suffix.size()
+			&& iequals(type.substr(type.size() - suffix.size()), suffix);
+	};
+	return (type.size() > 5 && iequals(type.substr(0, 5), "text/"))
+		|| ends_with("json") || ends_with("javascript") || ends_with("xml")
+		|| iequals(type, "application/wasm");
+}
+
+bool Compression::compress(Encoding encoding, Level level, std::string_view input, std::string& out)
+{
+	Compressor compressor(encoding, level);
+	return compressor.write(input.data(), input.size()) && compressor.finish(out);
+}
+
+Compression::Stats Compression::stats() noexcept
+{
+	return {
+		.bodies = stat_bodies.load(std::memory_order_relaxed),
+		.bytes_in = stat_bytes_in.load(std::memory_order_relaxed),
+		.bytes_out = stat_bytes_out.load(std::memory_order_relaxed),
+		.precompressed = stat_precompressed.load(std::memory_order_relaxed),
+		.failed = stat_failed.load(std::memory_order_relaxed),
+	};
+}
+void Compression::count_precompressed() noexcept
+{
+	stat_precompressed.fetch_add(1, std::memory_order_relaxed);
+}
+
+struct Compressor::State
+{
+	Encoding encoding;
+	z_stream zs {};
+#ifdef DVM_BROTLI
+	BrotliEncoderState* br = nullptr;
+#endif
+#ifdef DVM_ZSTD
+	ZSTD_CCtx* zstd = nullptr;
+#endif
+	std::string out;
+
+	bool init(Compression::Level);
+	bool write(const uint8_t* data, size_t len, bool finish);
+	~State();
+};
+
+bool Compressor::State::init(Compression::Level level)
+{
+	const bool best = (level == Compression::Level::Best);
+	switch (encoding) {
+	case Encoding::Gzip:
+		/* 16 + window bits selects the gzip wrapper */
+		return deflateInit2(&zs, best ? 9 : 4, Z_DEFLATED, 16 + 15, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+#ifdef DVM_BROTLI
+	case Encoding::Brotli:
+		/* Quality 11 is too slow even for once per program */
+		br = BrotliEncoderCreateInstance(nullptr, nullptr, nullptr);
+		return br != nullptr
+			&& BrotliEncoderSetParameter(br, BROTLI_PARAM_QUALITY, best ? 9 : 4);
+#endif
+#ifdef DVM_ZSTD
+	case Encoding::Zstd:
+		zstd = ZSTD_createCCtx();
+		return zstd != nullptr
+			&& !ZSTD_isError(ZSTD_CCtx_setParameter(zstd, ZSTD_c_compressionLevel, best ? 19 : 3));
+#endif
+	default:
+		return false;
+	}
+}
+
+bool Compressor::State::write(const uint8_t* data, size_t len, bool finish)
+{
+	switch (encoding) {
+	case Encoding::Gzip: {
+		zs.next_in = const_cast<uint8_t*>(data);
+		zs.avail_in = len;
+		const int flush = finish ? Z_FINISH : Z_NO_FLUSH;
+		int ret;
+		do {
+			const size_t size = out.size();
+			out.resize(size + CHUNK);
+			zs.next_out = (uint8_t*) &out[size];
+			zs.avail_out = CHUNK;
+			ret = deflate(&zs, flush);
+			out.resize(size + CHUNK - zs.avail_out);
+			if (ret == Z_STREAM_ERROR)
+				return false;
+		} while (zs.avail_out == 0 || zs.avail_in > 0);
+		return !finish || ret == Z_STREAM_END;
+	}
+#ifdef DVM_BROTLI
+	case Encoding::Brotli: {
+		const auto op = finish ? BROTLI_OPERATION_FINISH : BROTLI_OPERATION_PROCESS;
+		size_t avail_in = len;
+		const uint8_t* next_in = data;
+		do {
+			size_t avail_out = 0;
+			if (!BrotliEncoderCompressStream(br, op, &avail_in, &next_in, &avail_out, nullptr, nullptr))
+				return false;
+			size_t size = 0;
+			const uint8_t* output = BrotliEncoderTakeOutput(br, &size);
+			out.append((const char*) output, size);
+		} while (avail_in > 0 || BrotliEncoderHasMoreOutput(br)
+			|| (finish && !BrotliEncoderIsFinished(br)));
+		return true;
+	}
+#endif
+#ifdef DVM_ZSTD
+	case Encoding::Zstd: {
+		ZSTD_inBuffer input { data, len, 0 };
+		const auto mode = finish ? ZSTD_e_end : ZSTD_e_continue;
+		size_t remaining;
+		do {
+			const size_t size = out.size();
+			out.resize(size + CHUNK);
+			ZSTD_outBuffer output { &out[size], CHUNK, 0 };
+			remaining = ZSTD_compressStream2(zstd, &output, &input, mode);
+			out.resize(size + output.pos);
+			if (ZSTD_isError(remaining))
+				return false;
+		} while (input.pos < input.size || (finish && remaining != 0));
+		return true;
+	}
+#endif
+	default:
+		return false;
+	}
+}
+
+Compressor::State::~State()
+{
+	if (encoding == Encoding::Gzip)
+		deflateEnd(&zs);
+#ifdef DVM_BROTLI
+	if (br != nullptr)
+		BrotliEncoderDestroyInstance(br);
+#endif
+#ifdef DVM_ZSTD
+	if (zstd != nullptr)
+		ZSTD_freeCCtx(zstd);
+#endif
+}
+
+Compressor::Compressor(Encoding encoding, Compression::Level level)
+	: m_state{new State}
+{
+	m_state->encoding = encoding;
+	if (!Compression::available(encoding) || !m_state->init(level)) {
+		m_state = nullptr;
+		stat_failed.fetch_add(1, std::memory_order_relaxed);
+	}
+}
+Compressor::~Compressor() {}
+
+bool Compressor::write(const void* data, size_t len)
+{
+	if (m_state == nullptr)
+		return false;
+	m_input += len;
+	if (!m_state->write((const uint8_t*) data, len, false)) {
+		m_state = nullptr;
+		stat_failed.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+	return true;
+}
+
+bool Compressor::finish(std::string& out)
+{
+	if (m_state == nullptr || !m_state->write(nullptr, 0, true)) {
+		if (m_state != nullptr)
+			stat_failed.fetch_add(1, std::memory_order_relaxed);
+		m_state = nullptr;
+		return false;
+	}
+	out = std::move(m_state->out);
+	m_state = nullptr;
+	stat_bodies.fetch_add(1, std::memory_order_relaxed);
+	stat_bytes_in.fetch_add(m_input, std::memory_order_relaxed);
+	stat_bytes_out.fetch_add(out.size(), std::memory_order_relaxed);
+	return true;
+}
+
+PrecompressedBodies::Body PrecompressedBodies::get(uint64_t addr, size_t len, Encoding encoding) const
+{
+	std::lock_guard<std::mutex> lock(m_mtx);
+	auto it = m_bodies.find({addr, len, encoding});
+	return (it != m_bodies.end()) ? it->second : nullptr;
+}
+
+bool PrecompressedBodies::has_room(size_t len) const
+{
+	std::lock_guard<std::mutex> lock(m_mtx);
+	return m_bytes + len <= MAX_BYTES;
+}
+
+PrecompressedBodies::Body PrecompressedBodies::insert(uint64_t addr, size_t len,
+	Encoding encoding, std::string compressed)
+{
+	auto body = std::make_shared<const std::string>(std::move(compressed));
+	std::lock_guard<std::mutex> lock(m_mtx);
+	auto it = m_bodies.find({addr, len, encoding});
+	if (it != m_bodies.end())
+		return it->second;
+	if (m_bytes + body->size() <= MAX_BYTES) {
+		m_bytes += body->size();
+		m_bodies.emplace(Key{addr, len, encoding}, body);
+	}
+	return body;
+}
@@ -0,0 +1,132 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+/* Content codings, in the order they are preferred on equal q-values */
+enum class Encoding : uint8_t {
+	Identity = 0,
+	Brotli,
+	Zstd,
+	Gzip,
+	Count
+};
+
+/**
+ * Native compression of response bodies and guest buffers.
+ *
+ * gzip is always available through zlib. Brotli and zstd are compiled
+ * in when their libraries were found (DVM_BROTLI, DVM_ZSTD). Whatever
+ * zlib is linked decides how fast gzip is; zlib-ng in compat mode has
+ * SIMD deflate and CRC.
+ *
+ * Responses are compressed at a fast level, as it happens on every
+ * request. Bodies that are compressed once and then reused, like the
+ * precompressed pages of a program, use the best level instead.
+**/
+class Compression
+{
+public:
+	enum class Level { Fast, Best };
+
+	struct Config {
+		/* Smaller bodies are sent as they are */
+		size_t min_length = 1024;
+	};
+	static void configure(const Config&);
+	static size_t min_length() noexcept;
+
+	static bool available(Encoding) noexcept;
+	/* The token used in Content-Encoding, like "br" */
+	static const char* name(Encoding) noexcept;
+	/* The best available encoding allowed by an Accept-Encoding
+	   header, by q-value. Identity when there is none. */
+	static Encoding negotiate(std::string_view accept_encoding) noexcept;
+	/* Text, JSON, JavaScript, XML, SVG and WebAssembly */
+	static bool compressible(std::string_view content_type) noexcept;
+
+	/* Compresses one body, returns false if the encoding is not
+	   available or the compressor failed */
+	static bool compress(Encoding, Level, std::string_view input, std::string& out);
+
+	struct Stats {
+		uint64_t bodies;
+		uint64_t bytes_in;
+		uint64_t bytes_out;
+		uint64_t precompressed; /* Responses served from PrecompressedBodies */
+		uint64_t failed;
+	};
+	static Stats stats() noexcept;
+	static void count_precompressed() noexcept;
+};
+
+/**
+ * Streaming compressor, for bodies that are gathered from several
+ * buffers, like guest memory. Feed it with write(), and finish() once.
+**/
+class Compressor
+{
+public:
+	Compressor(Encoding, Compression::Level);
+	~Compressor();
+
+	bool write(const void* data, size_t len);
+	/* Appends the remaining output, and returns the whole */
+	bool finish(std::string& out);
+	bool ok() const noexcept { return m_state != nullptr; }
+
+private:
+	struct State;
+	std::unique_ptr<State> m_state;
+	size_t m_input = 0;
+};
+
+/**
+ * Compressed copies of the static response bodies of one program.
+ *
+ * A body is static when it lies in pages that the fork shares with
+ * the main VM, which doesn't change after initialization. The same
+ * address and length then always hold the same bytes, for as long as
+ * the program lives, and every fork can be served the same compressed
+ * copy. Concurrent first requests may each compress the body, and the
+ * first copy to be inserted is kept.
+ *
+ * The best level is only worth its time for bodies that are kept, and
+ * it runs on the IO thread of the first request, so larger bodies are
+ * compressed at the fast level even when they are kept.
+**/
+class PrecompressedBodies
+{
+public:
+	using Body = std::shared_ptr<const std::string>;
+	static constexpr size_t MAX_BYTES = 16ul << 20;
+	static constexpr size_t MAX_BEST_LENGTH = 256ul << 10;
+
+	Body get(uint64_t addr, size_t len, Encoding) const;
+	/* Whether a body of len bytes would be kept, compressed or not */
+	bool has_room(size_t len) const;
+	/* Returns the copy that is kept, which may be another one. Bodies
+	   are not kept once the program has used up its share. */
+	Body insert(uint64_t addr, size_t len, Encoding, std::string compressed);
+
+private:
+	struct Key {
+		uint64_t addr;
+		size_t len;
+		Encoding encoding;
+		bool operator==(const Key& other) const noexcept {
+			return addr == other.addr && len == other.len && encoding == other.encoding;
+		}
+	};
+	struct KeyHash {
+		size_t operator()(const Key& key) const noexcept {
+			return std::hash<uint64_t>{}(key.addr ^ (uint64_t(key.len) << 24) ^ uint64_t(key.encoding));
+		}
+	};
+	mutable std::mutex m_mtx;
+	std::unordered_map<Key, Body, KeyHash> m_bodies;
+	size_t m_bytes = 0;
+};
@@ -0,0 +1,176 @@
+#include "cpu_governor.hpp"
+
+#include <algorithm>
+#include <mutex>
+#include <unordered_map>
+#include "metrics.hpp"
+
+/* Leases are this fraction of the rate per second */
+static constexpr int64_t LEASE_DIVISOR = 64;
+/* How often the buckets are refilled, at most */
+static constexpr double REFILL_INTERVAL = 0.001;
+
+static std::mutex limits_mtx;
+/* Governors are identified by a number that is never reused,
+   so that stale thread-local leases can never be found again. */
+static std::atomic<uint64_t> governor_counter { 1 };
+
+struct CpuGovernor::Lease
+{
+	uint64_t generation = 0;
+	std::array<int64_t, RESOURCES> balance {};
+};
+
+CpuGovernor::CpuGovernor(const Limits& limits)
+	: m_id{governor_counter.fetch_add(1, std::memory_order_relaxed)},
+	  m_alive{std::make_shared<const bool>(true)}
+{
+	this->set_limits(limits);
+}
+CpuGovernor::~CpuGovernor()
+{
+}
+
+void CpuGovernor::set_limits(const Limits& limits)
+{
+	std::lock_guard<std::mutex> lock(limits_mtx);
+	m_limits = limits;
+	const bool limited = limits.instructions_per_sec > 0 || limits.cpu_us_per_sec > 0;
+	/* Measuring the tick rate can take a moment, so only when needed */
+	const double spt = limited ? metrics::seconds_per_tick() : 0.0;
+	const int64_t rates[RESOURCES] = {
+		(int64_t) limits.instructions_per_sec,
+		limited ? int64_t(limits.cpu_us_per_sec * 1e-6 / spt) : 0,
+	};
+	for (int r = 0; r < RESOURCES; r++) {
+		const int64_t lease = std::max<int64_t>(rates[r] / LEASE_DIVISOR, 1);
+		const int64_t capacity = std::max<int64_t>(rates[r] * limits.burst, lease);
+		m_rate[r].store(rates[r], std::memory_order_relaxed);
+		m_lease_size[r].store(lease, std::memory_order_relaxed);
+		m_capacity[r].store(capacity, std::memory_order_relaxed);
+		m_tokens[r].store(capacity, std::memory_order_relaxed);
+	}
+	m_seconds_per_tick.store(spt, std::memory_order_relaxed);
+	m_refill_ticks.store(limited ? uint64_t(REFILL_INTERVAL / spt) : 0, std::memory_order_relaxed);
+	m_last_refill.store(metrics::now(), std::memory_order_relaxed);
+
+	const uint64_t generation = (m_generation.load(std::memory_order_relaxed) | 1) + 1;
+	m_generation.store(generation | (limited ? 1 : 0), std::memory_order_release);
+}
+
+CpuGovernor::Limits CpuGovernor::limits() const
+{
+	std::lock_guard<std::mutex> lock(limits_mtx);
+	return m_limits;
+}
+
+CpuGovernor::Lease& CpuGovernor::local() noexcept
+{
+	struct Local {
+		std::weak_ptr<const bool> alive;
+		Lease lease;
+	};
+	static thread_local std::unordered_map<uint64_t, Local> leases;
+	static thread_local size_t sweep_at = 64;
+
+	auto it = leases.find(m_id);
+	if (it != leases.end())
+		return it->second.lease;
+	/* Sweeping whenever the map has doubled keeps it in proportion
+	   to the governors that are alive, at a constant cost per lease */
+	if (leases.size() >= sweep_at) {
+		for (auto entry = leases.begin(); entry != leases.end(); ) {
+			if (entry->second.alive.expired()) entry = leases.erase(entry);
+			else ++entry;
+		}
+		sweep_at = std::max<size_t>(64, 2 * leases.size());
+	}
+	return leases.emplace(m_id, Local{m_alive, {}}).first->second.lease;
+}
+
+void CpuGovernor::refill() noexcept
+{
+	const uint64_t now = metrics::now();
+	uint64_t last = m_last_refill.load(std::memory_order_relaxed);
+	if (now - last < m_refill_ticks.load(std::memory_order_relaxed))
+		return;
+	/* Whoever moves the refill time forward does the refill */
+	if (!m_last_refill.compare_exchange_strong(last, now, std::memory_order_relaxed))
+		return;
+
+	const double seconds = (now - last) * m_seconds_per_tick.load(std::memory_order_relaxed);
+	for (int r = 0; r < RESOURCES; r++) {
+		const int64_t add = m_rate[r].load(std::memory_order_relaxed) * seconds;
+		const int64_t capacity = m_capacity[r].load(std::memory_order_relaxed);
+		int64_t tokens = m_tokens[r].load(std::memory_order_relaxed);
+		while (!m_tokens[r].compare_exchange_weak(tokens,
+			std::min(tokens + add, capacity), std::memory_order_relaxed));
+	}
+}
+
+bool CpuGovernor::take_lease(Lease& lease, int r) noexcept
+{
+	this->refill();
+	/* Pay back the debt, and take a new lease on top */
+	const int64_t need = m_lease_size[r].load(std::memory_order_relaxed) - lease.balance[r];
+	int64_t tokens = m_tokens[r].load(std::memory_order_relaxed);
+	while (tokens > 0) {
+		const int64_t take = std::min(tokens, need);
+		if (m_tokens[r].compare_exchange_weak(tokens, tokens - take,
+			std::memory_order_relaxed))
+		{
+			lease.balance[r] += take;
+			return lease.balance[r] > 0;
+		}
+	}
+	return false;
+}
+
+bool CpuGovernor::admit() noexcept
+{
+	const uint64_t generation = m_generation.load(std::memory_order_acquire);
+	if (!(generation & 1))
+		return true;
+
+	auto& lease = this->local();
+	if (lease.generation != generation) {
+		lease.generation = generation;
+		lease.balance = {};
+	}
+	for (int r = 0; r < RESOURCES; r++) {
+		if (lease.balance[r] > 0 || m_rate[r].load(std::memory_order_relaxed) == 0)
+			continue;
+		if (!this->take_lease(lease, r)) {
+			m_rejected.fetch_add(1, std::memory_order_relaxed);
+			return false;
+		}
+	}
+	return true;
+}
+
+void CpuGovernor::charge(uint64_t instructions, uint64_t ticks) noexcept
+{
+	const uint64_t generation = m_generation.load(std::memory_order_acquire);
+	if (!(generation & 1))
+		return;
+	auto& lease = this->local();
+	/* Requests admitted under older limits are not charged */
+	if (lease.generation != generation)
+		return;
+	lease.balance[INSTRUCTIONS] -= instructions;
+	lease.balance[TICKS] -= ticks;
+}
+
+double CpuGovernor::retry_after() noexcept
+{
+	const auto& lease = this->local();
+	double seconds = 0.0;
+	for (int r = 0; r < RESOURCES; r++) {
+		const int64_t rate = m_rate[r].load(std::memory_order_relaxed);
+		if (rate == 0 || lease.balance[r] > 0)
+			continue;
+		const int64_t need = m_lease_size[r].load(std::memory_order_relaxed) - lease.balance[r];
+		seconds = std::max(seconds, double(need) / rate);
+	}
+	return seconds;
+}
@@ -0,0 +1,69 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+/**
+ * Per-tenant CPU budget, as token buckets of instructions retired and
+ * of time spent forking and executing, refilled every second.
+ *
+ * The buckets are shared by every thread, but threads take tokens out
+ * in leases and charge requests against their own lease, so that the
+ * shared atomics are only touched about once per lease. A thread that
+ * has run its lease into debt cannot admit requests for the tenant
+ * until the bucket has refilled enough to cover the debt, which makes
+ * over-budget tenants fail fast before anything is forked.
+ *
+ * Limits can be changed at any time, and leases taken under the old
+ * limits are dropped. A rate of zero means unlimited. Threads forget
+ * the leases of destroyed governors the next time their map grows.
+**/
+class CpuGovernor
+{
+public:
+	struct Limits {
+		uint64_t instructions_per_sec = 0;
+		uint64_t cpu_us_per_sec = 0;
+		/* Seconds of budget that can be saved up for bursts */
+		double   burst = 1.0;
+	};
+	void set_limits(const Limits&);
+	Limits limits() const;
+	bool limited() const noexcept { return m_generation.load(std::memory_order_relaxed) & 1; }
+
+	/* Whether the tenant may run another request on this thread */
+	bool admit() noexcept;
+	/* Charges what a finished request used on this thread */
+	void charge(uint64_t instructions, uint64_t ticks) noexcept;
+	/* Seconds until this thread is likely to admit requests again */
+	double retry_after() noexcept;
+
+	uint64_t rejected() const noexcept { return m_rejected.load(std::memory_order_relaxed); }
+
+	CpuGovernor(const Limits&);
+	~CpuGovernor();
+
+	enum Resource { INSTRUCTIONS, TICKS, RESOURCES };
+	struct Lease;
+private:
+	Lease& local() noexcept;
+	bool take_lease(Lease&, int resource) noexcept;
+	void refill() noexcept;
+
+	const uint64_t m_id;
+	/* Threads keep weak references, to tell when the governor is gone */
+	const std::shared_ptr<const bool> m_alive;
+	Limits m_limits;
+	/* Odd while limited. Bumped on every change of limits. */
+	std::atomic<uint64_t> m_generation { 0 };
+	std::array<std::atomic<int64_t>, RESOURCES> m_rate {};
+	std::array<std::atomic<int64_t>, RESOURCES> m_capacity {};
+	std::array<std::atomic<int64_t>, RESOURCES> m_lease_size {};
+	std::atomic<double>   m_seconds_per_tick { 0.0 };
+	std::atomic<uint64_t> m_refill_ticks { 0 };
+
+	alignas(64) std::array<std::atomic<int64_t>, RESOURCES> m_tokens {};
+	std::atomic<uint64_t> m_last_refill { 0 };
+	alignas(64) std::atomic<uint64_t> m_rejected { 0 };
+};
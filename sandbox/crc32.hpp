@@ -1,7 +1,25 @@
+#pragma once
 #include <array>
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
+#if defined(__x86_64__) && defined(__SSE4_2__)
+#include <nmmintrin.h>
+#endif
+#if defined(__x86_64__) && defined(__PCLMUL__) && defined(__SSE4_1__)
+#include <smmintrin.h>
+#include <wmmintrin.h>
+#endif
 
+/**
+ * CRC-32 of any reflected polynomial, 0xEDB88320 (zlib) by default
+ * and 0x82F63B78 (Castagnoli, CRC32C) being the common ones.
+ *
+ * In constant expressions a byte-at-a-time table is used. At runtime,
+ * CRC32C uses the SSE4.2 instruction, zlib's polynomial folds 64 bytes
+ * at a time with PCLMULQDQ, and everything else, including the guest,
+ * uses slicing-by-8. Passing a previous result continues from it.
+**/
 template <uint32_t POLYNOMIAL>
 inline constexpr auto gen_crc32_table()
 {
@@ -21,6 +39,138 @@ inline constexpr auto gen_crc32_table()
     return crc32_table;
 }
 
+/* Table k gives the CRC of a byte followed by k zero bytes */
+template <uint32_t POLYNOMIAL>
+inline constexpr auto gen_crc32_slices()
+{
+	auto slices = std::array<std::array<uint32_t, 256>, 8> {};
+	slices[0] = gen_crc32_table<POLYNOMIAL>();
+	for (auto k = 1u; k < slices.size(); ++k) {
+		for (auto byte = 0u; byte < 256; ++byte) {
+			const auto prev = slices[k-1][byte];
+			slices[k][byte] = (prev >> 8) ^ slices[0][prev & 0xFF];
+		}
+	}
+	return slices;
+}
+template <uint32_t POLYNOMIAL>
+inline constexpr auto crc32_slices = gen_crc32_slices<POLYNOMIAL>();
+
+namespace crc32_detail
+{
+	/* Both x86 and RISC-V are little-endian */
+	inline uint32_t load32(const uint8_t* data) {
+		uint32_t value;
+		std::memcpy(&value, data, sizeof(value));
+		return value;
+	}
+
+	template <uint32_t POLYNOMIAL>
+	inline uint32_t slice8(uint32_t crc, const uint8_t* data, size_t len)
+	{
+		const auto& t = crc32_slices<POLYNOMIAL>;
+		for (; len >= 8; data += 8, len -= 8) {
+			const uint32_t lo = load32(data) ^ crc;
+			const uint32_t hi = load32(data + 4);
+			crc = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF]
+				^ t[5][(lo >> 16) & 0xFF] ^ t[4][lo >> 24]
+				^ t[3][hi & 0xFF] ^ t[2][(hi >> 8) & 0xFF]
+				^ t[1][(hi >> 16) & 0xFF] ^ t[0][hi >> 24];
+		}
+		for (; len > 0; data++, len--)
+			crc = t[0][(crc ^ *data) & 0xFF] ^ (crc >> 8);
+		return crc;
+	}
+
+#if defined(__x86_64__) && defined(__SSE4_2__)
+	inline uint32_t crc32c_sse42(uint32_t crc, const uint8_t* data, size_t len)
+	{
+		uint64_t crc64 = crc;
+		for (; len >= 8; data += 8, len -= 8) {
+			uint64_t value;
+			std::memcpy(&value, data, sizeof(value));
+			crc64 = _mm_crc32_u64(crc64, value);
+		}
+		crc = crc64;
+		for (; len > 0; data++, len--)
+			crc = _mm_crc32_u8(crc, *data);
+		return crc;
+	}
+#endif
+
+#if defined(__x86_64__) && defined(__PCLMUL__) && defined(__SSE4_1__)
+	/* Folding with carry-less multiplication, from Intel's "Fast CRC
+	   Computation for Generic Polynomials Using PCLMULQDQ". Takes at
+	   least 64 bytes, a multiple of 16, and returns the running CRC. */
+	inline uint32_t crc32_pclmul(uint32_t crc, const uint8_t* data, size_t len)
+	{
+		const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+		const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+		const __m128i k5k0 = _mm_set_epi64x(0, 0x0163cd6124);
+		const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+		const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+		auto load = [] (const uint8_t* p) { return _mm_loadu_si128((const __m128i*) p); };
+		auto fold = [] (__m128i x, __m128i k, __m128i next) {
+			const __m128i lo = _mm_clmulepi64_si128(x, k, 0x00);
+			const __m128i hi = _mm_clmulepi64_si128(x, k, 0x11);
+			return _mm_xor_si128(_mm_xor_si128(hi, lo), next);
+		};
+
+		__m128i x1 = _mm_xor_si128(load(data), _mm_cvtsi32_si128(crc));
+		__m128i x2 = load(data + 16);
+		__m128i x3 = load(data + 32);
+		__m128i x4 = load(data + 48);
+		for (data += 64, len -= 64; len >= 64; data += 64, len -= 64) {
+			x1 = fold(x1, k1k2, load(data));
+			x2 = fold(x2, k1k2, load(data + 16));
+			x3 = fold(x3, k1k2, load(data + 32));
+			x4 = fold(x4, k1k2, load(data + 48));
+		}
+		/* Fold the four lanes into one, then the remaining blocks */
+		x1 = fold(x1, k3k4, x2);
+		x1 = fold(x1, k3k4, x3);
+		x1 = fold(x1, k3k4, x4);
+		for (; len >= 16; data += 16, len -= 16)
+			x1 = fold(x1, k3k4, load(data));
+
+		/* 128 bits down to 64 bits */
+		__m128i x2r = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+		x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2r);
+		x2r = _mm_srli_si128(x1, 4);
+		x1 = _mm_and_si128(x1, mask32);
+		x1 = _mm_xor_si128(_mm_clmulepi64_si128(x1, k5k0, 0x00), x2r);
+		/* Barrett reduction to 32 bits */
+		x2r = _mm_and_si128(x1, mask32);
+		x2r = _mm_clmulepi64_si128(x2r, poly, 0x10);
+		x2r = _mm_and_si128(x2r, mask32);
+		x2r = _mm_clmulepi64_si128(x2r, poly, 0x00);
+		x1 = _mm_xor_si128(x1, x2r);
+		return _mm_extract_epi32(x1, 1);
+	}
+#endif
+
+	/* The running CRC, which is the complement of the result */
+	template <uint32_t POLYNOMIAL>
+	inline uint32_t update(uint32_t crc, const uint8_t* data, size_t len)
+	{
+#if defined(__x86_64__) && defined(__SSE4_2__)
+		if constexpr (POLYNOMIAL == 0x82F63B78)
+			return crc32c_sse42(crc, data, len);
+#endif
+#if defined(__x86_64__) && defined(__PCLMUL__) && defined(__SSE4_1__)
+		if constexpr (POLYNOMIAL == 0xEDB88320) {
+			if (len >= 64) {
+				const size_t blocks = len & ~size_t(15);
+				crc = crc32_pclmul(crc, data, blocks);
+				data += blocks;
+				len -= blocks;
+			}
+		}
+#endif
+		return slice8<POLYNOMIAL>(crc, data, len);
+	}
+}
+
 template <uint32_t POLYNOMIAL = 0xEDB88320>
 inline constexpr auto crc32(const char* data)
 {
@@ -34,14 +184,24 @@ inline constexpr auto crc32(const char* data)
 }
 
 template <uint32_t POLYNOMIAL = 0xEDB88320>
-inline constexpr auto crc32(const void* vdata, const size_t len)
+inline constexpr uint32_t crc32(const char* data, const size_t len, uint32_t prev = 0)
 {
+	if (!__builtin_is_constant_evaluated())
+		return ~crc32_detail::update<POLYNOMIAL>(~prev, (const uint8_t*) data, len);
+
 	constexpr auto crc32_table = gen_crc32_table<POLYNOMIAL>();
+	auto crc = ~prev;
+	for (auto i = 0u; i < len; ++i) {
+		crc = crc32_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+	}
+	return ~crc;
+}
 
-	auto* data = (const uint8_t*) vdata;
-    auto crc = 0xFFFFFFFFu;
-    for (auto i = 0u; i < len; ++i) {
-        crc = crc32_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
-    }
-    return ~crc;
-}
\ No newline at end of file
+template <uint32_t POLYNOMIAL = 0xEDB88320>
+inline uint32_t crc32(const void* data, const size_t len, uint32_t prev = 0)
+{
+	return ~crc32_detail::update<POLYNOMIAL>(~prev, (const uint8_t*) data, len);
+}
+
+static_assert(crc32("123456789", 9) == 0xCBF43926);
+static_assert(crc32<0x82F63B78>("123456789", 9) == 0xE3069283);
@@ -0,0 +1,250 @@
+#include "kv_store.hpp"
+
+#include <charconv>
+#include <cstring>
+#include <functional>
+#include <new>
+#include <vector>
+
+static constexpr size_t INITIAL_BUCKETS = 16;
+
+KVStore::Entry* KVStore::Entry::create(uint64_t hash, std::string_view key, std::string_view value)
+{
+	void* memory = ::operator new(sizeof(Entry) + key.size() + value.size());
+	auto* entry = new (memory) Entry;
+	entry->hash = hash;
+	entry->key_len = key.size();
+	entry->value_len = value.size();
+	char* data = (char*)(entry + 1);
+	std::memcpy(data, key.data(), key.size());
+	std::memcpy(data + key.size(), value.data(), value.size());
+	return entry;
+}
+void KVStore::Entry::destroy(Entry* entry) noexcept
+{
+	entry->~Entry();
+	::operator delete(entry);
+}
+
+uint64_t KVStore::hash(std::string_view key) noexcept
+{
+	return std::hash<std::string_view>{}(key);
+}
+
+KVStore::KVStore(size_t max_bytes)
+	: m_max_bytes(max_bytes)
+{
+}
+
+KVStore::~KVStore()
+{
+	rcu::Domain* domain = m_rcu.load(std::memory_order_relaxed);
+	if (domain == nullptr)
+		return;
+	domain->synchronize();
+	delete domain;
+	for (auto& shard : m_shards) {
+		Table* table = shard.table.load(std::memory_order_relaxed);
+		if (table == nullptr)
+			continue;
+		for (size_t i = 0; i <= table->mask; i++) {
+			Entry* entry = table->buckets[i].load(std::memory_order_relaxed);
+			while (entry != nullptr) {
+				Entry* next = entry->next.load(std::memory_order_relaxed);
+				Entry::destroy(entry);
+				entry = next;
+			}
+		}
+		delete table;
+	}
+}
+
+rcu::Domain& KVStore::domain()
+{
+	rcu::Domain* domain = m_rcu.load(std::memory_order_acquire);
+	if (domain != nullptr)
+		return *domain;
+	auto* created = new rcu::Domain;
+	if (m_rcu.compare_exchange_strong(domain, created, std::memory_order_acq_rel))
+		return *created;
+	delete created;
+	return *domain;
+}
+
+const KVStore::Entry* KVStore::find(const Shard& shard, uint64_t hash, std::string_view key) const noexcept
+{
+	Table* table = shard.table.load(std::memory_order_acquire);
+	if (table == nullptr)
+		return nullptr;
+	const Entry* entry = table->bucket(hash).load(std::memory_order_acquire);
+	for (; entry != nullptr; entry = entry->next.load(std::memory_order_acquire)) {
+		if (entry->hash == hash && entry->key() == key)
+			return entry;
+	}
+	return nullptr;
+}
+
+bool KVStore::replace(Shard& shard, uint64_t hash, std::string_view key, Entry* entry)
+{
+	Table* table = shard.table.load(std::memory_order_relaxed);
+	if (table == nullptr) {
+		if (entry == nullptr)
+			return false;
+		table = new Table(INITIAL_BUCKETS);
+		shard.table.store(table, std::memory_order_release);
+	}
+	/* Find the link that points to the current entry, if any */
+	std::atomic<Entry*>* link = &table->bucket(hash);
+	Entry* old = link->load(std::memory_order_relaxed);
+	for (; old != nullptr; old = link->load(std::memory_order_relaxed)) {
+		if (old->hash == hash && old->key() == key)
+			break;
+		link = &old->next;
+	}
+	if (old == nullptr && entry == nullptr)
+		return false;
+
+	const size_t added = (entry != nullptr) ? entry->bytes() : 0;
+	const size_t removed = (old != nullptr) ? old->bytes() : 0;
+	if (added > removed) {
+		size_t bytes = m_bytes.load(std::memory_order_relaxed);
+		do {
+			if (bytes + added - removed > m_max_bytes) {
+				m_rejected.fetch_add(1, std::memory_order_relaxed);
+				Entry::destroy(entry);
+				return false;
+			}
+		} while (!m_bytes.compare_exchange_weak(bytes, bytes + added - removed,
+			std::memory_order_relaxed));
+	} else {
+		m_bytes.fetch_sub(removed - added, std::memory_order_relaxed);
+	}
+
+	if (old != nullptr) {
+		/* Readers on the old entry still see the rest of the chain */
+		Entry* next = old->next.load(std::memory_order_relaxed);
+		if (entry != nullptr) {
+			entry->next.store(next, std::memory_order_relaxed);
+			link->store(entry, std::memory_order_release);
+		} else {
+			link->store(next, std::memory_order_release);
+			shard.count.fetch_sub(1, std::memory_order_relaxed);
+		}
+		m_rcu.load(std::memory_order_relaxed)->retire([old] { Entry::destroy(old); });
+		return true;
+	}
+	auto& bucket = table->bucket(hash);
+	entry->next.store(bucket.load(std::memory_order_relaxed), std::memory_order_relaxed);
+	bucket.store(entry, std::memory_order_release);
+	if (shard.count.fetch_add(1, std::memory_order_relaxed) + 1 > table->mask + 1)
+		this->grow(shard);
+	return true;
+}
+
+void KVStore::grow(Shard& shard)
+{
+	/* Chains are linked differently in the new table, so every entry
+	   is copied, and the old table is retired with all its entries. */
+	Table* old = shard.table.load(std::memory_order_relaxed);
+	auto* table = new Table(2 * (old->mask + 1));
+	auto entries = std::make_shared<std::vector<Entry*>>();
+	entries->reserve(shard.count.load(std::memory_order_relaxed));
+	for (size_t i = 0; i <= old->mask; i++) {
+		Entry* entry = old->buckets[i].load(std::memory_order_relaxed);
+		for (; entry != nullptr; entry = entry->next.load(std::memory_order_relaxed)) {
+			Entry* copy = Entry::create(entry->hash, entry->key(), entry->value());
+			auto& bucket = table->bucket(entry->hash);
+			copy->next.store(bucket.load(std::memory_order_relaxed), std::memory_order_relaxed);
+			bucket.store(copy, std::memory_order_relaxed);
+			entries->push_back(entry);
+		}
+	}
+	shard.table.store(table, std::memory_order_release);
+	m_rcu.load(std::memory_order_relaxed)->retire([old, entries] {
+		for (Entry* entry : *entries)
+			Entry::destroy(entry);
+		delete old;
+	});
+}
+
+bool KVStore::set(std::string_view key, std::string_view value)
+{
+	if (key.size() > MAX_KEY || value.size() > MAX_VALUE)
+		return false;
+	if (m_max_bytes == 0) {
+		m_rejected.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+	auto& domain = this->domain();
+	const uint64_t h = hash(key);
+	Entry* entry = Entry::create(h, key, value);
+	Shard& shard = shard_for(h);
+	bool result;
+	{
+		std::lock_guard<std::mutex> lock(shard.mtx);
+		result = this->replace(shard, h, key, entry);
+	}
+	domain.reclaim();
+	return result;
+}
+
+bool KVStore::erase(std::string_view key)
+{
+	/* Nothing has been written yet */
+	rcu::Domain* domain = m_rcu.load(std::memory_order_acquire);
+	if (domain == nullptr)
+		return false;
+	const uint64_t h = hash(key);
+	Shard& shard = shard_for(h);
+	bool result;
+	{
+		std::lock_guard<std::mutex> lock(shard.mtx);
+		result = this->replace(shard, h, key, nullptr);
+	}
+	domain->reclaim();
+	return result;
+}
+
+std::optional<int64_t> KVStore::increment(std::string_view key, int64_t delta)
+{
+	if (key.size() > MAX_KEY)
+		return std::nullopt;
+	if (m_max_bytes == 0) {
+		m_rejected.fetch_add(1, std::memory_order_relaxed);
+		return std::nullopt;
+	}
+	auto& domain = this->domain();
+	const uint64_t h = hash(key);
+	Shard& shard = shard_for(h);
+	int64_t value = 0;
+	bool result;
+	{
+		/* Other writers are locked out, so the entry stays current */
+		std::lock_guard<std::mutex> lock(shard.mtx);
+		if (const Entry* entry = find(shard, h, key); entry != nullptr) {
+			const auto old = entry->value();
+			std::from_chars(old.data(), old.data() + old.size(), value);
+		}
+		value = int64_t(uint64_t(value) + uint64_t(delta));
+		char buffer[24];
+		const auto end = std::to_chars(buffer, buffer + sizeof(buffer), value).ptr;
+		Entry* entry = Entry::create(h, key, {buffer, size_t(end - buffer)});
+		result = this->replace(shard, h, key, entry);
+	}
+	domain.reclaim();
+	if (!result)
+		return std::nullopt;
+	return value;
+}
+
+KVStore::Stats KVStore::stats() const noexcept
+{
+	uint64_t keys = 0;
+	for (const auto& shard : m_shards)
+		keys += shard.count.load(std::memory_order_relaxed);
+	return {
+		.keys  = keys,
+		.bytes = m_bytes.load(std::memory_order_relaxed),
+		.rejected = m_rejected.load(std::memory_order_relaxed),
+	};
+}
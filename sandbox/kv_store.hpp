@@ -0,0 +1,124 @@
+#pragma once
+#include "rcu.hpp"
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string_view>
+
+/**
+ * Per-tenant key-value store that outlives the requests, and is only
+ * reachable by the guest through system calls.
+ *
+ * Keys are spread over shards, each a hash table of singly-linked
+ * chains of immutable entries. Readers walk the chains under an RCU
+ * read guard without taking any lock or writing to shared memory.
+ * Writers lock their shard, replace an entry by linking in a new one,
+ * and retire the old entry until no reader can be looking at it. Tables
+ * grow by building a new table and retiring the old one the same way.
+ *
+ * The store is bounded by the tenant's memory budget for it. Writes
+ * that would exceed the budget fail, and nothing is evicted. The RCU
+ * domain has a slot for every thread, so it is only created by the
+ * first write, and never when the store is disabled.
+**/
+class KVStore
+{
+public:
+	static constexpr size_t SHARDS = 16;
+	static constexpr size_t MAX_KEY = 256;
+	static constexpr size_t MAX_VALUE = 65536;
+
+	struct Stats {
+		uint64_t keys;
+		uint64_t bytes;
+		uint64_t rejected; /* Writes over the budget */
+	};
+
+	/* Calls func with the value, which is only valid during the call,
+	   returns false if the key doesn't exist */
+	template <typename Func>
+	bool read(std::string_view key, Func&& func) const;
+
+	/* Returns false if the key or value is too large, or over budget */
+	bool set(std::string_view key, std::string_view value);
+	bool erase(std::string_view key);
+	/* Adds to a decimal integer value, where a missing or non-integer
+	   value counts as 0. Returns the new value, or nothing if over budget. */
+	std::optional<int64_t> increment(std::string_view key, int64_t delta);
+
+	Stats stats() const noexcept;
+
+	/* Zero bytes disables the store */
+	KVStore(size_t max_bytes);
+	~KVStore();
+
+private:
+	struct Entry;
+	struct Table;
+	struct alignas(64) Shard {
+		std::mutex mtx;
+		std::atomic<Table*> table { nullptr };
+		std::atomic<size_t> count { 0 };
+	};
+	static uint64_t hash(std::string_view key) noexcept;
+	Shard& shard_for(uint64_t hash) noexcept { return m_shards[hash % SHARDS]; }
+	const Entry* find(const Shard&, uint64_t hash, std::string_view key) const noexcept;
+	/* Inserts, replaces or (with a null entry) removes, with the shard
+	   locked. Takes ownership of the entry, also when it fails. */
+	bool replace(Shard&, uint64_t hash, std::string_view key, Entry* entry);
+	void grow(Shard&);
+	/* Creates the domain on first use. Writer-side only. */
+	rcu::Domain& domain();
+
+	const size_t m_max_bytes;
+	std::atomic<size_t>   m_bytes { 0 };
+	std::atomic<uint64_t> m_rejected { 0 };
+	/* Readers find nothing until there is a domain */
+	std::atomic<rcu::Domain*> m_rcu { nullptr };
+	std::array<Shard, SHARDS> m_shards;
+};
+
+struct KVStore::Entry
+{
+	std::atomic<Entry*> next { nullptr };
+	uint64_t hash;
+	uint32_t key_len;
+	uint32_t value_len;
+
+	std::string_view key() const noexcept { return {data(), key_len}; }
+	std::string_view value() const noexcept { return {data() + key_len, value_len}; }
+	const char* data() const noexcept { return (const char*)(this + 1); }
+	size_t bytes() const noexcept { return sizeof(Entry) + key_len + value_len; }
+
+	static Entry* create(uint64_t hash, std::string_view key, std::string_view value);
+	static void destroy(Entry*) noexcept;
+};
+
+struct KVStore::Table
+{
+	Table(size_t size) : mask(size - 1), buckets(new std::atomic<Entry*>[size]) {
+		for (size_t i = 0; i < size; i++) buckets[i].store(nullptr, std::memory_order_relaxed);
+	}
+	auto& bucket(uint64_t hash) noexcept { return buckets[(hash / SHARDS) & mask]; }
+
+	const size_t mask;
+	std::unique_ptr<std::atomic<Entry*>[]> buckets;
+};
+
+template <typename Func>
+inline bool KVStore::read(std::string_view key, Func&& func) const
+{
+	rcu::Domain* domain = m_rcu.load(std::memory_order_acquire);
+	if (domain == nullptr)
+		return false;
+	const uint64_t h = hash(key);
+	auto guard = domain->read();
+	const Entry* entry = find(m_shards[h % SHARDS], h, key);
+	if (entry == nullptr)
+		return false;
+	func(entry->value());
+	return true;
+}
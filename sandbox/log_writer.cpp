@@ -0,0 +1,311 @@
+#include "log_writer.hpp"
+#include "machine_instance.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+static uint64_t now_ms() noexcept
+{
+	return std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+LogLimiter::LogLimiter(uint64_t lines_per_sec, uint64_t burst)
+	: m_rate(lines_per_sec),
+	  m_capacity(1000 * std::max(burst, lines_per_sec)),
+	  m_tokens(m_capacity)
+{
+}
+
+bool LogLimiter::take() noexcept
+{
+	if (m_rate == 0)
+		return true;
+	/* One thread per millisecond adds what was earned since the last refill */
+	const uint64_t now = now_ms();
+	uint64_t last = m_last_ms.load(std::memory_order_relaxed);
+	if (now > last && m_last_ms.compare_exchange_strong(last, now,
+		std::memory_order_relaxed))
+	{
+		const int64_t earned = (last == 0) ? m_capacity : (now - last) * m_rate;
+		int64_t tokens = m_tokens.load(std::memory_order_relaxed);
+		while (!m_tokens.compare_exchange_weak(tokens,
+			std::min(tokens + earned, m_capacity), std::memory_order_relaxed));
+	}
+	if (m_tokens.fetch_sub(1000, std::memory_order_relaxed) >= 1000)
+		return true;
+	m_tokens.fetch_add(1000, std::memory_order_relaxed);
+	m_dropped.fetch_add(1, std::memory_order_relaxed);
+	return false;
+}
+
+struct LogWriter::Ring
+{
+	struct Slot {
+		ErrorReport* report;
+		uint16_t length;
+		Stream   stream;
+		char     text[SLOT_SIZE - 11];
+	};
+	std::array<Slot, RING_SLOTS> slots;
+	/* Written by the owning thread */
+	alignas(64) std::atomic<size_t> head { 0 };
+	/* Written by the writer thread */
+	alignas(64) std::atomic<size_t> tail { 0 };
+	std::atomic<bool> abandoned { false };
+};
+static_assert(sizeof(LogWriter::Ring::Slot) == LogWriter::SLOT_SIZE);
+
+static constexpr size_t SLOT_TEXT = sizeof(LogWriter::Ring::Slot::text);
+static_assert(LogWriter::MAX_MESSAGE == LogWriter::MAX_SLOTS_PER_MESSAGE * SLOT_TEXT);
+
+static std::atomic<uint64_t> messages_total { 0 };
+static std::atomic<uint64_t> dropped_total { 0 };
+static std::atomic<uint64_t> reports_total { 0 };
+
+static void format_report(ErrorReport& report, FILE* out)
+{
+	if (report.program != nullptr) {
+		const auto& memory = report.program->script.machine().memory;
+		for (auto& frame : report.frames)
+			frame.symbol = memory.lookup(frame.addr).name;
+	}
+	const auto& pc = report.frames[0];
+	const auto& ra = report.frames[1];
+	const auto& call = report.frames[2];
+
+	if (report.kind == ErrorReport::TIMEOUT) {
+		fprintf(out, "Script hit max instructions for: %s (%s)\n",
+			call.symbol.c_str(), report.tenant.c_str());
+		return;
+	}
+	if (report.kind == ErrorReport::EXCEPTION) {
+		if (report.has_data)
+			fprintf(out, "Script exception: %s (data: 0x%lX)\n",
+				report.message.c_str(), long(report.data));
+		else
+			fprintf(out, "Script exception: %s\n", report.message.c_str());
+		fprintf(out, ">>> Machine registers:\n[PC\t%08lX] %s\n",
+			(long) pc.addr, report.registers.to_string().c_str());
+		fprintf(out, "Program page: %s\n", report.program_page.c_str());
+		fprintf(out, "Stack page: %s\n", report.stack_page.c_str());
+		fprintf(out, "Function call: %s (%s)\n",
+			call.symbol.c_str(), report.tenant.c_str());
+	}
+	fprintf(out, "-> [0] 0x%08lx: %s\n", (long) pc.addr, pc.symbol.c_str());
+	fprintf(out, "-> [1] 0x%08lx: %s\n", (long) ra.addr, ra.symbol.c_str());
+	fprintf(out, "-> [-] 0x%08lx: %s\n", (long) call.addr, call.symbol.c_str());
+}
+
+/**
+ * Owns the rings of every thread, and the thread that drains them.
+ * Idle, the writer backs off to polling every few milliseconds.
+**/
+class Writer
+{
+public:
+	using Ring = LogWriter::Ring;
+	static constexpr unsigned MAX_SLEEP_MS = 8;
+
+	static Writer& get()
+	{
+		static Writer writer;
+		return writer;
+	}
+
+	std::shared_ptr<Ring> attach()
+	{
+		auto ring = std::make_shared<Ring>();
+		std::lock_guard<std::mutex> lock(m_mtx);
+		m_rings.push_back(ring);
+		return ring;
+	}
+
+	void flush()
+	{
+		std::vector<std::pair<std::shared_ptr<Ring>, size_t>> marks;
+		{
+			std::lock_guard<std::mutex> lock(m_mtx);
+			for (const auto& ring : m_rings)
+				marks.emplace_back(ring, ring->head.load(std::memory_order_acquire));
+		}
+		for (const auto& [ring, head] : marks) {
+			while (ring->tail.load(std::memory_order_acquire) < head)
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+	}
+
+	~Writer()
+	{
+		m_running.store(false, std::memory_order_relaxed);
+		m_thread.join();
+		this->drain();
+	}
+
+private:
+	Writer() : m_thread([this] { this->run(); }) {}
+
+	void run()
+	{
+		unsigned sleep_ms = 1;
+		while (m_running.load(std::memory_order_relaxed)) {
+			if (this->drain()) {
+				sleep_ms = 1;
+				continue;
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(sleep_ms));
+			sleep_ms = std::min(sleep_ms * 2, MAX_SLEEP_MS);
+		}
+	}
+
+	bool drain()
+	{
+		bool any = false;
+		bool out = false, err = false;
+		std::lock_guard<std::mutex> lock(m_mtx);
+		for (auto it = m_rings.begin(); it != m_rings.end(); ) {
+			Ring& ring = **it;
+			/* Once abandoned, nothing more can be pushed */
+			const bool abandoned = ring.abandoned.load(std::memory_order_acquire);
+			size_t tail = ring.tail.load(std::memory_order_relaxed);
+			const size_t head = ring.head.load(std::memory_order_acquire);
+			for (; tail != head; tail++) {
+				auto& slot = ring.slots[tail % LogWriter::RING_SLOTS];
+				FILE* file = (slot.stream == LogWriter::ERR) ? stderr : stdout;
+				(slot.stream == LogWriter::ERR ? err : out) = true;
+				if (slot.report != nullptr) {
+					format_report(*slot.report, file);
+					delete slot.report;
+					slot.report = nullptr;
+				} else {
+					fwrite(slot.text, 1, slot.length, file);
+				}
+			}
+			any |= (tail != ring.tail.load(std::memory_order_relaxed));
+			ring.tail.store(tail, std::memory_order_release);
+			if (abandoned)
+				it = m_rings.erase(it);
+			else
+				++it;
+		}
+		if (out) fflush(stdout);
+		if (err) fflush(stderr);
+		return any;
+	}
+
+	std::mutex m_mtx;
+	std::vector<std::shared_ptr<Ring>> m_rings;
+	std::atomic<bool> m_running { true };
+	std::thread m_thread;
+};
+
+static LogWriter::Ring& local_ring()
+{
+	struct Attached {
+		Attached() : ring(Writer::get().attach()) {}
+		~Attached() { ring->abandoned.store(true, std::memory_order_release); }
+		std::shared_ptr<LogWriter::Ring> ring;
+	};
+	static thread_local Attached attached;
+	return *attached.ring;
+}
+
+bool LogWriter::push(Stream stream, std::string_view prefix, std::string_view text,
+	ErrorReport* report) noexcept
+{
+	Ring& ring = local_ring();
+	const size_t total = prefix.size() + text.size();
+	size_t needed = (report != nullptr) ? 1
+		: std::max<size_t>(1, (total + SLOT_TEXT - 1) / SLOT_TEXT);
+	const bool truncated = needed > MAX_SLOTS_PER_MESSAGE;
+	if (truncated)
+		needed = MAX_SLOTS_PER_MESSAGE;
+
+	const size_t head = ring.head.load(std::memory_order_relaxed);
+	if (head + needed - ring.tail.load(std::memory_order_acquire) > RING_SLOTS) {
+		dropped_total.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+
+	if (report != nullptr) {
+		auto& slot = ring.slots[head % RING_SLOTS];
+		slot.report = report;
+		slot.length = 0;
+		slot.stream = stream;
+		reports_total.fetch_add(1, std::memory_order_relaxed);
+	} else {
+		/* Copy the prefix and then the text across the slots */
+		size_t pos = 0;
+		for (size_t i = 0; i < needed; i++) {
+			auto& slot = ring.slots[(head + i) % RING_SLOTS];
+			size_t len = 0;
+			while (len < SLOT_TEXT && pos < total) {
+				const auto& part = (pos < prefix.size()) ? prefix : text;
+				const size_t offset = (pos < prefix.size()) ? pos : pos - prefix.size();
+				const size_t n = std::min(SLOT_TEXT - len, part.size() - offset);
+				std::memcpy(&slot.text[len], &part[offset], n);
+				len += n;
+				pos += n;
+			}
+			slot.report = nullptr;
+			slot.length = len;
+			slot.stream = stream;
+		}
+		if (truncated) {
+			auto& last = ring.slots[(head + needed - 1) % RING_SLOTS];
+			std::memcpy(&last.text[SLOT_TEXT - 4], "...\n", 4);
+		}
+		messages_total.fetch_add(1, std::memory_order_relaxed);
+	}
+	/* Every slot of the message becomes visible at once */
+	ring.head.store(head + needed, std::memory_order_release);
+	return true;
+}
+
+bool LogWriter::write(LogLimiter& limiter, std::string_view name, std::string_view text) noexcept
+{
+	if (!limiter.take())
+		return false;
+	return write(name, text);
+}
+
+bool LogWriter::write(std::string_view name, std::string_view text) noexcept
+{
+	char prefix[128];
+	const int len = snprintf(prefix, sizeof(prefix), ">>> %.*s: ",
+		(int) name.size(), name.data());
+	return push(OUT, {prefix, std::min<size_t>(len, sizeof(prefix) - 1)}, text, nullptr);
+}
+
+bool LogWriter::error(std::string_view text) noexcept
+{
+	return push(ERR, {}, text, nullptr);
+}
+
+bool LogWriter::report(std::unique_ptr<ErrorReport> report) noexcept
+{
+	if (!push(ERR, {}, {}, report.get()))
+		return false;
+	/* Owned by the ring until the writer has formatted it */
+	report.release();
+	return true;
+}
+
+void LogWriter::flush()
+{
+	Writer::get().flush();
+}
+
+LogWriter::Stats LogWriter::stats() noexcept
+{
+	return {
+		.messages = messages_total.load(std::memory_order_relaxed),
+		.dropped  = dropped_total.load(std::memory_order_relaxed),
+		.reports  = reports_total.load(std::memory_order_relaxed),
+	};
+}
@@ -0,0 +1,109 @@
+#pragma once
+#include <libriscv/machine.hpp>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+struct MachineInstance;
+
+/**
+ * Per-tenant limit of log lines, as a token bucket shared by every
+ * thread. Lines over the limit are counted and dropped.
+**/
+class LogLimiter
+{
+public:
+	/* Whether the tenant may log one more line now */
+	bool take() noexcept;
+	uint64_t dropped() const noexcept { return m_dropped.load(std::memory_order_relaxed); }
+
+	/* Zero lines per second is unlimited */
+	LogLimiter(uint64_t lines_per_sec, uint64_t burst);
+
+private:
+	/* Tokens are counted in thousandths of a line */
+	const int64_t m_rate;
+	const int64_t m_capacity;
+	std::atomic<int64_t>  m_tokens;
+	std::atomic<uint64_t> m_last_ms { 0 };
+	std::atomic<uint64_t> m_dropped { 0 };
+};
+
+/**
+ * What is known about a failed guest call when it fails. The writer
+ * thread turns it into text, and resolves the symbols from the program,
+ * which the report keeps alive.
+**/
+struct ErrorReport
+{
+	static constexpr int MARCH = riscv::RISCV64;
+	using gaddr_t = riscv::address_type<MARCH>;
+
+	enum Kind { EXCEPTION, TIMEOUT, BACKTRACE };
+	struct Frame {
+		gaddr_t addr = 0;
+		/* Resolved by the writer, unless there was no program */
+		std::string symbol;
+	};
+
+	Kind kind = EXCEPTION;
+	std::string tenant;
+	std::string message;
+	bool     has_data = false;
+	uint64_t data = 0;
+	riscv::Registers<MARCH> registers;
+	std::string program_page;
+	std::string stack_page;
+	/* The current pc, the return address, and the called function */
+	std::array<Frame, 3> frames;
+	std::shared_ptr<const MachineInstance> program = nullptr;
+};
+
+/**
+ * Asynchronous output for guest logging and sandbox errors.
+ *
+ * Each thread writes into its own single-producer ring of fixed-size
+ * slots, without locks or system calls, and a background thread drains
+ * every ring into stdout and stderr. Writers never block: when a ring
+ * is full, the message is dropped and counted. A message longer than a
+ * slot spans several slots, which are published together so that lines
+ * are never interleaved with other threads, up to MAX_SLOTS_PER_MESSAGE.
+**/
+class LogWriter
+{
+public:
+	static constexpr size_t RING_SLOTS = 512;
+	static constexpr size_t SLOT_SIZE  = 512;
+	static constexpr size_t MAX_SLOTS_PER_MESSAGE = 8;
+	/* Messages are truncated to this, including the prefix */
+	static constexpr size_t MAX_MESSAGE = MAX_SLOTS_PER_MESSAGE * (SLOT_SIZE - 11);
+
+	enum Stream : uint8_t { OUT, ERR };
+	struct Stats {
+		uint64_t messages;
+		uint64_t dropped;  /* Rings that were full */
+		uint64_t reports;
+	};
+
+	/* Queues one message of guest output. Returns false when it was
+	   dropped, either by the limiter or because the ring was full. */
+	static bool write(LogLimiter&, std::string_view name, std::string_view text) noexcept;
+	/* The same, for callers that have already taken from the limiter */
+	static bool write(std::string_view name, std::string_view text) noexcept;
+	/* Queues a line of sandbox diagnostics, which is not rate limited */
+	static bool error(std::string_view text) noexcept;
+	/* Reports of guest errors are not rate limited here either. Callers
+	   take from the limiter of the tenant before building them. */
+	static bool report(std::unique_ptr<ErrorReport>) noexcept;
+
+	/* Blocks until everything queued so far has been written */
+	static void flush();
+	static Stats stats() noexcept;
+
+	struct Ring;
+private:
+	static bool push(Stream, std::string_view prefix, std::string_view text,
+		ErrorReport*) noexcept;
+};
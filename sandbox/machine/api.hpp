@@ -0,0 +1,254 @@
+#pragma once
+/**
+ * Guest-side API for tenant programs.
+ * Build the tenant program with this directory in the include path.
+**/
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include "syscalls.h"
+#include "../crc32.hpp"
+
+namespace api
+{
+	template <int N>
+	inline long syscall(long a0 = 0, long a1 = 0, long a2 = 0,
+		long a3 = 0, long a4 = 0, long a5 = 0, long a6 = 0)
+	{
+		register long ra0 asm("a0") = a0;
+		register long ra1 asm("a1") = a1;
+		register long ra2 asm("a2") = a2;
+		register long ra3 asm("a3") = a3;
+		register long ra4 asm("a4") = a4;
+		register long ra5 asm("a5") = a5;
+		register long ra6 asm("a6") = a6;
+		register long syscall_id asm("a7") = N;
+		asm volatile ("ecall"
+			: "+r"(ra0)
+			: "r"(ra1), "r"(ra2), "r"(ra3), "r"(ra4), "r"(ra5), "r"(ra6), "r"(syscall_id)
+			: "memory");
+		return ra0;
+	}
+	/* For system calls that return a pointer and a length in A0, A1 */
+	template <int N>
+	inline std::string_view syscall_view(long a0 = 0, long a1 = 0, long a2 = 0,
+		long a3 = 0, long a4 = 0, long a5 = 0)
+	{
+		register long ra0 asm("a0") = a0;
+		register long ra1 asm("a1") = a1;
+		register long ra2 asm("a2") = a2;
+		register long ra3 asm("a3") = a3;
+		register long ra4 asm("a4") = a4;
+		register long ra5 asm("a5") = a5;
+		register long syscall_id asm("a7") = N;
+		asm volatile ("ecall"
+			: "+r"(ra0), "+r"(ra1)
+			: "r"(ra2), "r"(ra3), "r"(ra4), "r"(ra5), "r"(syscall_id)
+			: "memory");
+		return {(const char*)ra0, (size_t)ra1};
+	}
+
+	/* A field name together with its hash, computed at compile-time.
+	   Header names must be lower-case. */
+	struct Field {
+		constexpr Field(std::string_view n) : name(n), hash(crc32(n.data(), n.size())) {}
+		std::string_view name;
+		uint32_t hash;
+	};
+
+	/* Copies the value of a field into buf, returns the
+	   full length of the value or -1 if not found. */
+	inline long field_get(int where, Field f, char* buf, size_t buflen) {
+		return syscall<ECALL_FIELD_GET>(where, f.hash,
+			(long)f.name.data(), f.name.size(), (long)buf, buflen);
+	}
+	/* Returns the length of the value or -1 if not found */
+	inline long field_find(int where, Field f) {
+		return syscall<ECALL_HTTP_FIND>(where, f.hash,
+			(long)f.name.data(), f.name.size());
+	}
+	/* Returns 0, or -1 if the field can't be written, or the value is
+	   longer than 16KB or contains CR, LF or NUL */
+	inline long field_set(int where, Field f, std::string_view value) {
+		return syscall<ECALL_FIELD_SET>(where, f.hash,
+			(long)f.name.data(), f.name.size(), (long)value.data(), value.size());
+	}
+	inline long field_append(int where, Field f, std::string_view value) {
+		return syscall<ECALL_FIELD_APPEND>(where, f.hash,
+			(long)f.name.data(), f.name.size(), (long)value.data(), value.size());
+	}
+	inline long field_copy(int src, int dst, Field f) {
+		return syscall<ECALL_FIELD_COPY>(src, dst, f.hash,
+			(long)f.name.data(), f.name.size());
+	}
+	inline long field_unset(int where, Field f) {
+		return syscall<ECALL_FIELD_UNSET>(where, f.hash,
+			(long)f.name.data(), f.name.size());
+	}
+	/* Writes "name: value\n" for every field into buf,
+	   returns the length needed for all of them. */
+	inline long foreach_field(int where, char* buf, size_t buflen) {
+		return syscall<ECALL_FOREACH_FIELD>(where, (long)buf, buflen);
+	}
+	inline long http_copy(int src, int dst) {
+		return syscall<ECALL_HTTP_COPY>(src, dst);
+	}
+	inline long http_rollback(int where) {
+		return syscall<ECALL_HTTP_ROLLBACK>(where);
+	}
+	/* Returns the previous status code */
+	inline long set_status(int status) {
+		return syscall<ECALL_HTTP_SET_STATUS>(status);
+	}
+
+	/* Cache the response for ttl seconds, varying on a comma-separated
+	   list of request headers, eg. "accept-encoding, cookie" */
+	inline long cache_control(unsigned ttl, std::string_view vary = {}) {
+		return syscall<ECALL_CACHE_CONTROL>(ttl, (long)vary.data(), vary.size());
+	}
+
+	/* Returns a handle, or -1 if the pattern is invalid. Patterns
+	   compiled in on_init are shared by every request for free. */
+	inline int regex_compile(std::string_view pattern) {
+		return syscall<ECALL_REGEX_COMPILE>((long)pattern.data(), pattern.size());
+	}
+	/* Returns 1 if the pattern matches anywhere in the subject */
+	inline long regex_match(int re, std::string_view subject) {
+		return syscall<ECALL_REGEX_MATCH>(re, (long)subject.data(), subject.size());
+	}
+	/* Returns the result allocated on the heap, or an empty view when
+	   nothing matched. Pass REGEX_GLOBAL to substitute every match.
+	   A result too large for the heap is an empty view whose data()
+	   is (const char*)-1. */
+	inline std::string_view regex_subst(int re, std::string_view subject,
+		std::string_view replacement, int flags = 0) {
+		return syscall_view<ECALL_REGEX_SUBST>(re, (long)subject.data(), subject.size(),
+			(long)replacement.data(), replacement.size(), flags);
+	}
+	/* Returns the number of substitutions, or -1 if the field was not
+	   found or its new value would be longer than 16KB */
+	inline long regex_subst_field(int re, int where, Field f,
+		std::string_view replacement, int flags = 0) {
+		return syscall<ECALL_REGSUB_HDR>(re, where | flags, f.hash,
+			(long)f.name.data(), f.name.size(), (long)replacement.data(), replacement.size());
+	}
+	inline long regex_free(int re) {
+		return syscall<ECALL_REGEX_FREE>(re);
+	}
+	/* Removes every field with a matching name, returns how many */
+	inline long field_unset_re(int where, int re) {
+		return syscall<ECALL_HTTP_UNSET_RE>(where, re);
+	}
+
+	/* Routes requests matching the method(s) and path pattern to
+	   func, instead of on_client_request. Call during initialization.
+	   Patterns are made of /literal, /:param and a final /* segment. */
+	inline long route(unsigned methods, std::string_view pattern, void(*func)()) {
+		return syscall<ECALL_ROUTE_ADD>(methods, (long)pattern.data(), pattern.size(), (long)func);
+	}
+	/* Copies the nth :param of the route into buf, returns the
+	   full length of the value or -1 if not found. */
+	inline long route_param(unsigned idx, char* buf, size_t buflen) {
+		return syscall<ECALL_ROUTE_PARAM>(idx, (long)buf, buflen);
+	}
+
+	/* The tenant's key-value store, which is kept across requests and
+	   shared by all of them. Keys are at most 256 bytes, and values
+	   at most 64KB. Copies the value into buf, returns the full length
+	   of the value or -1 if not found. */
+	inline long kv_get(std::string_view key, char* buf, size_t buflen) {
+		return syscall<ECALL_KV_GET>((long)key.data(), key.size(), (long)buf, buflen);
+	}
+	/* Returns 0, or -1 when the store is full */
+	inline long kv_set(std::string_view key, std::string_view value) {
+		return syscall<ECALL_KV_SET>((long)key.data(), key.size(), (long)value.data(), value.size());
+	}
+	/* Returns 0, or -1 if not found */
+	inline long kv_del(std::string_view key) {
+		return syscall<ECALL_KV_DEL>((long)key.data(), key.size());
+	}
+	/* Atomically adds delta to a decimal value, where a missing value
+	   is 0, and stores the result in value. Returns 0 or -1. */
+	inline long kv_incr(std::string_view key, long delta, long* value = nullptr) {
+		return syscall<ECALL_KV_INCR>((long)key.data(), key.size(), delta, (long)value);
+	}
+
+	/* Starts a request to one of the tenant's upstreams, and returns a
+	   handle, or -1 if the request was not allowed. Headers are given
+	   as "name: value" lines. Only asynchronous tenants can fetch. */
+	inline long fetch(unsigned method, std::string_view url,
+		std::string_view headers = {}, std::string_view body = {}) {
+		return syscall<ECALL_FETCH>(method, (long)url.data(), url.size(),
+			(long)headers.data(), headers.size(), (long)body.data(), body.size());
+	}
+	/* Suspends until the response has arrived, and returns its
+	   status, or -1 if the request failed */
+	inline long fetch_wait(long handle) {
+		return syscall<ECALL_FETCH_WAIT>(handle);
+	}
+	/* Copies the body of the response into buf, returns the full
+	   length of the body or -1 if the request has not completed */
+	inline long fetch_body(long handle, char* buf, size_t buflen) {
+		return syscall<ECALL_FETCH_BODY>(handle, (long)buf, buflen);
+	}
+	/* Copies a response header into buf, returns the full length of
+	   the value or -1 if not found. Names must be lower-case. */
+	inline long fetch_header(long handle, std::string_view name, char* buf, size_t buflen) {
+		return syscall<ECALL_FETCH_HEADER>(handle, (long)name.data(), name.size(), (long)buf, buflen);
+	}
+
+	/* Compresses data natively into buf, with COMPRESS_GZIP, _BR or
+	   _ZSTD, optionally OR-ed with COMPRESS_BEST. Returns the length,
+	   or -1 if the encoding is not available, buf is too small, or the
+	   data is over 16MB, or 256KB with COMPRESS_BEST. Costs 4
+	   instructions per byte, or 64 with COMPRESS_BEST.
+	   Responses are already compressed for clients that accept it,
+	   so this is for bodies that are stored or sent elsewhere. */
+	inline long compress(unsigned encoding, std::string_view data, char* buf, size_t buflen) {
+		return syscall<ECALL_COMPRESS>(encoding, (long)data.data(), data.size(), (long)buf, buflen);
+	}
+
+	/* Native versions of loops over every byte. The ones that write
+	   into buf return the length, or -1 if buf is too small or the
+	   input is invalid. */
+	/* Returns the offset of needle in haystack, or -1 */
+	inline long find(std::string_view haystack, std::string_view needle) {
+		return syscall<ECALL_FIND>((long)haystack.data(), haystack.size(),
+			(long)needle.data(), needle.size());
+	}
+	/* CRC32_ZLIB or CRC32_C, continuing from a previous result. The
+	   crc32() of crc32.hpp computes the same in the guest. */
+	inline uint32_t checksum(unsigned poly, std::string_view data, uint32_t crc = 0) {
+		return syscall<ECALL_CRC32>(poly, (long)data.data(), data.size(), crc);
+	}
+	/* Needs (len + 2) / 3 * 4 bytes */
+	inline long base64_encode(std::string_view data, char* buf, size_t buflen) {
+		return syscall<ECALL_BASE64_ENCODE>((long)data.data(), data.size(), (long)buf, buflen);
+	}
+	inline long base64_decode(std::string_view data, char* buf, size_t buflen) {
+		return syscall<ECALL_BASE64_DECODE>((long)data.data(), data.size(), (long)buf, buflen);
+	}
+	/* With form, '+' is decoded as a space */
+	inline long url_decode(std::string_view data, char* buf, size_t buflen, bool form = false) {
+		return syscall<ECALL_URL_DECODE>((long)data.data(), data.size(), (long)buf, buflen, form);
+	}
+	/* ESCAPE_HTML or ESCAPE_JSON, needs at most 6 bytes per byte */
+	inline long escape(unsigned kind, std::string_view data, char* buf, size_t buflen) {
+		return syscall<ECALL_ESCAPE>(kind, (long)data.data(), data.size(), (long)buf, buflen);
+	}
+
+	/* Request bodies are streamed to programs that export
+	     extern "C" long on_body_chunk(const char* data, size_t len, int last);
+	   before on_client_request is called. Return how many bytes were
+	   consumed, and the rest is passed again in front of the next chunk.
+	   Return -1 to stop receiving the body. */
+
+	/* Gives the event loop back, and returns 0 when resumed. Only
+	   asynchronous tenants can be suspended, others get -1. */
+	inline long sleep(unsigned ms) {
+		return syscall<ECALL_YIELD>(ms);
+	}
+	inline long yield() {
+		return syscall<ECALL_YIELD>(0);
+	}
+}
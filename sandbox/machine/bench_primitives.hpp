@@ -0,0 +1,86 @@
+#pragma once
+/**
+ * Guest versions of the native primitives, for dvm_primitives_bench.
+ *
+ * Include this in one source file of a program to export them. They
+ * are written the way a guest would without the system calls, and run
+ * over the same input as the native versions do.
+**/
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include "../crc32.hpp"
+
+namespace bench_primitives
+{
+	/* Enough for six bytes of output per byte of a 64KB input */
+	inline char output[6 * 65536];
+}
+
+extern "C" long bench_find(const char* data, size_t len)
+{
+	/* Not in the input, so that every byte is looked at */
+	const auto pos = std::string_view(data, len).find("</never>");
+	return (pos != std::string_view::npos) ? long(pos) : -1L;
+}
+
+extern "C" long bench_crc32(const char* data, size_t len)
+{
+	return crc32<0x82F63B78>(data, len);
+}
+
+extern "C" long bench_base64_encode(const char* data, size_t len)
+{
+	static constexpr char table[] =
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	const auto* src = (const uint8_t*) data;
+	char* dst = bench_primitives::output;
+	for (; len >= 3; src += 3, len -= 3, dst += 4) {
+		const uint32_t v = (src[0] << 16) | (src[1] << 8) | src[2];
+		dst[0] = table[v >> 18];
+		dst[1] = table[(v >> 12) & 63];
+		dst[2] = table[(v >> 6) & 63];
+		dst[3] = table[v & 63];
+	}
+	return dst - bench_primitives::output;
+}
+
+extern "C" long bench_url_decode(const char* data, size_t len)
+{
+	auto hex = [] (char c) -> int {
+		if (c >= '0' && c <= '9') return c - '0';
+		if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+		if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+		return -1;
+	};
+	char* dst = bench_primitives::output;
+	for (size_t i = 0; i < len; i++) {
+		if (data[i] == '%' && i + 2 < len && hex(data[i+1]) >= 0 && hex(data[i+2]) >= 0) {
+			*dst++ = hex(data[i+1]) * 16 + hex(data[i+2]);
+			i += 2;
+		} else {
+			*dst++ = data[i];
+		}
+	}
+	return dst - bench_primitives::output;
+}
+
+extern "C" long bench_escape_html(const char* data, size_t len)
+{
+	char* dst = bench_primitives::output;
+	auto put = [&dst] (std::string_view s) {
+		for (const char c : s)
+			*dst++ = c;
+	};
+	for (size_t i = 0; i < len; i++) {
+		switch (data[i]) {
+		case '&':  put("&amp;"); break;
+		case '<':  put("&lt;"); break;
+		case '>':  put("&gt;"); break;
+		case '"':  put("&quot;"); break;
+		case '\'': put("&#39;"); break;
+		default:   *dst++ = data[i];
+		}
+	}
+	return dst - bench_primitives::output;
+}
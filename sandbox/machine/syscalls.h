@@ -35,5 +35,67 @@ enum
 	ECALL_HTTP_UNSET_RE,
 	ECALL_HTTP_FIND,
 
+	ECALL_CACHE_CONTROL,
+	ECALL_YIELD,
+	ECALL_ROUTE_ADD,
+	ECALL_ROUTE_PARAM,
+
+	ECALL_KV_GET,
+	ECALL_KV_SET,
+	ECALL_KV_DEL,
+	ECALL_KV_INCR,
+
+	ECALL_FETCH,
+	ECALL_FETCH_WAIT,
+	ECALL_FETCH_BODY,
+	ECALL_FETCH_HEADER,
+
+	ECALL_COMPRESS,
+
+	ECALL_FIND,
+	ECALL_CRC32,
+	ECALL_BASE64_ENCODE,
+	ECALL_BASE64_DECODE,
+	ECALL_URL_DECODE,
+	ECALL_ESCAPE,
+
 	ECALL_LAST
 };
+
+/* The field lists that ECALL_FIELD_* and ECALL_HTTP_* operate on */
+enum
+{
+	HTTP_REQ = 0,
+	HTTP_RESP,
+	HTTP_QUERY,  /* Read-only */
+	HTTP_COOKIE, /* Read-only */
+};
+
+/* Substitute every match, for ECALL_REGEX_SUBST and ECALL_REGSUB_HDR.
+   The latter takes it OR-ed into the field list. */
+#define REGEX_GLOBAL  0x100
+
+/* Methods for ECALL_ROUTE_ADD, which can be OR-ed together */
+#define ROUTE_GET     0x1
+#define ROUTE_POST    0x2
+#define ROUTE_PUT     0x4
+#define ROUTE_DELETE  0x8
+#define ROUTE_PATCH   0x10
+#define ROUTE_HEAD    0x20
+#define ROUTE_OPTIONS 0x40
+#define ROUTE_ANY     0x7F
+
+/* Encodings for ECALL_COMPRESS, which can have COMPRESS_BEST OR-ed in
+   to compress as small as possible, for bodies that are kept */
+#define COMPRESS_BR    1
+#define COMPRESS_ZSTD  2
+#define COMPRESS_GZIP  3
+#define COMPRESS_BEST  0x100
+
+/* Polynomials for ECALL_CRC32 */
+#define CRC32_ZLIB     0  /* 0xEDB88320 */
+#define CRC32_C        1  /* 0x82F63B78, Castagnoli */
+
+/* Kinds of ECALL_ESCAPE */
+#define ESCAPE_HTML    0
+#define ESCAPE_JSON    1
@@ -1,12 +1,16 @@
 #include "machine_instance.hpp"
+#include "log_writer.hpp"
+#include "numa.hpp"
 
 static const std::vector<std::string> lookup_wishlist {
 	"on_init",
 	"on_client_request",
+	"on_body_chunk",
 };
 
 MachineInstance::MachineInstance(SharedBinary elf, TenantInstance* vrm)
-	: script{*elf, vrm, *this}, binary{std::move(elf)}
+	: script{*elf, vrm, *this}, binary{std::move(elf)},
+	  node{Numa::current_node()}
 {
 	for (const auto& func : lookup_wishlist) {
 		/* NOTE: We can't check if addr is 0 here, because
@@ -16,8 +20,43 @@ MachineInstance::MachineInstance(SharedBinary elf, TenantInstance* vrm)
 		const auto callsite = script.callsite(addr);
 		sym_vector.push_back({func, addr, callsite.size});
 	}
+	this->entry_address = sym_lookup["on_client_request"];
+	/* Allocated once in the main VM, so that every fork inherits it */
+	this->body_chunk_address = sym_lookup["on_body_chunk"];
+	if (this->body_chunk_address != 0x0)
+		this->body_window = script.guest_alloc(BODY_WINDOW);
+}
+
+MachineInstance::MachineInstance(const MachineInstance& primary)
+	: script{Script::Replica{}, primary.script, *this}, binary{primary.binary},
+	  sym_lookup{primary.sym_lookup}, sym_vector{primary.sym_vector},
+	  entry_address{primary.entry_address},
+	  body_chunk_address{primary.body_chunk_address},
+	  body_window{primary.body_window},
+	  node{Numa::current_node()}
+{
 }
 
 MachineInstance::~MachineInstance()
 {
 }
+
+void MachineInstance::replicate()
+{
+	std::vector<std::shared_ptr<MachineInstance>> result(Numa::nodes());
+	try {
+		for (size_t n = 0; n < result.size(); n++) {
+			if (n == this->node)
+				continue;
+			/* Pages are placed on the node that first touches them */
+			Numa::run_on_node(n, [&] {
+				result[n] = std::make_shared<MachineInstance>(*this);
+			});
+		}
+	} catch (const std::exception& e) {
+		LogWriter::error("Replicating '" + script.name() + "' failed: "
+			+ e.what() + "\n");
+		return;
+	}
+	this->replicas = std::move(result);
+}
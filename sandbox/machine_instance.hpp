@@ -1,12 +1,19 @@
 #pragma once
 #include "script.hpp"
+#include "binary_table.hpp"
+#include "compression.hpp"
+#include "working_set.hpp"
 #include <atomic>
 
 struct MachineInstance
 {
-	using SharedBinary = std::shared_ptr<std::vector<uint8_t>>;
+	/* Guest memory that request bodies are streamed through */
+	static constexpr size_t BODY_WINDOW = 65536;
+	using SharedBinary = BinaryTable::SharedBinary;
 
 	MachineInstance(SharedBinary elf, TenantInstance* vrm);
+	/* A replica of primary for the node of the calling thread */
+	explicit MachineInstance(const MachineInstance& primary);
 	~MachineInstance();
 
 	inline Script::gaddr_t lookup(const std::string& name) const {
@@ -27,4 +34,22 @@ struct MachineInstance
 		size_t size;
 	};
 	std::vector<Lookup> sym_vector;
+	/* Cached address of on_client_request, used when forking */
+	Script::gaddr_t entry_address = 0x0;
+	/* Optional on_body_chunk, and the window allocated for it */
+	Script::gaddr_t body_chunk_address = 0x0;
+	Script::gaddr_t body_window = 0x0;
+	/* Learned from the first requests, by forks on any thread */
+	mutable WorkingSet working_set;
+	/* Compressed once, for every fork that responds with them */
+	mutable PrecompressedBodies precompressed;
+
+	/* The NUMA node this program was initialized on, and its copies
+	   for the other nodes, indexed by node, when replicated */
+	size_t node = 0;
+	std::vector<std::shared_ptr<MachineInstance>> replicas;
+	/* Copies this program to every other node. Without replicas,
+	   the threads of every node use this program. Replicas start
+	   from the memory that on_init left behind, which isn't run again. */
+	void replicate();
 };
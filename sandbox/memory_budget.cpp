@@ -0,0 +1,88 @@
+#include "memory_budget.hpp"
+
+std::atomic<size_t> MemoryBudget::m_max_pages { 0 };
+std::atomic<size_t> MemoryBudget::m_fork_dirty_pages { 0 };
+std::atomic<size_t> MemoryBudget::m_reserve_pages { 0 };
+std::atomic<size_t> MemoryBudget::m_used { 0 };
+std::atomic<uint64_t> MemoryBudget::m_rejected { 0 };
+std::atomic<uint64_t> MemoryBudget::m_denied { 0 };
+
+/* Pages this thread has taken from the budget, but not loaned out */
+static thread_local size_t credit = 0;
+
+void MemoryBudget::configure(const Config& config)
+{
+	m_max_pages = config.max_pages;
+	m_fork_dirty_pages = config.fork_dirty_pages;
+	m_reserve_pages = (config.reserve_pages != 0)
+		? config.reserve_pages : config.fork_dirty_pages;
+}
+
+bool MemoryBudget::reserve(size_t pages) noexcept
+{
+	const size_t max = m_max_pages.load(std::memory_order_relaxed);
+	size_t used = m_used.load(std::memory_order_relaxed);
+	do {
+		if (max != 0 && used + pages > max)
+			return false;
+	} while (!m_used.compare_exchange_weak(used, used + pages,
+		std::memory_order_relaxed));
+	return true;
+}
+
+bool MemoryBudget::charge(size_t pages) noexcept
+{
+	if (credit >= pages) {
+		credit -= pages;
+		return true;
+	}
+	/* Refill with a batch, or with just enough when nearly exhausted */
+	const size_t missing = pages - credit;
+	if (reserve(missing + BATCH)) {
+		credit = BATCH;
+		return true;
+	}
+	if (reserve(missing)) {
+		credit = 0;
+		return true;
+	}
+	m_denied.fetch_add(1, std::memory_order_relaxed);
+	return false;
+}
+
+void MemoryBudget::release(size_t pages) noexcept
+{
+	credit += pages;
+	if (credit > 2 * BATCH) {
+		const size_t excess = credit - BATCH;
+		m_used.fetch_sub(excess, std::memory_order_relaxed);
+		credit = BATCH;
+	}
+}
+
+bool MemoryBudget::has_room() noexcept
+{
+	const size_t max = m_max_pages.load(std::memory_order_relaxed);
+	if (max == 0)
+		return true;
+	const size_t used = m_used.load(std::memory_order_relaxed);
+	const size_t reserve = m_reserve_pages.load(std::memory_order_relaxed);
+	return used + reserve <= max;
+}
+bool MemoryBudget::admit() noexcept
+{
+	if (has_room())
+		return true;
+	m_rejected.fetch_add(1, std::memory_order_relaxed);
+	return false;
+}
+
+MemoryBudget::Stats MemoryBudget::stats() noexcept
+{
+	return {
+		.max_pages  = m_max_pages.load(std::memory_order_relaxed),
+		.used_pages = m_used.load(std::memory_order_relaxed),
+		.rejected_forks = m_rejected.load(std::memory_order_relaxed),
+		.denied_pages   = m_denied.load(std::memory_order_relaxed),
+	};
+}
@@ -0,0 +1,67 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Process-wide budget of pages loaned to forked sandboxes.
+ *
+ * Every page a fork creates for writing is charged to the budget,
+ * and returned when the fork is reset or destroyed. Threads charge
+ * against a small local credit that is refilled from the shared
+ * counter in batches, so the shared atomic is only touched about
+ * once per batch. Unused credit counts as used, which makes the
+ * budget slightly conservative.
+ *
+ * A fork that runs into the budget, or into the per-fork limit of
+ * dirty pages, fails with an out-of-memory exception. Before it gets
+ * that far, admit() tells the request path to stop forking while
+ * less than a worst-case fork is left, so that overload turns into
+ * rejected or delayed requests instead of an OOM-killed server.
+**/
+class MemoryBudget
+{
+public:
+	static constexpr size_t BATCH = 64;
+
+	struct Config {
+		/* Pages loaned to forks by all threads, 0 is unlimited */
+		size_t max_pages = 0;
+		/* Pages one fork may create for writing, 0 is unlimited */
+		size_t fork_dirty_pages = 0;
+		/* Pages that must be left for a new fork to be admitted,
+		   0 is one fork at its dirty-page limit */
+		size_t reserve_pages = 0;
+	};
+	struct Stats {
+		uint64_t max_pages;
+		uint64_t used_pages;
+		uint64_t rejected_forks; /* Denied by admit() */
+		uint64_t denied_pages;   /* Faults that ran out of budget */
+	};
+
+	static void configure(const Config&);
+	static Stats stats() noexcept;
+
+	/* Whether a new fork may start now, counting rejections */
+	static bool admit() noexcept;
+	static bool has_room() noexcept;
+	static size_t fork_dirty_pages() noexcept {
+		return m_fork_dirty_pages.load(std::memory_order_relaxed);
+	}
+
+	/* Returns false when the budget is exhausted */
+	static bool charge(size_t pages = 1) noexcept;
+	/* Pages must be released on the thread that charged them */
+	static void release(size_t pages) noexcept;
+
+private:
+	static bool reserve(size_t pages) noexcept;
+
+	static std::atomic<size_t> m_max_pages;
+	static std::atomic<size_t> m_fork_dirty_pages;
+	static std::atomic<size_t> m_reserve_pages;
+	alignas(64) static std::atomic<size_t> m_used;
+	static std::atomic<uint64_t> m_rejected;
+	static std::atomic<uint64_t> m_denied;
+};
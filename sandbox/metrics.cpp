@@ -0,0 +1,447 @@
+#include "metrics.hpp"
+
+#include <cinttypes>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include "binary_table.hpp"
+#include "compression.hpp"
+#include "log_writer.hpp"
+#include "memory_budget.hpp"
+#include "page_pool.hpp"
+#include "tenant_instance.hpp"
+
+namespace metrics
+{
+	using steady = std::chrono::steady_clock;
+	/* Reference point for converting ticks into seconds */
+	static const uint64_t start_ticks = now();
+	static const steady::time_point start_time = steady::now();
+
+	double seconds_per_tick()
+	{
+	#if defined(__x86_64__)
+		auto elapsed = steady::now() - start_time;
+		if (elapsed < std::chrono::milliseconds(10)) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			elapsed = steady::now() - start_time;
+		}
+		const uint64_t ticks = now() - start_ticks;
+		return std::chrono::duration<double>(elapsed).count() / ticks;
+	#else
+		return double(steady::period::num) / steady::period::den;
+	#endif
+	}
+
+	uint64_t Histogram::count_below_pow2(unsigned exp) const noexcept
+	{
+		const size_t end = std::min(size_t(exp / 2 + 1), BUCKETS);
+		uint64_t total = 0;
+		for (size_t i = 0; i < end; i++)
+			total += counts[i];
+		return total;
+	}
+}
+
+/* Written by one thread only, so that increments
+   can be plain loads and stores. */
+using Counter = std::atomic<uint64_t>;
+static inline void add(Counter& counter, uint64_t value) noexcept
+{
+	counter.store(counter.load(std::memory_order_relaxed) + value,
+		std::memory_order_relaxed);
+}
+
+struct ShardHistogram
+{
+	void record(uint64_t value) noexcept
+	{
+		add(counts[metrics::Histogram::bucket(value)], 1);
+		add(sum, value);
+		add(count, 1);
+	}
+	void merge_into(metrics::Histogram& hist) const noexcept
+	{
+		for (size_t i = 0; i < counts.size(); i++)
+			hist.counts[i] += counts[i].load(std::memory_order_relaxed);
+		hist.sum   += sum.load(std::memory_order_relaxed);
+		hist.count += count.load(std::memory_order_relaxed);
+	}
+
+	std::array<Counter, metrics::Histogram::BUCKETS> counts {};
+	Counter sum {0};
+	Counter count {0};
+};
+
+struct alignas(64) TenantMetrics::Shard
+{
+	Counter requests {0};
+	Counter timeouts {0};
+	Counter exceptions {0};
+	Counter page_faults {0};
+	Counter cow_reads {0};
+	Counter prefaulted {0};
+	ShardHistogram fork_ticks;
+	ShardHistogram exec_ticks;
+	ShardHistogram instructions;
+};
+
+/* The shards of one tenant, and the totals of the shards that
+   their threads have given up. Threads only keep weak references,
+   so that they can tell when the tenant is gone. */
+struct TenantMetrics::Shards
+{
+	std::mutex mtx;
+	std::vector<std::unique_ptr<Shard>> live;
+	Snapshot retired {};
+};
+
+static void merge_into(TenantMetrics::Snapshot& total, const TenantMetrics::Shard& shard)
+{
+	total.requests    += shard.requests.load(std::memory_order_relaxed);
+	total.timeouts    += shard.timeouts.load(std::memory_order_relaxed);
+	total.exceptions  += shard.exceptions.load(std::memory_order_relaxed);
+	total.page_faults += shard.page_faults.load(std::memory_order_relaxed);
+	total.cow_reads   += shard.cow_reads.load(std::memory_order_relaxed);
+	total.prefaulted  += shard.prefaulted.load(std::memory_order_relaxed);
+	shard.fork_ticks.merge_into(total.fork_ticks);
+	shard.exec_ticks.merge_into(total.exec_ticks);
+	shard.instructions.merge_into(total.instructions);
+}
+
+/* Metrics objects are identified by a number that is never reused,
+   so that a thread can keep pointers to the shards of destroyed
+   tenants around without ever finding them again. */
+static std::atomic<uint64_t> metrics_counter { 1 };
+
+TenantMetrics::TenantMetrics()
+	: m_id{metrics_counter.fetch_add(1, std::memory_order_relaxed)},
+	  m_shards{std::make_shared<Shards>()}
+{
+}
+TenantMetrics::~TenantMetrics()
+{
+}
+
+TenantMetrics::Shard& TenantMetrics::local()
+{
+	struct Local {
+		std::weak_ptr<Shards> owner;
+		Shard* shard = nullptr;
+		uint64_t last_used = 0;
+	};
+	struct LastUsed {
+		uint64_t id = 0;
+		Shard* shard = nullptr;
+	};
+	static thread_local LastUsed last;
+	static thread_local std::unordered_map<uint64_t, Local> shards;
+	static thread_local uint64_t uses = 0;
+
+	if (LIKELY(last.id == m_id))
+		return *last.shard;
+
+	auto it = shards.find(m_id);
+	if (it == shards.end()) {
+		if (shards.size() >= MAX_LOCAL_SHARDS) {
+			/* Forget shards of destroyed tenants, or else give
+			   up the least recently used one */
+			auto victim = shards.end();
+			for (auto s = shards.begin(); s != shards.end(); ) {
+				if (s->second.owner.expired()) {
+					s = shards.erase(s);
+					continue;
+				}
+				if (victim == shards.end() || s->second.last_used < victim->second.last_used)
+					victim = s;
+				++s;
+			}
+			if (shards.size() >= MAX_LOCAL_SHARDS && victim != shards.end()) {
+				if (auto owner = victim->second.owner.lock()) {
+					std::lock_guard<std::mutex> lock(owner->mtx);
+					merge_into(owner->retired, *victim->second.shard);
+					auto& live = owner->live;
+					for (size_t i = 0; i < live.size(); i++) {
+						if (live[i].get() == victim->second.shard) {
+							live[i] = std::move(live.back());
+							live.pop_back();
+							break;
+						}
+					}
+				}
+				if (last.id == victim->first)
+					last = {};
+				shards.erase(victim);
+			}
+		}
+		auto shard = std::make_unique<Shard>();
+		std::lock_guard<std::mutex> lock(m_shards->mtx);
+		it = shards.emplace(m_id, Local{m_shards, shard.get()}).first;
+		m_shards->live.push_back(std::move(shard));
+	}
+	it->second.last_used = ++uses;
+	last = {m_id, it->second.shard};
+	return *it->second.shard;
+}
+
+void TenantMetrics::record(const Sample& sample) noexcept
+{
+	auto& shard = this->local();
+	add(shard.requests, 1);
+	if (sample.timeout)
+		add(shard.timeouts, 1);
+	if (sample.exception)
+		add(shard.exceptions, 1);
+	add(shard.page_faults, sample.page_faults);
+	add(shard.cow_reads, sample.cow_reads);
+	add(shard.prefaulted, sample.prefaulted);
+	shard.fork_ticks.record(sample.fork_ticks);
+	shard.exec_ticks.record(sample.exec_ticks);
+	shard.instructions.record(sample.instructions);
+}
+
+TenantMetrics::Snapshot TenantMetrics::snapshot() const
+{
+	std::lock_guard<std::mutex> lock(m_shards->mtx);
+	Snapshot total = m_shards->retired;
+	for (const auto& shard : m_shards->live)
+		merge_into(total, *shard);
+	return total;
+}
+
+/** Prometheus text format **/
+
+static std::string escape_label(const std::string& value)
+{
+	std::string result;
+	for (const char c : value) {
+		if (c == '\\' || c == '"') result += '\\';
+		if (c == '\n') { result += "\\n"; continue; }
+		result += c;
+	}
+	return result;
+}
+
+static void write_header(std::string& out, const char* name, const char* type, const char* help)
+{
+	out += "# HELP "; out += name; out += ' '; out += help; out += '\n';
+	out += "# TYPE "; out += name; out += ' '; out += type; out += '\n';
+}
+
+template <typename T>
+static void write_value(std::string& out, const char* name, const std::string& labels, T value)
+{
+	char buffer[64];
+	if constexpr (std::is_floating_point_v<T>)
+		snprintf(buffer, sizeof(buffer), "%.9g", value);
+	else
+		snprintf(buffer, sizeof(buffer), "%" PRIu64, uint64_t(value));
+	out += name; out += '{'; out += labels; out += "} "; out += buffer; out += '\n';
+}
+
+/* Buckets at every other power of two, between 2^first and 2^last */
+static void write_histogram(std::string& out, const char* name, const std::string& labels,
+	const metrics::Histogram& hist, unsigned first, unsigned last, double scale)
+{
+	const std::string bucket = std::string(name) + "_bucket";
+	char le[64];
+	for (unsigned exp = first; exp <= last; exp += 2) {
+		snprintf(le, sizeof(le), ",le=\"%.6g\"", double(1ull << exp) * scale);
+		write_value(out, bucket.c_str(), labels + le, hist.count_below_pow2(exp));
+	}
+	write_value(out, bucket.c_str(), labels + ",le=\"+Inf\"", hist.count);
+	if (scale == 1.0)
+		write_value(out, (std::string(name) + "_sum").c_str(), labels, hist.sum);
+	else
+		write_value(out, (std::string(name) + "_sum").c_str(), labels, hist.sum * scale);
+	write_value(out, (std::string(name) + "_count").c_str(), labels, hist.count);
+}
+
+std::string prometheus_metrics(const std::vector<std::shared_ptr<TenantInstance>>& tenants)
+{
+	struct Entry {
+		std::string labels;
+		TenantMetrics::Snapshot metrics;
+		ResponseCache::Stats cache;
+		bool has_cache;
+	};
+	std::vector<Entry> entries;
+	entries.reserve(tenants.size());
+	for (const auto& tenant : tenants) {
+		entries.push_back({
+			"tenant=\"" + escape_label(tenant->config.name) + "\",group=\""
+				+ escape_label(tenant->config.group) + "\"",
+			tenant->metrics.snapshot(),
+			tenant->cache.stats(),
+			tenant->cache.enabled()
+		});
+	}
+	const double spt = metrics::seconds_per_tick();
+	std::string out;
+
+	struct CounterFamily {
+		const char* name;
+		const char* help;
+		uint64_t TenantMetrics::Snapshot::* field;
+	};
+	static const CounterFamily counters[] = {
+		{"dvm_requests_total", "Requests handled by the tenant", &TenantMetrics::Snapshot::requests},
+		{"dvm_timeouts_total", "Requests that ran out of instructions", &TenantMetrics::Snapshot::timeouts},
+		{"dvm_exceptions_total", "Requests that ended with a guest exception", &TenantMetrics::Snapshot::exceptions},
+		{"dvm_page_faults_total", "Pages created for writing in forks", &TenantMetrics::Snapshot::page_faults},
+		{"dvm_cow_reads_total", "Pages of the main VM mapped for reading in forks", &TenantMetrics::Snapshot::cow_reads},
+		{"dvm_prefaulted_pages_total", "Working set pages installed in forks ahead of requests", &TenantMetrics::Snapshot::prefaulted},
+	};
+	for (const auto& family : counters) {
+		write_header(out, family.name, "counter", family.help);
+		for (const auto& entry : entries)
+			write_value(out, family.name, entry.labels, entry.metrics.*family.field);
+	}
+
+	write_header(out, "dvm_throttled_total", "counter", "Requests rejected for exceeding the CPU budget");
+	for (size_t i = 0; i < entries.size(); i++)
+		write_value(out, "dvm_throttled_total", entries[i].labels, tenants[i]->governor.rejected());
+
+	write_header(out, "dvm_log_throttled_total", "counter", "Guest log lines over the rate limit");
+	for (size_t i = 0; i < entries.size(); i++)
+		write_value(out, "dvm_log_throttled_total", entries[i].labels, tenants[i]->log_limiter.dropped());
+
+	struct KVFamily {
+		const char* name;
+		const char* type;
+		const char* help;
+		uint64_t KVStore::Stats::* field;
+	};
+	static const KVFamily kv_families[] = {
+		{"dvm_kv_keys", "gauge", "Keys in the key-value store", &KVStore::Stats::keys},
+		{"dvm_kv_bytes", "gauge", "Bytes used by the key-value store", &KVStore::Stats::bytes},
+		{"dvm_kv_rejected_total", "counter", "Writes rejected for exceeding the store budget", &KVStore::Stats::rejected},
+	};
+	std::vector<KVStore::Stats> kv_stats;
+	for (const auto& tenant : tenants)
+		kv_stats.push_back(tenant->kv.stats());
+	for (const auto& family : kv_families) {
+		write_header(out, family.name, family.type, family.help);
+		for (size_t i = 0; i < entries.size(); i++)
+			write_value(out, family.name, entries[i].labels, kv_stats[i].*family.field);
+	}
+
+	struct UpstreamFamily {
+		const char* name;
+		const char* type;
+		const char* help;
+		uint64_t Upstreams::Stats::* field;
+	};
+	static const UpstreamFamily upstream_families[] = {
+		{"dvm_upstream_requests_total", "counter", "Requests sent upstream", &Upstreams::Stats::requests},
+		{"dvm_upstream_coalesced_total", "counter", "Requests coalesced onto an identical GET", &Upstreams::Stats::coalesced},
+		{"dvm_upstream_rejected_total", "counter", "Requests not allowed or over the limit", &Upstreams::Stats::rejected},
+		{"dvm_upstream_failed_total", "counter", "Requests that got no valid response", &Upstreams::Stats::failed},
+		{"dvm_upstream_inflight", "gauge", "Requests waiting for upstream", &Upstreams::Stats::inflight},
+	};
+	std::vector<Upstreams::Stats> upstream_stats;
+	for (const auto& tenant : tenants)
+		upstream_stats.push_back(tenant->upstreams.stats());
+	for (const auto& family : upstream_families) {
+		write_header(out, family.name, family.type, family.help);
+		for (size_t i = 0; i < entries.size(); i++) {
+			if (tenants[i]->upstreams.enabled())
+				write_value(out, family.name, entries[i].labels, upstream_stats[i].*family.field);
+		}
+	}
+
+	write_header(out, "dvm_fork_seconds", "histogram", "Time to fork or reuse a sandbox");
+	for (const auto& entry : entries)
+		write_histogram(out, "dvm_fork_seconds", entry.labels, entry.metrics.fork_ticks, 6, 36, spt);
+	write_header(out, "dvm_exec_seconds", "histogram", "Time spent executing the guest");
+	for (const auto& entry : entries)
+		write_histogram(out, "dvm_exec_seconds", entry.labels, entry.metrics.exec_ticks, 6, 36, spt);
+	write_header(out, "dvm_instructions", "histogram", "Instructions retired per request");
+	for (const auto& entry : entries)
+		write_histogram(out, "dvm_instructions", entry.labels, entry.metrics.instructions, 4, 34, 1.0);
+
+	struct CacheFamily {
+		const char* name;
+		const char* type;
+		const char* help;
+		uint64_t ResponseCache::Stats::* field;
+	};
+	static const CacheFamily cache_families[] = {
+		{"dvm_cache_hits_total", "counter", "Response cache hits", &ResponseCache::Stats::hits},
+		{"dvm_cache_misses_total", "counter", "Response cache misses", &ResponseCache::Stats::misses},
+		{"dvm_cache_collapsed_total", "counter", "Hits after waiting for another request", &ResponseCache::Stats::collapsed},
+		{"dvm_cache_passes_total", "counter", "Lookups of uncacheable keys", &ResponseCache::Stats::passes},
+		{"dvm_cache_inserts_total", "counter", "Objects inserted", &ResponseCache::Stats::inserts},
+		{"dvm_cache_evictions_total", "counter", "Objects evicted", &ResponseCache::Stats::evictions},
+		{"dvm_cache_objects", "gauge", "Objects in the cache", &ResponseCache::Stats::objects},
+		{"dvm_cache_bytes", "gauge", "Bytes used by the cache", &ResponseCache::Stats::bytes},
+	};
+	for (const auto& family : cache_families) {
+		write_header(out, family.name, family.type, family.help);
+		for (const auto& entry : entries) {
+			if (entry.has_cache)
+				write_value(out, family.name, entry.labels, entry.cache.*family.field);
+		}
+	}
+
+	struct PoolFamily {
+		const char* name;
+		const char* type;
+		const char* help;
+		uint64_t PagePool::Stats::* field;
+	};
+	static const PoolFamily pool_families[] = {
+		{"dvm_pagepool_hits_total", "counter", "Pages taken from the free list", &PagePool::Stats::hits},
+		{"dvm_pagepool_misses_total", "counter", "Pages taken from fresh slabs or the heap", &PagePool::Stats::misses},
+		{"dvm_pagepool_overflow_total", "counter", "Pages allocated above the high-water mark", &PagePool::Stats::overflow},
+		{"dvm_pagepool_resident_pages", "gauge", "Pages mapped by the pool", &PagePool::Stats::resident},
+		{"dvm_pagepool_free_pages", "gauge", "Pages on the free list", &PagePool::Stats::free},
+		{"dvm_pagepool_in_use_pages", "gauge", "Pages loaned out to sandboxes", &PagePool::Stats::in_use},
+	};
+	const auto pools = PagePool::all_stats();
+	for (const auto& family : pool_families) {
+		write_header(out, family.name, family.type, family.help);
+		for (size_t i = 0; i < pools.size(); i++)
+			write_value(out, family.name, "thread=\"" + std::to_string(i) + "\"", pools[i].*family.field);
+	}
+
+	const auto budget = MemoryBudget::stats();
+	write_header(out, "dvm_memory_budget_pages", "gauge", "Pages forks may use in total, 0 is unlimited");
+	write_value(out, "dvm_memory_budget_pages", "", budget.max_pages);
+	write_header(out, "dvm_memory_used_pages", "gauge", "Pages charged to the memory budget");
+	write_value(out, "dvm_memory_used_pages", "", budget.used_pages);
+	write_header(out, "dvm_memory_rejected_total", "counter", "Requests not forked because memory was low");
+	write_value(out, "dvm_memory_rejected_total", "", budget.rejected_forks);
+	write_header(out, "dvm_memory_denied_pages_total", "counter", "Page faults that ran out of budget");
+	write_value(out, "dvm_memory_denied_pages_total", "", budget.denied_pages);
+
+	const auto logs = LogWriter::stats();
+	write_header(out, "dvm_log_messages_total", "counter", "Messages queued for the log writer");
+	write_value(out, "dvm_log_messages_total", "", logs.messages);
+	write_header(out, "dvm_log_reports_total", "counter", "Error reports queued for the log writer");
+	write_value(out, "dvm_log_reports_total", "", logs.reports);
+	write_header(out, "dvm_log_dropped_total", "counter", "Messages dropped because a log ring was full");
+	write_value(out, "dvm_log_dropped_total", "", logs.dropped);
+
+	const auto compression = Compression::stats();
+	write_header(out, "dvm_compressed_bodies_total", "counter", "Bodies compressed natively");
+	write_value(out, "dvm_compressed_bodies_total", "", compression.bodies);
+	write_header(out, "dvm_compressed_in_bytes_total", "counter", "Bytes before compression");
+	write_value(out, "dvm_compressed_in_bytes_total", "", compression.bytes_in);
+	write_header(out, "dvm_compressed_out_bytes_total", "counter", "Bytes after compression");
+	write_value(out, "dvm_compressed_out_bytes_total", "", compression.bytes_out);
+	write_header(out, "dvm_compressed_reused_total", "counter", "Responses served from precompressed static bodies");
+	write_value(out, "dvm_compressed_reused_total", "", compression.precompressed);
+	write_header(out, "dvm_compression_failed_total", "counter", "Bodies that could not be compressed");
+	write_value(out, "dvm_compression_failed_total", "", compression.failed);
+
+	const auto binaries = BinaryTable::stats();
+	write_header(out, "dvm_binary_loads_total", "counter", "Programs loaded by tenants");
+	write_value(out, "dvm_binary_loads_total", "", binaries.loads);
+	write_header(out, "dvm_binary_shared_total", "counter", "Loads that shared an existing mapping");
+	write_value(out, "dvm_binary_shared_total", "", binaries.shared);
+	write_header(out, "dvm_binary_mapped_bytes", "gauge", "Bytes of distinct programs mapped");
+	write_value(out, "dvm_binary_mapped_bytes", "", binaries.bytes);
+	return out;
+}
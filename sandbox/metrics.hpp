@@ -0,0 +1,111 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#else
+#include <chrono>
+#endif
+struct TenantInstance;
+
+namespace metrics
+{
+	/* Timestamps in ticks of the cheapest clock available. On x86 this
+	   is the (invariant) TSC, which is converted to seconds only when
+	   the metrics are exported. */
+	inline uint64_t now() noexcept
+	{
+	#if defined(__x86_64__)
+		return __rdtsc();
+	#else
+		return std::chrono::steady_clock::now().time_since_epoch().count();
+	#endif
+	}
+	double seconds_per_tick();
+
+	/**
+	 * Histogram with a bucket for every other power of two, which is
+	 * the resolution that is exported. Bucket i counts the values in
+	 * [4^(i-1), 4^i), and bucket 0 counts zeroes.
+	**/
+	struct Histogram
+	{
+		static constexpr size_t BUCKETS = 33;
+
+		static size_t bucket(uint64_t value) noexcept
+		{
+			const unsigned width = (value != 0) ? 64 - __builtin_clzll(value) : 0;
+			return (width + 1) / 2;
+		}
+		/* Number of values below 2^exp, where exp is even */
+		uint64_t count_below_pow2(unsigned exp) const noexcept;
+
+		std::array<uint64_t, BUCKETS> counts {};
+		uint64_t sum   = 0;
+		uint64_t count = 0;
+	};
+}
+
+/**
+ * Always-on metrics of one tenant.
+ *
+ * Every thread records into its own cache-line aligned shard, with
+ * plain relaxed loads and stores, so recording never contends and
+ * never needs an atomic read-modify-write. Shards are only summed
+ * up when someone asks for a snapshot.
+ *
+ * Shards are created by the threads that serve the tenant, and each
+ * thread keeps at most MAX_LOCAL_SHARDS of them. The least recently
+ * used one is merged into the totals of its tenant and freed when a
+ * thread needs another, so that memory follows the tenants that are
+ * active on each thread, and not all tenants times all threads.
+**/
+class TenantMetrics
+{
+public:
+	/* Everything measured during one request */
+	struct Sample {
+		uint64_t fork_ticks   = 0;
+		uint64_t exec_ticks   = 0;
+		uint64_t instructions = 0;
+		uint32_t page_faults  = 0;
+		uint32_t cow_reads    = 0;
+		uint32_t prefaulted   = 0;
+		bool timeout   = false;
+		bool exception = false;
+	};
+	void record(const Sample&) noexcept;
+
+	struct Snapshot {
+		uint64_t requests;
+		uint64_t timeouts;
+		uint64_t exceptions;
+		uint64_t page_faults;
+		uint64_t cow_reads;
+		uint64_t prefaulted;
+		metrics::Histogram fork_ticks;
+		metrics::Histogram exec_ticks;
+		metrics::Histogram instructions;
+	};
+	Snapshot snapshot() const;
+
+	static constexpr size_t MAX_LOCAL_SHARDS = 256;
+
+	TenantMetrics();
+	~TenantMetrics();
+
+	struct Shard;
+	struct Shards;
+private:
+	Shard& local();
+
+	const uint64_t m_id;
+	const std::shared_ptr<Shards> m_shards;
+};
+
+/* Prometheus text exposition of the given tenants and the page pools */
+extern std::string prometheus_metrics(const std::vector<std::shared_ptr<TenantInstance>>&);
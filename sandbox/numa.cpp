@@ -0,0 +1,145 @@
+#include "numa.hpp"
+
+#include <atomic>
+#include <exception>
+#include <fstream>
+#include <sched.h>
+#include <string>
+#include <thread>
+
+static std::atomic<bool> replication { false };
+/* The node a pinned thread belongs to, or -1 */
+static thread_local int pinned_node = -1;
+
+struct Topology
+{
+	std::vector<std::vector<int>> cpus;
+	/* Indexed by CPU number */
+	std::vector<int> node_of;
+
+	Topology();
+};
+
+/* Parses lists like "0-3,8-11" */
+static std::vector<int> parse_list(const std::string& list)
+{
+	std::vector<int> result;
+	size_t pos = 0;
+	while (pos < list.size()) {
+		size_t end = list.find(',', pos);
+		if (end == std::string::npos)
+			end = list.size();
+		const std::string range = list.substr(pos, end - pos);
+		const size_t dash = range.find('-');
+		try {
+			const int first = std::stoi(range.substr(0, dash));
+			const int last = (dash == std::string::npos) ? first : std::stoi(range.substr(dash + 1));
+			for (int i = first; i <= last; i++)
+				result.push_back(i);
+		} catch (const std::exception&) {
+			/* Trailing newlines and the like */
+		}
+		pos = end + 1;
+	}
+	return result;
+}
+static std::string read_line(const std::string& path)
+{
+	std::ifstream file(path);
+	std::string line;
+	std::getline(file, line);
+	return line;
+}
+
+Topology::Topology()
+{
+	const auto nodes = parse_list(read_line("/sys/devices/system/node/online"));
+	for (const int node : nodes) {
+		auto list = parse_list(read_line(
+			"/sys/devices/system/node/node" + std::to_string(node) + "/cpulist"));
+		/* Memory-only nodes have no cores to run on */
+		if (!list.empty())
+			cpus.push_back(std::move(list));
+	}
+	if (cpus.empty()) {
+		cpus.emplace_back();
+		for (unsigned i = 0; i < std::max(1u, std::thread::hardware_concurrency()); i++)
+			cpus.back().push_back(i);
+	}
+	for (size_t node = 0; node < cpus.size(); node++) {
+		for (const int cpu : cpus[node]) {
+			if (size_t(cpu) >= node_of.size())
+				node_of.resize(cpu + 1, 0);
+			node_of[cpu] = node;
+		}
+	}
+}
+static const Topology& topology()
+{
+	static const Topology topo;
+	return topo;
+}
+
+void Numa::configure(const Config& config)
+{
+	replication = config.replicate && nodes() > 1;
+}
+bool Numa::replicate() noexcept
+{
+	return replication.load(std::memory_order_relaxed);
+}
+
+size_t Numa::nodes()
+{
+	return topology().cpus.size();
+}
+const std::vector<int>& Numa::cpus(size_t node)
+{
+	return topology().cpus.at(node);
+}
+
+size_t Numa::current_node() noexcept
+{
+	if (pinned_node >= 0)
+		return pinned_node;
+	const int cpu = sched_getcpu();
+	const auto& node_of = topology().node_of;
+	return (cpu >= 0 && size_t(cpu) < node_of.size()) ? node_of[cpu] : 0;
+}
+
+static bool bind(const std::vector<int>& cpus)
+{
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (const int cpu : cpus)
+		CPU_SET(cpu, &set);
+	return sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+bool Numa::pin_io_thread(size_t index)
+{
+	const size_t node = index % nodes();
+	const auto& list = cpus(node);
+	if (!bind({list[(index / nodes()) % list.size()]}))
+		return false;
+	pinned_node = node;
+	return true;
+}
+
+void Numa::run_on_node(size_t node, const std::function<void()>& func)
+{
+	std::exception_ptr failure = nullptr;
+	std::thread thread([&] {
+		/* Unbound, the memory still works, just from further away */
+		if (bind(cpus(node)))
+			pinned_node = node;
+		try {
+			func();
+		} catch (...) {
+			failure = std::current_exception();
+		}
+	});
+	thread.join();
+	if (failure)
+		std::rethrow_exception(failure);
+}
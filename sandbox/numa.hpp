@@ -0,0 +1,38 @@
+#pragma once
+#include <cstddef>
+#include <functional>
+#include <vector>
+
+/**
+ * NUMA topology, as reported by sysfs, and placement of threads.
+ *
+ * With replication enabled, the main VM of every program is copied to
+ * each node, on a thread bound to that node, so that its pages are
+ * allocated locally (first touch). Forks then read copy-on-write
+ * pages from the replica of the node they run on, instead of reaching
+ * across the interconnect on every request.
+ *
+ * Nodes are numbered 0..nodes()-1 here, in the order of the node ids,
+ * which don't have to be contiguous. Without NUMA there is one node.
+**/
+class Numa
+{
+public:
+	struct Config {
+		/* One main VM per node for every program */
+		bool replicate = false;
+	};
+	static void configure(const Config&);
+	static bool replicate() noexcept;
+
+	static size_t nodes();
+	static const std::vector<int>& cpus(size_t node);
+	/* The node of the calling thread, cached for pinned threads */
+	static size_t current_node() noexcept;
+
+	/* Pins the calling thread to one core. IO threads are spread over
+	   the nodes round-robin, and then over the cores of each node. */
+	static bool pin_io_thread(size_t index);
+	/* Runs func on a thread bound to the cores of the node, and waits */
+	static void run_on_node(size_t node, const std::function<void()>& func);
+};
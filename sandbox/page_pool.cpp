@@ -0,0 +1,177 @@
+#include "page_pool.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <sys/mman.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+static PagePool::Config pool_config;
+static std::mutex pools_mtx;
+static std::vector<PagePool*> pools;
+
+PagePool& PagePool::local()
+{
+	static thread_local PagePool pool;
+	return pool;
+}
+
+void PagePool::configure(const Config& config)
+{
+	std::lock_guard<std::mutex> lock(pools_mtx);
+	pool_config = config;
+}
+
+std::vector<PagePool::Stats> PagePool::all_stats()
+{
+	std::lock_guard<std::mutex> lock(pools_mtx);
+	std::vector<Stats> result;
+	for (const auto* pool : pools)
+		result.push_back(pool->stats());
+	return result;
+}
+
+PagePool::PagePool()
+{
+	std::lock_guard<std::mutex> lock(pools_mtx);
+	pools.push_back(this);
+}
+PagePool::~PagePool()
+{
+	{
+		std::lock_guard<std::mutex> lock(pools_mtx);
+		pools.erase(std::find(pools.begin(), pools.end(), this));
+	}
+	for (const auto base : m_slabs)
+		munmap((void*) base, SLAB_SIZE);
+}
+
+static inline void zero_page(void* page)
+{
+#ifdef __SSE2__
+	/* Non-temporal stores avoid evicting the working set
+	   of the request for a page that is mostly unused. */
+	auto* dst = (__m128i*) page;
+	const __m128i zero = _mm_setzero_si128();
+	for (size_t i = 0; i < PagePool::PAGE_SIZE / sizeof(__m128i); i += 4) {
+		_mm_stream_si128(&dst[i+0], zero);
+		_mm_stream_si128(&dst[i+1], zero);
+		_mm_stream_si128(&dst[i+2], zero);
+		_mm_stream_si128(&dst[i+3], zero);
+	}
+	_mm_sfence();
+#else
+	std::memset(page, 0, PagePool::PAGE_SIZE);
+#endif
+}
+
+static char* allocate_slab(bool huge_pages)
+{
+	if (huge_pages) {
+		void* ptr = mmap(nullptr, PagePool::SLAB_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (ptr != MAP_FAILED)
+			return (char*) ptr;
+	}
+	/* Over-allocate in order to align the slab to its size,
+	   which also allows transparent huge pages. */
+	const size_t size = 2 * PagePool::SLAB_SIZE;
+	char* ptr = (char*) mmap(nullptr, size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ptr == MAP_FAILED)
+		return nullptr;
+	const uintptr_t base = ((uintptr_t) ptr + PagePool::SLAB_SIZE - 1) & ~(PagePool::SLAB_SIZE - 1);
+	char* slab = (char*) base;
+	if (slab > ptr)
+		munmap(ptr, slab - ptr);
+	if (slab + PagePool::SLAB_SIZE < ptr + size)
+		munmap(slab + PagePool::SLAB_SIZE, (ptr + size) - (slab + PagePool::SLAB_SIZE));
+	if (huge_pages)
+		madvise(slab, PagePool::SLAB_SIZE, MADV_HUGEPAGE);
+	return slab;
+}
+
+bool PagePool::grow()
+{
+	Config config;
+	{
+		std::lock_guard<std::mutex> lock(pools_mtx);
+		config = pool_config;
+	}
+	if ((m_slabs.size() + 1) * SLAB_PAGES > config.max_pages)
+		return false;
+
+	char* slab = allocate_slab(config.huge_pages);
+	if (slab == nullptr)
+		return false;
+
+	m_slabs.insert(std::upper_bound(m_slabs.begin(), m_slabs.end(), (uintptr_t) slab),
+		(uintptr_t) slab);
+	m_fresh = slab;
+	m_fresh_left = SLAB_PAGES;
+	bump(m_resident, SLAB_PAGES);
+	return true;
+}
+
+bool PagePool::owns(const riscv::PageData* page) const noexcept
+{
+	const uintptr_t base = (uintptr_t) page & ~(SLAB_SIZE - 1);
+	return std::binary_search(m_slabs.begin(), m_slabs.end(), base);
+}
+
+riscv::PageData* PagePool::allocate(riscv::PageData::Initialization init)
+{
+	bump(m_in_use);
+	if (m_free != nullptr) {
+		FreePage* page = m_free;
+		m_free = page->next;
+		bump(m_hits);
+		bump(m_free_count, -1);
+
+		auto* pagedata = new (page) riscv::PageData(riscv::PageData::UNINITIALIZED);
+		if (init == riscv::PageData::INITIALIZED)
+			zero_page(pagedata);
+		return pagedata;
+	}
+
+	bump(m_misses);
+	if (m_fresh_left > 0 || this->grow()) {
+		/* Fresh pages from mmap are already zeroed */
+		char* page = m_fresh;
+		m_fresh += PAGE_SIZE;
+		m_fresh_left--;
+		return new (page) riscv::PageData(riscv::PageData::UNINITIALIZED);
+	}
+
+	/* Above the high-water mark */
+	bump(m_overflow);
+	return new riscv::PageData(init);
+}
+
+void PagePool::release(riscv::PageData* pagedata) noexcept
+{
+	bump(m_in_use, -1);
+	if (UNLIKELY(!this->owns(pagedata))) {
+		delete pagedata;
+		return;
+	}
+	auto* page = (FreePage*) pagedata;
+	page->next = m_free;
+	m_free = page;
+	bump(m_free_count);
+}
+
+PagePool::Stats PagePool::stats() const noexcept
+{
+	return {
+		.hits     = m_hits.load(std::memory_order_relaxed),
+		.misses   = m_misses.load(std::memory_order_relaxed),
+		.overflow = m_overflow.load(std::memory_order_relaxed),
+		.resident = m_resident.load(std::memory_order_relaxed),
+		.free     = m_free_count.load(std::memory_order_relaxed),
+		.in_use   = m_in_use.load(std::memory_order_relaxed),
+	};
+}
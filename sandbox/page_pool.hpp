@@ -0,0 +1,78 @@
+#pragma once
+#include <libriscv/page.hpp>
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+/**
+ * Per-thread pool of page data loaned to forked sandboxes.
+ *
+ * Pages are carved out of 2MB slabs, optionally backed by huge pages,
+ * and returned to an intrusive free-list without copying. Slabs are
+ * allocated up to a high-water mark, after which pages come from the
+ * regular heap and are freed on release. Pages are only zeroed when
+ * the sandbox asks for an initialized page, and never when they come
+ * fresh from a slab.
+ *
+ * A page must be released on the thread that allocated it.
+**/
+class PagePool
+{
+public:
+	static constexpr size_t PAGE_SIZE  = sizeof(riscv::PageData);
+	static constexpr size_t SLAB_SIZE  = 2ul << 20;
+	static constexpr size_t SLAB_PAGES = SLAB_SIZE / PAGE_SIZE;
+
+	struct Config {
+		/* Maximum number of slab pages per thread */
+		size_t max_pages = 16384;
+		/* Use MAP_HUGETLB for slabs, with fallback to THP */
+		bool huge_pages = false;
+	};
+	struct Stats {
+		uint64_t hits;     /* Served from the free-list */
+		uint64_t misses;   /* Fresh slab pages or heap pages */
+		uint64_t overflow; /* Heap pages beyond the high-water mark */
+		uint64_t resident; /* Pages held by slabs */
+		uint64_t free;     /* Pages in the free-list */
+		uint64_t in_use;   /* Pages currently loaned out */
+	};
+
+	static PagePool& local();
+	/* Applies to slabs created after the call */
+	static void configure(const Config&);
+	/* The stats of every live thread pool */
+	static std::vector<Stats> all_stats();
+
+	riscv::PageData* allocate(riscv::PageData::Initialization);
+	void release(riscv::PageData*) noexcept;
+	Stats stats() const noexcept;
+
+	PagePool();
+	~PagePool();
+
+private:
+	struct FreePage {
+		FreePage* next;
+	};
+	bool grow();
+	bool owns(const riscv::PageData*) const noexcept;
+	static void bump(std::atomic<uint64_t>& counter, int64_t n = 1) noexcept {
+		/* Single writer, so no need for a locked add */
+		counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+	}
+
+	FreePage* m_free = nullptr;
+	/* Never-used pages at the end of the newest slab are already zero */
+	char*  m_fresh = nullptr;
+	size_t m_fresh_left = 0;
+	/* Sorted slab base addresses */
+	std::vector<uintptr_t> m_slabs;
+
+	std::atomic<uint64_t> m_hits { 0 };
+	std::atomic<uint64_t> m_misses { 0 };
+	std::atomic<uint64_t> m_overflow { 0 };
+	std::atomic<uint64_t> m_resident { 0 };
+	std::atomic<uint64_t> m_free_count { 0 };
+	std::atomic<uint64_t> m_in_use { 0 };
+};
@@ -0,0 +1,263 @@
+#include "primitives.hpp"
+
+#include <array>
+#include <cstring>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+/* Longer needles are searched for without the AVX2 prefilter */
+static constexpr size_t MAX_PREFILTER_NEEDLE = 32;
+
+/* Bytes that the escapers and decoders have to look at. The rest is
+   copied in runs, found 32 bytes at a time where AVX2 is available. */
+#ifdef __AVX2__
+static inline uint32_t mask_eq(__m256i v, char c)
+{
+	return _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(c)));
+}
+#endif
+
+struct HtmlSpecial {
+	static bool test(uint8_t c) {
+		return c == '&' || c == '<' || c == '>' || c == '"' || c == '\'';
+	}
+#ifdef __AVX2__
+	static uint32_t mask(__m256i v) {
+		return mask_eq(v, '&') | mask_eq(v, '<') | mask_eq(v, '>')
+			| mask_eq(v, '"') | mask_eq(v, '\'');
+	}
+#endif
+};
+struct JsonSpecial {
+	static bool test(uint8_t c) {
+		return c < 0x20 || c == '"' || c == '\\';
+	}
+#ifdef __AVX2__
+	static uint32_t mask(__m256i v) {
+		/* Unsigned c <= 0x1F is max(c, 0x1F) == 0x1F */
+		const __m256i limit = _mm256_set1_epi8(0x1F);
+		const __m256i control = _mm256_cmpeq_epi8(_mm256_max_epu8(v, limit), limit);
+		return _mm256_movemask_epi8(control) | mask_eq(v, '"') | mask_eq(v, '\\');
+	}
+#endif
+};
+struct UrlSpecial {
+	static bool test(uint8_t c) {
+		return c == '%' || c == '+';
+	}
+#ifdef __AVX2__
+	static uint32_t mask(__m256i v) {
+		return mask_eq(v, '%') | mask_eq(v, '+');
+	}
+#endif
+};
+
+/* The length of the prefix without special bytes */
+template <typename Special>
+static size_t plain_run(const char* data, size_t len)
+{
+	size_t i = 0;
+#ifdef __AVX2__
+	for (; i + 32 <= len; i += 32) {
+		const uint32_t mask = Special::mask(_mm256_loadu_si256((const __m256i*) (data + i)));
+		if (mask != 0)
+			return i + __builtin_ctz(mask);
+	}
+#endif
+	while (i < len && !Special::test(data[i]))
+		i++;
+	return i;
+}
+
+/* Calls special() for every special byte, and appends the rest */
+template <typename Special, typename Func>
+static bool transform(std::string_view data, std::string& out, Func special)
+{
+	out.reserve(out.size() + data.size());
+	while (true) {
+		const size_t run = plain_run<Special>(data.data(), data.size());
+		out.append(data.data(), run);
+		data.remove_prefix(run);
+		if (data.empty())
+			return true;
+		if (!special(data, out))
+			return false;
+	}
+}
+
+size_t primitives::find(std::string_view haystack, std::string_view needle) noexcept
+{
+	const size_t k = needle.size();
+	if (k == 0)
+		return 0;
+	if (k > haystack.size())
+		return npos;
+	const char* h = haystack.data();
+	size_t i = 0;
+#ifdef __AVX2__
+	/* Candidates have both the first and the last byte of the needle
+	   in place, and only those are compared in full. Each comparison
+	   costs up to the length of the needle, so only short ones. */
+	const size_t last = haystack.size() - k; /* The last possible offset */
+	const __m256i first = _mm256_set1_epi8(needle[0]);
+	const __m256i tail = _mm256_set1_epi8(needle[k-1]);
+	for (; k <= MAX_PREFILTER_NEEDLE && i + 31 <= last; i += 32) {
+		const __m256i a = _mm256_loadu_si256((const __m256i*) (h + i));
+		const __m256i b = _mm256_loadu_si256((const __m256i*) (h + i + k - 1));
+		uint32_t mask = _mm256_movemask_epi8(
+			_mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, tail)));
+		for (; mask != 0; mask &= mask - 1) {
+			const size_t pos = i + __builtin_ctz(mask);
+			if (k <= 2 || std::memcmp(h + pos + 1, needle.data() + 1, k - 2) == 0)
+				return pos;
+		}
+	}
+#endif
+	/* glibc's memmem is linear in the haystack for any needle,
+	   with the Two-Way algorithm for long ones */
+	const void* found = memmem(h + i, haystack.size() - i, needle.data(), k);
+	return (found != nullptr) ? size_t((const char*) found - h) : npos;
+}
+
+static constexpr char BASE64[] =
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static constexpr auto gen_base64_values()
+{
+	std::array<uint8_t, 256> values {};
+	for (auto& value : values)
+		value = 0xFF;
+	for (int i = 0; i < 64; i++)
+		values[(uint8_t) BASE64[i]] = i;
+	return values;
+}
+
+void primitives::base64_encode(std::string_view data, std::string& out)
+{
+	const size_t start = out.size();
+	out.resize(start + base64_length(data.size()));
+	char* dst = &out[start];
+	const auto* src = (const uint8_t*) data.data();
+	size_t len = data.size();
+	for (; len >= 3; src += 3, len -= 3, dst += 4) {
+		const uint32_t v = (src[0] << 16) | (src[1] << 8) | src[2];
+		dst[0] = BASE64[v >> 18];
+		dst[1] = BASE64[(v >> 12) & 63];
+		dst[2] = BASE64[(v >> 6) & 63];
+		dst[3] = BASE64[v & 63];
+	}
+	if (len > 0) {
+		const uint32_t v = (src[0] << 16) | ((len > 1) ? (src[1] << 8) : 0);
+		dst[0] = BASE64[v >> 18];
+		dst[1] = BASE64[(v >> 12) & 63];
+		dst[2] = (len > 1) ? BASE64[(v >> 6) & 63] : '=';
+		dst[3] = '=';
+	}
+}
+
+bool primitives::base64_decode(std::string_view data, std::string& out)
+{
+	static constexpr auto values = gen_base64_values();
+	for (int i = 0; i < 2 && !data.empty() && data.back() == '='; i++)
+		data.remove_suffix(1);
+	if (data.size() % 4 == 1)
+		return false;
+
+	const size_t start = out.size();
+	out.resize(start + data.size() / 4 * 3 + (data.size() % 4 ? data.size() % 4 - 1 : 0));
+	char* dst = &out[start];
+	const auto* src = (const uint8_t*) data.data();
+	size_t len = data.size();
+	for (; len >= 4; src += 4, len -= 4, dst += 3) {
+		const uint32_t a = values[src[0]], b = values[src[1]];
+		const uint32_t c = values[src[2]], d = values[src[3]];
+		if ((a | b | c | d) & 0x80)
+			return false;
+		const uint32_t v = (a << 18) | (b << 12) | (c << 6) | d;
+		dst[0] = v >> 16;
+		dst[1] = v >> 8;
+		dst[2] = v;
+	}
+	if (len > 0) {
+		uint32_t v = 0;
+		for (size_t i = 0; i < len; i++) {
+			const uint32_t value = values[src[i]];
+			if (value & 0x80)
+				return false;
+			v |= value << (18 - 6 * i);
+		}
+		dst[0] = v >> 16;
+		if (len > 2)
+			dst[1] = v >> 8;
+	}
+	return true;
+}
+
+static int hex_value(char c)
+{
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+bool primitives::url_decode(std::string_view data, std::string& out, bool form)
+{
+	return transform<UrlSpecial>(data, out,
+		[form] (std::string_view& data, std::string& out) {
+			if (data[0] == '+') {
+				out += form ? ' ' : '+';
+				data.remove_prefix(1);
+				return true;
+			}
+			if (data.size() < 3)
+				return false;
+			const int hi = hex_value(data[1]), lo = hex_value(data[2]);
+			if (hi < 0 || lo < 0)
+				return false;
+			out += char(hi * 16 + lo);
+			data.remove_prefix(3);
+			return true;
+		});
+}
+
+void primitives::escape_html(std::string_view data, std::string& out)
+{
+	transform<HtmlSpecial>(data, out,
+		[] (std::string_view& data, std::string& out) {
+			switch (data[0]) {
+			case '&':  out += "&amp;"; break;
+			case '<':  out += "&lt;"; break;
+			case '>':  out += "&gt;"; break;
+			case '"':  out += "&quot;"; break;
+			default:   out += "&#39;"; break;
+			}
+			data.remove_prefix(1);
+			return true;
+		});
+}
+
+void primitives::escape_json(std::string_view data, std::string& out)
+{
+	transform<JsonSpecial>(data, out,
+		[] (std::string_view& data, std::string& out) {
+			const char c = data[0];
+			switch (c) {
+			case '"':  out += "\\\""; break;
+			case '\\': out += "\\\\"; break;
+			case '\b': out += "\\b"; break;
+			case '\f': out += "\\f"; break;
+			case '\n': out += "\\n"; break;
+			case '\r': out += "\\r"; break;
+			case '\t': out += "\\t"; break;
+			default: {
+				static constexpr char hex[] = "0123456789abcdef";
+				const char escape[] = { '\\', 'u', '0', '0', hex[(c >> 4) & 0xF], hex[c & 0xF] };
+				out.append(escape, sizeof(escape));
+			}
+			}
+			data.remove_prefix(1);
+			return true;
+		});
+}
@@ -0,0 +1,40 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+/**
+ * String, encoding and escaping primitives that guests call natively.
+ *
+ * Where it pays off, bytes that need no work are skipped 32 at a time
+ * with AVX2, when the host was built with it (NATIVE). Everything has
+ * a portable version, which is what runs otherwise. Checksums are in
+ * crc32.hpp, which the guest can use too.
+**/
+namespace primitives
+{
+	static constexpr size_t npos = std::string_view::npos;
+
+	/* The offset of the first occurrence of needle, or npos, in time
+	   linear in the haystack, whatever the needle */
+	size_t find(std::string_view haystack, std::string_view needle) noexcept;
+
+	inline constexpr size_t base64_length(size_t len) { return (len + 2) / 3 * 4; }
+	/* Standard alphabet with padding. Appends to out. */
+	void base64_encode(std::string_view data, std::string& out);
+	/* Accepts missing padding, returns false on anything else */
+	bool base64_decode(std::string_view data, std::string& out);
+
+	/* Percent-decoding, and '+' as space for form data. Returns false
+	   on an invalid escape. */
+	bool url_decode(std::string_view data, std::string& out, bool form = false);
+
+	/* & < > " ' as entities */
+	void escape_html(std::string_view data, std::string& out);
+	/* The inside of a JSON string: quotes, backslashes and control
+	   characters. Other bytes, including UTF-8, are kept. */
+	void escape_json(std::string_view data, std::string& out);
+	/* Escaped output is at most this long */
+	inline constexpr size_t escaped_length(size_t len) { return len * 6; }
+}
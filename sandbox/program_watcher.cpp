@@ -0,0 +1,147 @@
+#include "program_watcher.hpp"
+
+#include <climits>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#include "machine_instance.hpp"
+#include "tenant_instance.hpp"
+
+static std::pair<std::string, std::string> split_path(const std::string& filename)
+{
+	char resolved[PATH_MAX];
+	std::string path = filename;
+	if (realpath(filename.c_str(), resolved) != nullptr)
+		path = resolved;
+	const size_t slash = path.find_last_of('/');
+	if (slash == std::string::npos)
+		return {".", path};
+	return {path.substr(0, slash), path};
+}
+
+ProgramWatcher::ProgramWatcher()
+{
+	m_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (m_inotify_fd < 0)
+		fprintf(stderr, "ProgramWatcher: inotify unavailable, only manual reloads\n");
+	m_thread = std::thread(&ProgramWatcher::background, this);
+}
+ProgramWatcher::~ProgramWatcher()
+{
+	m_running = false;
+	m_thread.join();
+	if (m_inotify_fd >= 0)
+		close(m_inotify_fd);
+}
+
+void ProgramWatcher::watch(const SharedTenant& tenant)
+{
+	const auto [dir, path] = split_path(tenant->config.filename);
+
+	std::lock_guard<std::mutex> lock(m_mtx);
+	m_files.emplace(path, tenant);
+	if (m_inotify_fd < 0)
+		return;
+	/* Editors and deploy scripts usually replace the file, which
+	   a watch on the file itself would not survive. */
+	const int wd = inotify_add_watch(m_inotify_fd, dir.c_str(),
+		IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE);
+	if (wd < 0) {
+		fprintf(stderr, "ProgramWatcher: Could not watch %s\n", dir.c_str());
+		return;
+	}
+	m_dirs[wd] = dir;
+}
+
+void ProgramWatcher::reload(const SharedTenant& tenant)
+{
+	std::lock_guard<std::mutex> lock(m_mtx);
+	m_pending.emplace_back(tenant, clock::now());
+}
+
+void ProgramWatcher::background()
+{
+	while (m_running)
+	{
+		if (m_inotify_fd >= 0) {
+			struct pollfd pfd { m_inotify_fd, POLLIN, 0 };
+			if (poll(&pfd, 1, 50) > 0)
+				this->read_events();
+		} else {
+			std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		}
+		this->run_reloads();
+		this->release_retired();
+	}
+}
+
+void ProgramWatcher::read_events()
+{
+	alignas(struct inotify_event) char buffer[4096];
+	ssize_t len;
+	while ((len = read(m_inotify_fd, buffer, sizeof(buffer))) > 0)
+	{
+		std::lock_guard<std::mutex> lock(m_mtx);
+		const auto due = clock::now() + DEBOUNCE;
+		for (char* ptr = buffer; ptr < buffer + len; ) {
+			const auto* event = (const struct inotify_event*) ptr;
+			ptr += sizeof(struct inotify_event) + event->len;
+
+			auto dir = m_dirs.find(event->wd);
+			if (dir == m_dirs.end() || event->len == 0)
+				continue;
+			const std::string path = dir->second + "/" + event->name;
+			auto range = m_files.equal_range(path);
+			for (auto it = range.first; it != range.second; ++it)
+				m_pending.emplace_back(it->second, due);
+		}
+	}
+}
+
+void ProgramWatcher::run_reloads()
+{
+	std::vector<SharedTenant> due;
+	{
+		std::lock_guard<std::mutex> lock(m_mtx);
+		const auto now = clock::now();
+		for (auto it = m_pending.begin(); it != m_pending.end(); ) {
+			if (it->second > now) {
+				++it;
+				continue;
+			}
+			auto tenant = it->first.lock();
+			it = m_pending.erase(it);
+			if (tenant == nullptr)
+				continue;
+			/* Several events for the same file become one reload */
+			bool duplicate = false;
+			for (const auto& other : due)
+				duplicate |= (other == tenant);
+			for (const auto& other : m_pending)
+				duplicate |= (other.first.lock() == tenant);
+			if (!duplicate)
+				due.push_back(std::move(tenant));
+		}
+	}
+	for (const auto& tenant : due)
+	{
+		std::shared_ptr<MachineInstance> replaced;
+		if (tenant->reload(replaced)) {
+			printf("Reloaded program for '%s' from %s\n",
+				tenant->config.name.c_str(), tenant->config.filename.c_str());
+			if (replaced != nullptr)
+				m_retired.push_back(std::move(replaced));
+		}
+	}
+}
+
+void ProgramWatcher::release_retired()
+{
+	/* Once we hold the only reference, nobody can get a new one */
+	for (auto it = m_retired.begin(); it != m_retired.end(); ) {
+		if (it->use_count() == 1)
+			it = m_retired.erase(it);
+		else
+			++it;
+	}
+}
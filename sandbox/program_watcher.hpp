@@ -0,0 +1,61 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+struct TenantInstance;
+struct MachineInstance;
+
+/**
+ * Hot-reloads tenant programs on a background thread.
+ *
+ * The directory of each watched program is monitored with inotify,
+ * and a program is reloaded shortly after it has been written or
+ * moved into place. Reloads can also be requested directly.
+ *
+ * Replaced programs are destroyed on the background thread once the
+ * last in-flight fork has released them, so that the IO threads never
+ * pay for tearing down a program.
+**/
+class ProgramWatcher
+{
+public:
+	using SharedTenant = std::shared_ptr<TenantInstance>;
+
+	void watch(const SharedTenant&);
+	void reload(const SharedTenant&);
+
+	ProgramWatcher();
+	~ProgramWatcher();
+
+private:
+	using clock = std::chrono::steady_clock;
+	/* Coalesces the events of a file being written in several steps */
+	static constexpr auto DEBOUNCE = std::chrono::milliseconds(100);
+
+	void background();
+	void read_events();
+	void run_reloads();
+	void release_retired();
+
+	int m_inotify_fd = -1;
+	std::atomic<bool> m_running = true;
+	std::thread m_thread;
+
+	std::mutex m_mtx;
+	/* inotify watch descriptor to directory */
+	std::unordered_map<int, std::string> m_dirs;
+	/* Full path to the tenants running that program */
+	std::multimap<std::string, std::weak_ptr<TenantInstance>> m_files;
+	/* Pending reloads, and when they are due */
+	std::deque<std::pair<std::weak_ptr<TenantInstance>, clock::time_point>> m_pending;
+
+	/* Only accessed by the background thread */
+	std::vector<std::shared_ptr<MachineInstance>> m_retired;
+};
@@ -0,0 +1,125 @@
+#include "rcu.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+
+namespace rcu
+{
+	/* Thread slot indices are shared by all domains, and recycled
+	   when a thread exits. */
+	static std::mutex          slot_mtx;
+	static std::vector<size_t> free_slots;
+	static std::atomic<size_t> slot_counter { 0 };
+
+	struct ThreadSlot {
+		ThreadSlot()
+		{
+			std::lock_guard<std::mutex> lock(slot_mtx);
+			if (!free_slots.empty()) {
+				index = free_slots.back();
+				free_slots.pop_back();
+				return;
+			}
+			index = slot_counter.fetch_add(1, std::memory_order_relaxed);
+			if (index >= MAX_THREADS) {
+				fprintf(stderr, "rcu: Too many threads (max %zu)\n", MAX_THREADS);
+				std::abort();
+			}
+		}
+		~ThreadSlot()
+		{
+			std::lock_guard<std::mutex> lock(slot_mtx);
+			free_slots.push_back(index);
+		}
+		size_t index;
+	};
+	static thread_local ThreadSlot thread_slot;
+
+	Domain::Slot& Domain::my_slot() noexcept
+	{
+		return m_slots[thread_slot.index];
+	}
+
+	void Domain::read_lock() noexcept
+	{
+		auto& slot = my_slot();
+		if (slot.nesting++ == 0) {
+			slot.epoch.store(m_epoch.load(std::memory_order_relaxed),
+				std::memory_order_relaxed);
+			/* The epoch must be visible before we load any pointer */
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+		}
+	}
+	void Domain::read_unlock() noexcept
+	{
+		auto& slot = my_slot();
+		if (--slot.nesting == 0)
+			slot.epoch.store(0, std::memory_order_release);
+	}
+
+	uint64_t Domain::oldest_reader() const noexcept
+	{
+		uint64_t oldest = UINT64_MAX;
+		const size_t count = std::min(
+			slot_counter.load(std::memory_order_acquire), MAX_THREADS);
+		for (size_t i = 0; i < count; i++) {
+			const uint64_t e = m_slots[i].epoch.load(std::memory_order_acquire);
+			if (e != 0 && e < oldest)
+				oldest = e;
+		}
+		return oldest;
+	}
+
+	void Domain::retire(std::function<void()> deleter)
+	{
+		/* Readers that observe an epoch newer than this one
+		   cannot have seen the retired object. */
+		const uint64_t epoch = m_epoch.fetch_add(1, std::memory_order_seq_cst);
+		std::lock_guard<std::mutex> lock(m_retire_mtx);
+		m_retired.push_back({epoch, std::move(deleter)});
+	}
+
+	void Domain::reclaim()
+	{
+		std::vector<Retired> expired;
+		{
+			std::lock_guard<std::mutex> lock(m_retire_mtx);
+			if (m_retired.empty())
+				return;
+			const uint64_t oldest = this->oldest_reader();
+			auto it = m_retired.begin();
+			while (it != m_retired.end()) {
+				if (it->epoch < oldest) {
+					expired.push_back(std::move(*it));
+					it = m_retired.erase(it);
+				} else ++it;
+			}
+		}
+		/* Run the deleters outside of the lock */
+		for (auto& retired : expired)
+			retired.deleter();
+	}
+
+	void Domain::synchronize()
+	{
+		while (this->pending() > 0) {
+			this->reclaim();
+			if (this->pending() > 0)
+				std::this_thread::yield();
+		}
+	}
+
+	size_t Domain::pending() const
+	{
+		std::lock_guard<std::mutex> lock(m_retire_mtx);
+		return m_retired.size();
+	}
+
+	Domain& domain()
+	{
+		static Domain rcu_domain;
+		return rcu_domain;
+	}
+}
@@ -0,0 +1,101 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+/**
+ * Epoch-based read-copy-update.
+ *
+ * Readers (the IO threads) publish the global epoch in their own
+ * cache-line sized slot while they hold a ReadGuard, and clear it
+ * again when the guard goes out of scope. Readers never block and
+ * never write to shared cache lines.
+ *
+ * Writers publish a new immutable object with an atomic exchange,
+ * and retire the old one. Retired objects are destroyed only once
+ * every reader slot has either left its critical section or entered
+ * it after the retirement, which is checked from the writer side.
+**/
+namespace rcu
+{
+	static constexpr size_t MAX_THREADS = 1024;
+
+	class Domain
+	{
+	public:
+		struct ReadGuard {
+			ReadGuard(Domain& d) : domain(d) { domain.read_lock(); }
+			~ReadGuard() { domain.read_unlock(); }
+			ReadGuard(const ReadGuard&) = delete;
+			ReadGuard& operator=(const ReadGuard&) = delete;
+		private:
+			Domain& domain;
+		};
+		ReadGuard read() { return ReadGuard{*this}; }
+
+		void read_lock() noexcept;
+		void read_unlock() noexcept;
+
+		/* Defer the destruction of an unpublished object until all
+		   readers that could have seen it have left. Writer-side only. */
+		void retire(std::function<void()> deleter);
+		/* Destroy whatever can be destroyed right now. */
+		void reclaim();
+		/* Block (the writer) until every retired object is destroyed. */
+		void synchronize();
+
+		size_t pending() const;
+
+	private:
+		struct alignas(64) Slot {
+			std::atomic<uint64_t> epoch { 0 };
+			uint32_t nesting = 0;
+		};
+		struct Retired {
+			uint64_t epoch;
+			std::function<void()> deleter;
+		};
+		uint64_t oldest_reader() const noexcept;
+		Slot& my_slot() noexcept;
+
+		alignas(64) std::atomic<uint64_t> m_epoch { 1 };
+		std::array<Slot, MAX_THREADS> m_slots;
+
+		mutable std::mutex m_retire_mtx;
+		std::vector<Retired> m_retired;
+	};
+
+	/* The process-wide domain used by the tenant registry */
+	Domain& domain();
+
+	/**
+	 * A pointer to an immutable T that readers may load without locking,
+	 * and writers replace with update(). T is destroyed via the domain.
+	**/
+	template <typename T>
+	class Pointer
+	{
+	public:
+		Pointer(Domain& d, T* initial = nullptr) : m_domain(d), m_ptr(initial) {}
+		~Pointer() { delete m_ptr.load(std::memory_order_relaxed); }
+
+		/* Only valid while holding a ReadGuard on the same domain */
+		const T* load() const noexcept { return m_ptr.load(std::memory_order_acquire); }
+
+		/* Publish a new object and retire the old one */
+		void update(T* replacement)
+		{
+			T* old = m_ptr.exchange(replacement, std::memory_order_acq_rel);
+			if (old != nullptr)
+				m_domain.retire([old] { delete old; });
+			m_domain.reclaim();
+		}
+
+	private:
+		Domain& m_domain;
+		std::atomic<T*> m_ptr;
+	};
+}
@@ -0,0 +1,136 @@
+#include "regex_table.hpp"
+
+#include <re2/re2.h>
+#include "memory_budget.hpp"
+
+static constexpr size_t PAGE_SIZE = 4096;
+
+RegexTable::RegexTable()
+{
+}
+RegexTable::~RegexTable()
+{
+	this->clear();
+}
+
+int RegexTable::compile(std::string_view pattern, const Limits& limits)
+{
+	if (pattern.size() > MAX_PATTERN_LENGTH || m_count >= limits.max_patterns)
+		return -1;
+
+	/* RE2 stays below max_mem, which is what the pattern is charged */
+	const size_t pages = limits.budgeted ? limits.max_memory / PAGE_SIZE : 0;
+	if (pages > 0 && !MemoryBudget::charge(pages))
+		return -1;
+
+	re2::RE2::Options options;
+	options.set_log_errors(false);
+	options.set_max_mem(limits.max_memory);
+	auto re = std::make_unique<re2::RE2>(
+		re2::StringPiece(pattern.data(), pattern.size()), options);
+	if (!re->ok()) {
+		if (pages > 0)
+			MemoryBudget::release(pages);
+		return -1;
+	}
+
+	m_count++;
+	/* Reuse the slot of a freed pattern */
+	for (size_t i = 0; i < m_patterns.size(); i++) {
+		if (m_patterns[i] == nullptr) {
+			m_patterns[i] = std::move(re);
+			m_pages[i] = pages;
+			return i;
+		}
+	}
+	m_patterns.push_back(std::move(re));
+	m_pages.push_back(pages);
+	return m_patterns.size() - 1;
+}
+
+bool RegexTable::free(uint32_t idx)
+{
+	if (idx >= m_patterns.size() || m_patterns[idx] == nullptr)
+		return false;
+	m_patterns[idx] = nullptr;
+	if (m_pages[idx] > 0)
+		MemoryBudget::release(m_pages[idx]);
+	m_pages[idx] = 0;
+	m_count--;
+	return true;
+}
+int RegexTable::replace(std::string& out, std::string_view subject,
+	const re2::RE2& re, std::string_view rewrite, bool global, size_t max_size)
+{
+	static constexpr int MAX_GROUPS = 10; // \0..\9
+	const re2::StringPiece text(subject.data(), subject.size());
+	const re2::StringPiece rw(rewrite.data(), rewrite.size());
+	const int nvec = 1 + re2::RE2::MaxSubmatch(rw);
+	if (nvec > MAX_GROUPS || nvec > 1 + re.NumberOfCapturingGroups())
+		return 0;
+	re2::StringPiece vec[MAX_GROUPS];
+	const bool utf8 = re.options().encoding() == re2::RE2::Options::EncodingUTF8;
+
+	out.clear();
+	int count = 0;
+	size_t pos = 0;
+	const char* lastend = nullptr;
+	while (pos <= subject.size() && (global || count == 0))
+	{
+		if (!re.Match(text, pos, subject.size(), re2::RE2::UNANCHORED, vec, nvec))
+			break;
+		const size_t start = vec[0].data() - subject.data();
+		out.append(subject.data() + pos, start - pos);
+		if (vec[0].data() == lastend && vec[0].empty()) {
+			/* An empty match right after the previous one: move
+			   ahead by one character, like RE2 does */
+			if (pos >= subject.size())
+				break;
+			size_t n = 1;
+			if (utf8) {
+				while (pos + n < subject.size() && (subject[pos + n] & 0xC0) == 0x80)
+					n++;
+			}
+			out.append(subject.data() + pos, n);
+			pos += n;
+		} else {
+			re.Rewrite(&out, rw, vec, nvec);
+			pos = start + vec[0].size();
+			lastend = vec[0].data() + vec[0].size();
+			count++;
+		}
+		if (out.size() > max_size)
+			return -1;
+	}
+	if (count == 0)
+		return 0;
+	if (out.size() + (subject.size() - pos) > max_size)
+		return -1;
+	out.append(subject.data() + pos, subject.size() - pos);
+	return count;
+}
+
+void RegexTable::assign(const RegexTable& other)
+{
+	this->clear();
+	for (const auto& re : other.m_patterns) {
+		if (re != nullptr) {
+			m_patterns.push_back(std::make_unique<re2::RE2>(re->pattern(), re->options()));
+			m_count++;
+		} else {
+			m_patterns.push_back(nullptr);
+		}
+		m_pages.push_back(0);
+	}
+}
+void RegexTable::clear() noexcept
+{
+	size_t pages = 0;
+	for (const size_t p : m_pages)
+		pages += p;
+	if (pages > 0)
+		MemoryBudget::release(pages);
+	m_patterns.clear();
+	m_pages.clear();
+	m_count = 0;
+}
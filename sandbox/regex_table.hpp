@@ -0,0 +1,70 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+namespace re2 {
+	class RE2;
+}
+
+/**
+ * Compiled regular expressions, referenced by the guest through handles.
+ *
+ * Patterns are compiled with RE2, which matches in linear time with
+ * a lazily built DFA, so no pattern can make a tenant take more time
+ * than the length of the input allows. The memory of each compiled
+ * pattern is bounded too.
+ *
+ * The table of the main VM is filled during on_init and is read-only
+ * afterwards, so every fork shares it without locking. Forks have
+ * their own table for patterns compiled during a request, which is
+ * cleared when the fork is reset or destroyed. Those are limited to
+ * a few per request, and the memory each pattern may use is charged
+ * to the MemoryBudget, the same as the pages of the fork.
+**/
+class RegexTable
+{
+public:
+	static constexpr size_t MAX_PATTERN_LENGTH = 4096;
+
+	struct Limits {
+		size_t max_patterns;
+		/* Memory allowed for the program and DFA of one pattern */
+		int64_t max_memory;
+		/* Whether max_memory is charged to the MemoryBudget */
+		bool budgeted;
+	};
+	static constexpr Limits MAIN_LIMITS { 256, 1 << 20, false };
+	static constexpr Limits FORK_LIMITS { 8, 256 << 10, true };
+
+	/* Returns the index, or -1 if the pattern is invalid, the
+	   table is full or the memory budget has run out */
+	int compile(std::string_view pattern, const Limits&);
+	const re2::RE2* get(uint32_t idx) const noexcept {
+		return (idx < m_patterns.size()) ? m_patterns[idx].get() : nullptr;
+	}
+	bool free(uint32_t idx);
+	void clear() noexcept;
+	/* Compiles the patterns of another table again, under the same
+	   handles, for a table that is not budgeted */
+	void assign(const RegexTable& other);
+
+	/* Substitutes the first (or every) match of re in subject, with
+	   \0..\9 in rewrite referring to the capture groups, the same as
+	   RE2::GlobalReplace. The result is built in out, and the number of
+	   substitutions is returned, or -1 as soon as out would grow beyond
+	   max_size. Nothing is substituted if rewrite refers to a group
+	   that the pattern doesn't have. */
+	static int replace(std::string& out, std::string_view subject,
+		const re2::RE2& re, std::string_view rewrite, bool global, size_t max_size);
+
+	RegexTable();
+	~RegexTable();
+
+private:
+	std::vector<std::unique_ptr<re2::RE2>> m_patterns;
+	/* Budget pages charged for each pattern */
+	std::vector<size_t> m_pages;
+	size_t m_count = 0;
+};
@@ -0,0 +1,235 @@
+#include "response_cache.hpp"
+
+struct ResponseCache::Flight
+{
+	uint64_t    hash;
+	std::string key;
+	/* Collapsed requests, called once the fill has finished */
+	std::vector<ResponseCache::Waiter> waiters;
+};
+
+/* Share of the shard budget for objects that have been hit again */
+static constexpr double PROTECTED_RATIO = 0.8;
+
+ResponseCache::ResponseCache(size_t max_bytes)
+	: m_max_bytes{max_bytes}
+{
+}
+ResponseCache::~ResponseCache()
+{
+}
+
+static bool vary_matches(const std::vector<std::pair<std::string, std::string>>& vary,
+	const ResponseCache::HeaderLookup& header)
+{
+	for (const auto& it : vary) {
+		if (header(it.first) != it.second)
+			return false;
+	}
+	return true;
+}
+
+ResponseCache::Lookup ResponseCache::lookup(const std::string& key, const HeaderLookup& header,
+	Waiter waiter)
+{
+	const uint64_t hash = std::hash<std::string>{}(key);
+	auto& shard = shard_for(hash);
+	std::lock_guard<std::mutex> lock(shard.mtx);
+	const bool waited = (waiter == nullptr);
+
+	const auto now = clock::now();
+	auto range = shard.index.equal_range(hash);
+	for (auto it = range.first; it != range.second; ) {
+		auto entry = it->second;
+		++it;
+		if (entry->key != key)
+			continue;
+		if (entry->expires <= now) {
+			this->erase(shard, entry);
+			continue;
+		}
+		if (vary_matches(entry->vary, header)) {
+			this->touch(shard, entry);
+			if (waited)
+				shard.stats.collapsed++;
+			else
+				shard.stats.hits++;
+			return {entry->object, nullptr};
+		}
+	}
+
+	auto pass = shard.passes.find(key);
+	if (pass != shard.passes.end()) {
+		if (pass->second > now) {
+			shard.stats.passes++;
+			return {nullptr, nullptr};
+		}
+		shard.passes.erase(pass);
+	}
+
+	auto other = shard.flights.find(key);
+	if (other != shard.flights.end()) {
+		/* Someone else is already filling, wait for it once */
+		if (waited) {
+			shard.stats.misses++;
+			return {nullptr, nullptr};
+		}
+		other->second->waiters.push_back(std::move(waiter));
+		return {nullptr, nullptr, true};
+	}
+
+	shard.stats.misses++;
+	auto flight = std::make_shared<Flight>();
+	flight->hash = hash;
+	flight->key  = key;
+	shard.flights.emplace(key, flight);
+	return {nullptr, std::make_unique<Fill>(*this, std::move(flight))};
+}
+
+ResponseCache::Fill::Fill(ResponseCache& cache, std::shared_ptr<Flight> flight)
+	: m_cache{cache}, m_flight{std::move(flight)}
+{
+}
+ResponseCache::Fill::~Fill()
+{
+	if (m_flight != nullptr)
+		m_cache.finish(*m_flight, nullptr);
+}
+
+ResponseCache::Object ResponseCache::Fill::insert(const HeaderLookup& header,
+	const std::vector<std::string>& vary, std::chrono::seconds ttl, CachedResponse response)
+{
+	auto entry = std::make_unique<Entry>();
+	entry->hash = m_flight->hash;
+	entry->key  = m_flight->key;
+	for (const auto& name : vary)
+		entry->vary.emplace_back(name, std::string(header(name)));
+	entry->expires = clock::now() + ttl;
+	entry->bytes = sizeof(Entry) + entry->key.size() + response.body.size()
+		+ response.content_type.size();
+	for (const auto& it : response.headers)
+		entry->bytes += it.first.size() + it.second.size();
+	for (const auto& it : response.encoded)
+		entry->bytes += it.second.size();
+	entry->object = std::make_shared<const CachedResponse>(std::move(response));
+	Object object = entry->object;
+
+	m_cache.finish(*m_flight, std::move(entry));
+	m_flight = nullptr;
+	return object;
+}
+
+void ResponseCache::Fill::cancel()
+{
+	if (m_flight != nullptr)
+		m_cache.finish(*m_flight, nullptr, false);
+	m_flight = nullptr;
+}
+
+void ResponseCache::finish(Flight& flight, std::unique_ptr<Entry> entry, bool pass)
+{
+	auto& shard = shard_for(flight.hash);
+	std::vector<Waiter> waiters;
+	{
+		std::lock_guard<std::mutex> lock(shard.mtx);
+		shard.flights.erase(flight.key);
+
+		/* Without a pass, waiters will just look up the key again */
+		if (entry == nullptr && pass) {
+			/* Forget about old passes once in a while */
+			if (shard.passes.size() >= 1024) {
+				const auto now = clock::now();
+				for (auto it = shard.passes.begin(); it != shard.passes.end(); ) {
+					if (it->second <= now) it = shard.passes.erase(it);
+					else ++it;
+				}
+			}
+			shard.passes[flight.key] = clock::now() + PASS_TTL;
+		}
+		else if (entry != nullptr && entry->bytes <= m_max_bytes / SHARDS) {
+			/* Replace the same variant, if still around */
+			auto range = shard.index.equal_range(flight.hash);
+			for (auto it = range.first; it != range.second; ) {
+				auto old = it->second;
+				++it;
+				if (old->key == entry->key && old->vary == entry->vary)
+					this->erase(shard, old);
+			}
+			/* New objects enter probation */
+			shard.bytes += entry->bytes;
+			shard.probation.push_front(std::move(*entry));
+			shard.index.emplace(flight.hash, shard.probation.begin());
+			shard.stats.inserts++;
+			this->evict(shard);
+		}
+		waiters = std::move(flight.waiters);
+	}
+	for (auto& waiter : waiters)
+		waiter();
+}
+
+void ResponseCache::touch(Shard& shard, EntryList::iterator entry)
+{
+	if (entry->is_protected) {
+		shard.protect.splice(shard.protect.begin(), shard.protect, entry);
+		return;
+	}
+	/* Promote to the protected segment, and demote its
+	   least recently used objects back to probation. */
+	entry->is_protected = true;
+	shard.protect.splice(shard.protect.begin(), shard.probation, entry);
+	shard.protected_bytes += entry->bytes;
+
+	const size_t max_protected = (m_max_bytes / SHARDS) * PROTECTED_RATIO;
+	while (shard.protected_bytes > max_protected && shard.protect.size() > 1) {
+		auto last = std::prev(shard.protect.end());
+		last->is_protected = false;
+		shard.protected_bytes -= last->bytes;
+		shard.probation.splice(shard.probation.begin(), shard.protect, last);
+	}
+}
+
+void ResponseCache::erase(Shard& shard, EntryList::iterator entry)
+{
+	auto range = shard.index.equal_range(entry->hash);
+	for (auto it = range.first; it != range.second; ++it) {
+		if (it->second == entry) {
+			shard.index.erase(it);
+			break;
+		}
+	}
+	shard.bytes -= entry->bytes;
+	if (entry->is_protected) {
+		shard.protected_bytes -= entry->bytes;
+		shard.protect.erase(entry);
+	} else {
+		shard.probation.erase(entry);
+	}
+}
+
+void ResponseCache::evict(Shard& shard)
+{
+	const size_t max_bytes = m_max_bytes / SHARDS;
+	while (shard.bytes > max_bytes) {
+		auto& list = shard.probation.empty() ? shard.protect : shard.probation;
+		this->erase(shard, std::prev(list.end()));
+		shard.stats.evictions++;
+	}
+}
+
+ResponseCache::Stats ResponseCache::stats() const
+{
+	Stats total {};
+	for (const auto& shard : m_shards) {
+		std::lock_guard<std::mutex> lock(shard.mtx);
+		total.hits      += shard.stats.hits;
+		total.misses    += shard.stats.misses;
+		total.collapsed += shard.stats.collapsed;
+		total.passes    += shard.stats.passes;
+		total.inserts   += shard.stats.inserts;
+		total.evictions += shard.stats.evictions;
+		total.objects   += shard.index.size();
+		total.bytes     += shard.bytes;
+	}
+	return total;
+}
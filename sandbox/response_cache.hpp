@@ -0,0 +1,133 @@
+#pragma once
+#include <array>
+#include <chrono>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "compression.hpp"
+
+struct CachedResponse
+{
+	int status = 200;
+	std::string content_type;
+	std::vector<std::pair<std::string, std::string>> headers;
+	std::string body;
+	/* Compressed copies of the body, made when it was inserted */
+	std::vector<std::pair<Encoding, std::string>> encoded;
+};
+
+/**
+ * Per-tenant response cache, controlled by the guest.
+ *
+ * The cache is split into lock-striped shards, each bounded to its
+ * share of the tenant's memory budget and evicted as a segmented LRU:
+ * new objects enter a probation segment and are only promoted to the
+ * protected segment when hit again, so one-off scans cannot flush the
+ * objects that are actually popular.
+ *
+ * Objects are looked up by a key derived from the request, and the
+ * guest decides the TTL and which request headers the object varies
+ * on. Concurrent misses on the same key collapse onto a single fill:
+ * the first request becomes responsible for filling the object, and
+ * the others leave a waiter on it, which is called once the fill has
+ * finished, instead of blocking their thread. Keys that turn out to be
+ * uncacheable are passed for a short while, so that they do not keep
+ * collapsing.
+**/
+class ResponseCache
+{
+public:
+	using clock = std::chrono::steady_clock;
+	using Object = std::shared_ptr<const CachedResponse>;
+	/* Returns the value of a request header, by lower-case name */
+	using HeaderLookup = std::function<std::string_view(const std::string&)>;
+
+	static constexpr size_t SHARDS = 16;
+	/* How long an uncacheable key bypasses request collapsing */
+	static constexpr auto PASS_TTL = std::chrono::seconds(1);
+
+	struct Flight;
+	/* The responsibility of filling an object. Destroying the
+	   fill without inserting marks the key as uncacheable. */
+	class Fill {
+	public:
+		Object insert(const HeaderLookup&, const std::vector<std::string>& vary,
+			std::chrono::seconds ttl, CachedResponse);
+		/* Gives up without marking the key as uncacheable */
+		void cancel();
+
+		Fill(ResponseCache&, std::shared_ptr<Flight>);
+		~Fill();
+	private:
+		ResponseCache& m_cache;
+		std::shared_ptr<Flight> m_flight;
+	};
+
+	/* Called from the thread that finished the fill, after which
+	   the key should be looked up again, without a waiter */
+	using Waiter = std::function<void()>;
+
+	struct Lookup {
+		Object object;
+		/* Set when the caller must fill the object */
+		std::unique_ptr<Fill> fill;
+		/* Set when the waiter was kept, to be called later */
+		bool waiting = false;
+	};
+	/* Without a waiter, a miss that someone else is filling
+	   is returned as a plain miss, and counts as collapsed */
+	Lookup lookup(const std::string& key, const HeaderLookup&, Waiter waiter);
+
+	struct Stats {
+		uint64_t hits;
+		uint64_t misses;
+		uint64_t collapsed; /* Hits after waiting for another fill */
+		uint64_t passes;    /* Uncacheable keys */
+		uint64_t inserts;
+		uint64_t evictions;
+		uint64_t objects;
+		uint64_t bytes;
+	};
+	Stats stats() const;
+	bool enabled() const noexcept { return m_max_bytes > 0; }
+
+	ResponseCache(size_t max_bytes);
+	~ResponseCache();
+
+private:
+	struct Entry {
+		uint64_t hash;
+		std::string key;
+		/* The request header values this object was stored for */
+		std::vector<std::pair<std::string, std::string>> vary;
+		Object object;
+		clock::time_point expires;
+		size_t bytes;
+		bool is_protected = false;
+	};
+	using EntryList = std::list<Entry>;
+	struct Shard {
+		mutable std::mutex mtx;
+		EntryList probation;
+		EntryList protect;
+		std::unordered_multimap<uint64_t, EntryList::iterator> index;
+		std::unordered_map<std::string, std::shared_ptr<Flight>> flights;
+		std::unordered_map<std::string, clock::time_point> passes;
+		size_t bytes = 0;
+		size_t protected_bytes = 0;
+		Stats stats {};
+	};
+	Shard& shard_for(uint64_t hash) { return m_shards[hash % SHARDS]; }
+	void finish(Flight&, std::unique_ptr<Entry>, bool pass = true);
+	void erase(Shard&, EntryList::iterator);
+	void evict(Shard&);
+	void touch(Shard&, EntryList::iterator);
+
+	const size_t m_max_bytes;
+	std::array<Shard, SHARDS> m_shards;
+};
@@ -0,0 +1,180 @@
+#include "route_table.hpp"
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+struct RouteTable::Node
+{
+	/* Literal children, sorted by segment for binary search */
+	std::vector<std::pair<std::string, std::unique_ptr<Node>>> literals;
+	std::unique_ptr<Node> param;
+	std::unique_ptr<Node> wildcard;
+	/* Functions by method bit, and which of them are set */
+	std::array<uint64_t, METHODS> funcs {};
+	unsigned methods = 0;
+
+	Node* find_literal(std::string_view segment) const
+	{
+		auto it = std::lower_bound(literals.begin(), literals.end(), segment,
+			[] (const auto& child, std::string_view seg) { return child.first < seg; });
+		if (it != literals.end() && it->first == segment)
+			return it->second.get();
+		return nullptr;
+	}
+	std::unique_ptr<Node> clone() const
+	{
+		auto node = std::make_unique<Node>();
+		for (const auto& child : literals)
+			node->literals.emplace_back(child.first, child.second->clone());
+		if (param)
+			node->param = param->clone();
+		if (wildcard)
+			node->wildcard = wildcard->clone();
+		node->funcs = funcs;
+		node->methods = methods;
+		return node;
+	}
+	Node& literal(std::string_view segment)
+	{
+		auto it = std::lower_bound(literals.begin(), literals.end(), segment,
+			[] (const auto& child, std::string_view seg) { return child.first < seg; });
+		if (it == literals.end() || it->first != segment)
+			it = literals.emplace(it, std::string(segment), std::make_unique<Node>());
+		return *it->second;
+	}
+};
+
+/* Splits a path into segments, without the leading slash */
+static size_t split(std::string_view path, std::array<std::string_view, RouteTable::MAX_SEGMENTS + 1>& segments)
+{
+	if (!path.empty() && path[0] == '/')
+		path.remove_prefix(1);
+	size_t count = 0;
+	while (count < segments.size()) {
+		const size_t end = path.find('/');
+		segments[count++] = path.substr(0, end);
+		if (end == std::string_view::npos)
+			break;
+		path.remove_prefix(end + 1);
+	}
+	return count;
+}
+
+bool RouteTable::add(unsigned methods, std::string_view pattern, uint64_t func)
+{
+	methods &= (1u << METHODS) - 1;
+	if (methods == 0 || func == 0 || m_count >= MAX_ROUTES
+		|| pattern.empty() || pattern[0] != '/' || pattern.size() > MAX_PATTERN_LENGTH)
+		return false;
+
+	std::array<std::string_view, MAX_SEGMENTS + 1> segments;
+	const size_t count = split(pattern, segments);
+	if (count > MAX_SEGMENTS)
+		return false;
+
+	Node* node = m_root.get();
+	size_t params = 0;
+	for (size_t i = 0; i < count; i++) {
+		const auto segment = segments[i];
+		if (segment == "*") {
+			if (i + 1 != count)
+				return false;
+			if (!node->wildcard)
+				node->wildcard = std::make_unique<Node>();
+			node = node->wildcard.get();
+		} else if (!segment.empty() && segment[0] == ':') {
+			if (++params > RouteParams::MAX)
+				return false;
+			if (!node->param)
+				node->param = std::make_unique<Node>();
+			node = node->param.get();
+		} else {
+			node = &node->literal(segment);
+		}
+	}
+	for (size_t bit = 0; bit < METHODS; bit++) {
+		if (methods & (1u << bit))
+			node->funcs[bit] = func;
+	}
+	node->methods |= methods;
+	m_count++;
+	return true;
+}
+
+namespace {
+	struct Search {
+		const std::array<std::string_view, RouteTable::MAX_SEGMENTS + 1>& segments;
+		size_t count;
+		unsigned method;
+		RouteTable::Match& match;
+	};
+}
+
+/* Depth-first in order of precedence. The first node that has the
+   method wins, while every node matching the path adds its methods
+   to the allowed ones, for a 405. */
+template <typename NodeT>
+static bool search(const NodeT& node, Search& s, size_t i)
+{
+	if (i == s.count) {
+		if (node.methods & s.method) {
+			s.match.func = node.funcs[__builtin_ctz(s.method)];
+			return true;
+		}
+		s.match.allow |= node.methods;
+	} else {
+		const auto segment = s.segments[i];
+		if (const auto* child = node.find_literal(segment)) {
+			if (search(*child, s, i + 1))
+				return true;
+		}
+		if (node.param && !segment.empty()) {
+			auto& params = s.match.params;
+			params.values[params.count++] = segment;
+			if (search(*node.param, s, i + 1))
+				return true;
+			params.count--;
+		}
+	}
+	if (node.wildcard) {
+		const auto& wc = *node.wildcard;
+		if (wc.methods & s.method) {
+			s.match.func = wc.funcs[__builtin_ctz(s.method)];
+			return true;
+		}
+		s.match.allow |= wc.methods;
+	}
+	return false;
+}
+
+RouteTable::Match RouteTable::match(unsigned method, std::string_view path) const
+{
+	Match match;
+	if (method == 0 || (method & (method - 1)) != 0)
+		return match;
+
+	std::array<std::string_view, MAX_SEGMENTS + 1> segments;
+	const size_t count = split(path, segments);
+	if (count > MAX_SEGMENTS)
+		return match;
+	Search s { segments, count, method, match };
+	search(*m_root, s, 0);
+	if (match.func != 0)
+		match.allow = 0;
+	return match;
+}
+
+RouteTable::RouteTable()
+	: m_root{std::make_unique<Node>()}
+{
+}
+RouteTable::~RouteTable()
+{
+}
+RouteTable& RouteTable::operator=(const RouteTable& other)
+{
+	m_root = other.m_root->clone();
+	m_count = other.m_count;
+	return *this;
+}
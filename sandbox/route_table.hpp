@@ -0,0 +1,61 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <string_view>
+
+/* Values captured by :name segments of the route that matched */
+struct RouteParams
+{
+	static constexpr size_t MAX = 8;
+	std::array<std::string_view, MAX> values;
+	size_t count = 0;
+};
+
+/**
+ * Method and path patterns registered by a program, mapped to the
+ * guest functions that handle them.
+ *
+ * Patterns are split into segments on '/', and each segment is one of
+ *   "users"   a literal, matched exactly
+ *   ":id"     any single non-empty segment, captured as a parameter
+ *   "*"       the rest of the path, which can be empty, only as the
+ *             last segment
+ * Literals take precedence over parameters, which take precedence
+ * over wildcards, and the search backtracks when a more specific
+ * branch does not lead to a match.
+ *
+ * The table of the main VM is filled during initialization and is
+ * read-only afterwards, so every thread matches without locking.
+**/
+class RouteTable
+{
+public:
+	static constexpr size_t MAX_ROUTES = 256;
+	static constexpr size_t MAX_PATTERN_LENGTH = 1024;
+	static constexpr size_t MAX_SEGMENTS = 32;
+	/* The methods of ROUTE_GET and the rest, as bit indices */
+	static constexpr size_t METHODS = 7;
+
+	struct Match {
+		/* The function to call, 0 if the path or the method didn't match */
+		uint64_t func = 0;
+		/* Methods of the path when only the method didn't match */
+		unsigned allow = 0;
+		RouteParams params;
+	};
+
+	/* Returns false if the pattern is invalid or the table is full */
+	bool add(unsigned methods, std::string_view pattern, uint64_t func);
+	Match match(unsigned method, std::string_view path) const;
+	bool empty() const noexcept { return m_count == 0; }
+
+	RouteTable();
+	~RouteTable();
+	RouteTable& operator=(const RouteTable&);
+
+private:
+	struct Node;
+	std::unique_ptr<Node> m_root;
+	size_t m_count = 0;
+};
@@ -1,3 +1,19 @@
 #pragma once
 
+#include "binary_table.hpp"
+#include "compression.hpp"
+#include "cpu_governor.hpp"
+#include "kv_store.hpp"
+#include "log_writer.hpp"
+#include "memory_budget.hpp"
+#include "metrics.hpp"
+#include "numa.hpp"
+#include "page_pool.hpp"
+#include "program_watcher.hpp"
+#include "response_cache.hpp"
+#include "sandbox_pool.hpp"
 #include "tenant_instance.hpp"
+#include "tenant_manifest.hpp"
+#include "tenant_registry.hpp"
+#include "translation_cache.hpp"
+#include "upstream.hpp"
@@ -0,0 +1,107 @@
+#include "sandbox_pool.hpp"
+#include "log_writer.hpp"
+
+#include "machine_instance.hpp"
+#include "memory_budget.hpp"
+#include "page_pool.hpp"
+#include "tenant_instance.hpp"
+
+SandboxPool& SandboxPool::local()
+{
+	/* Pooled sandboxes return their pages on destruction,
+	   so the page pool must be destroyed after this one. */
+	PagePool::local();
+	static thread_local SandboxPool pool;
+	return pool;
+}
+
+SandboxPool::ScriptPtr SandboxPool::fork(TenantInstance& tenant, SharedMachine program)
+{
+	auto script = std::make_unique<Script>(program->script, &tenant, *program);
+	script->assign_instance(std::move(program));
+	return script;
+}
+
+SandboxPool::Entry& SandboxPool::entry_for(TenantInstance& tenant, const MachineInstance* program)
+{
+	auto& entry = m_entries[&tenant];
+	/* The address can belong to a tenant that has since been removed */
+	if (entry.tenant.expired()) {
+		entry.tenant = tenant.weak_from_this();
+		entry.free.clear();
+	}
+	/* Sandboxes of a replaced program are never used again */
+	if (entry.program != program) {
+		entry.program = program;
+		entry.free.clear();
+	}
+	return entry;
+}
+
+SandboxPool::ScriptPtr SandboxPool::acquire(TenantInstance& tenant, SharedMachine program)
+{
+	m_last_activity = clock::now();
+	auto& entry = this->entry_for(tenant, program.get());
+	entry.last_used = m_last_activity;
+
+	if (!entry.free.empty()) {
+		auto script = std::move(entry.free.back());
+		entry.free.pop_back();
+		m_stats.reused++;
+		return script;
+	}
+	m_stats.forked++;
+	return fork(tenant, std::move(program));
+}
+
+void SandboxPool::release(ScriptPtr script) noexcept
+{
+	auto it = m_entries.find(script->vrm());
+	if (it == m_entries.end())
+		return;
+	auto& entry = it->second;
+	if (entry.program != &script->instance()
+		|| entry.free.size() >= MAX_POOLED)
+		return;
+	/* A sandbox that cannot be fully reset is destroyed */
+	if (script->reset())
+		entry.free.push_back(std::move(script));
+}
+
+size_t SandboxPool::top_up(size_t max_forks)
+{
+	const auto now = clock::now();
+	if (now - m_last_activity < IDLE_THREAD)
+		return 0;
+	/* Idle sandboxes hold on to their prefaulted pages */
+	if (!MemoryBudget::has_room())
+		return 0;
+
+	size_t forks = 0;
+	for (auto it = m_entries.begin(); it != m_entries.end(); )
+	{
+		auto& entry = it->second;
+		auto tenant = entry.tenant.lock();
+		if (tenant == nullptr || now - entry.last_used > IDLE_TENANT) {
+			it = m_entries.erase(it);
+			continue;
+		}
+		++it;
+		auto program = tenant->current_program();
+		if (program == nullptr || program.get() != entry.program)
+			continue;
+		try {
+			while (entry.free.size() < MAX_POOLED && forks < max_forks) {
+				entry.free.push_back(fork(*tenant, program));
+				m_stats.preforked++;
+				forks++;
+			}
+		} catch (const std::exception& e) {
+			LogWriter::error("SandboxPool: Fork of '" + tenant->config.name
+				+ "' failed: " + e.what() + "\n");
+		}
+		if (forks >= max_forks)
+			break;
+	}
+	return forks;
+}
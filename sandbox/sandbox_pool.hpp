@@ -0,0 +1,64 @@
+#pragma once
+#include <chrono>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#include "script.hpp"
+struct TenantInstance;
+
+/**
+ * Per-thread pool of forked sandboxes, reset in place between requests.
+ *
+ * A reset drops every page of the fork back to the page pool, and
+ * restores the registers and the arena from the parent, while the
+ * machine, decoder and page-table allocations are kept. The sandbox
+ * is indistinguishable from a new fork of the same program.
+ *
+ * Sandboxes are pooled per tenant for the current program only, and
+ * are discarded when the tenant reloads its program. top_up() forks
+ * ahead of time for tenants that this thread has served recently,
+ * and is meant to be called while the event loop is idle.
+**/
+class SandboxPool
+{
+public:
+	using ScriptPtr = std::unique_ptr<Script>;
+	using SharedMachine = std::shared_ptr<MachineInstance>;
+	using clock = std::chrono::steady_clock;
+
+	/* Sandboxes kept per tenant and thread */
+	static constexpr size_t MAX_POOLED = 2;
+	/* Tenants not seen for this long are dropped from the pool */
+	static constexpr auto IDLE_TENANT = std::chrono::seconds(10);
+	/* How long the thread must be quiet before top_up() forks */
+	static constexpr auto IDLE_THREAD = std::chrono::milliseconds(1);
+
+	struct Stats {
+		uint64_t reused;
+		uint64_t forked;
+		uint64_t preforked;
+	};
+
+	static SandboxPool& local();
+
+	ScriptPtr acquire(TenantInstance&, SharedMachine program);
+	void release(ScriptPtr) noexcept;
+	/* Returns the number of sandboxes forked */
+	size_t top_up(size_t max_forks);
+
+	Stats stats() const noexcept { return m_stats; }
+
+private:
+	struct Entry {
+		std::weak_ptr<TenantInstance> tenant;
+		const MachineInstance* program = nullptr;
+		std::vector<ScriptPtr> free;
+		clock::time_point last_used;
+	};
+	static ScriptPtr fork(TenantInstance&, SharedMachine program);
+	Entry& entry_for(TenantInstance&, const MachineInstance*);
+
+	std::unordered_map<const TenantInstance*, Entry> m_entries;
+	clock::time_point m_last_activity;
+	Stats m_stats {};
+};
@@ -1,20 +1,21 @@
 #include "script.hpp"
 
 #include <libriscv/native_heap.hpp>
+#include <algorithm>
+#include <cstring>
+#include <mutex>
 #include <stdexcept>
+#include "machine_instance.hpp"
+#include "log_writer.hpp"
+#include "memory_budget.hpp"
+#include "binary_table.hpp"
+#include "page_pool.hpp"
 #include "tenant_instance.hpp"
-inline timespec time_now();
-inline long nanodiff(timespec start_time, timespec end_time);
+#include "translation_cache.hpp"
 
 static constexpr bool VERBOSE_ERRORS       = true;
 static constexpr int  NATIVE_SYSCALLS_BASE = 80;
 
-//#define ENABLE_TIMING
-#define TIMING_LOCATION(x) \
-	asm("" ::: "memory"); \
-	auto x = time_now();  \
-	asm("" ::: "memory");
-
 Script::Script(
 	const Script& source,
 	const TenantInstance* tenant, const MachineInstance& inst)
@@ -32,43 +33,126 @@ Script::Script(
 
 	/* Transfer data from the old arena, to fully replicate heap */
 	machine().transfer_arena_from(source.machine());
+
+	this->prefault();
 }
 
-Script::Script(
-	const std::vector<uint8_t>& binary,
-	const TenantInstance* tenant, const MachineInstance& inst)
-	: m_machine(binary, riscv::MachineOptions<MARCH>{
+Script::Script(Replica, const Script& primary, const MachineInstance& inst)
+	: m_machine(primary.machine(), riscv::MachineOptions<MARCH>{
+		.memory_max = 0,
+		.verbose_loader = false,
+		.minimal_fork = true,
+		.use_memory_arena = false,
+	  }),
+	  m_vrm(primary.m_vrm), m_inst(inst)
+{
+	machine().set_userdata<Script>(this);
+	machine().transfer_arena_from(primary.machine());
+
+	/* Copy every page that isn't zero. The rest are read as the zero
+	   page, and forks fault in fresh pages when they write to them. */
+	auto& mem = machine().memory;
+	const auto& source = primary.machine().memory;
+	mem.mmap_address() = source.mmap_address();
+	auto copy_page = [&] (gaddr_t pageno, const riscv::Page& page) {
+		const auto* data = page.data();
+		if (data == nullptr || mem.pages().count(pageno)
+			|| std::all_of(data, data + riscv::Page::SIZE, [] (uint8_t b) { return b == 0; }))
+			return;
+		riscv::PageAttributes attr = page.attr;
+		attr.is_cow = false;
+		attr.non_owning = false;
+		mem.allocate_page(pageno, attr, new riscv::PageData(*page.page()));
+	};
+	const gaddr_t arena_pages = m_vrm->config.max_memory >> riscv::Page::SHIFT;
+	for (gaddr_t pageno = 0; pageno < arena_pages; pageno++)
+		copy_page(pageno, source.get_pageno(pageno));
+	for (const auto& it : source.pages())
+		copy_page(it.first, it.second);
+
+	m_regex.assign(primary.m_regex);
+	m_routes = primary.m_routes;
+}
+
+static riscv::MachineOptions<Script::MARCH> main_options(
+	const ElfBinary& binary, const TenantInstance* tenant)
+{
+	riscv::MachineOptions<Script::MARCH> options {
 		.memory_max = tenant->config.max_memory,
 		.verbose_loader = true,
 		.use_memory_arena = true,
-	  }),
+	};
+#ifdef RISCV_BINARY_TRANSLATION
+	/* Load the native code of an earlier translation, or keep it */
+	auto prefix = TranslationCache::prepare(binary,
+		{ options.memory_max, options.use_memory_arena });
+	if (!prefix.empty()) {
+		options.translation_prefix = std::move(prefix);
+		options.translation_suffix = ".so";
+		options.translation_cache  = true;
+	}
+#endif
+	return options;
+}
+
+Script::Script(
+	const ElfBinary& binary,
+	const TenantInstance* tenant, const MachineInstance& inst)
+	: m_machine(binary.view(), main_options(binary, tenant)),
 	  m_vrm(tenant), m_inst(inst)
 {
 	this->machine_initialize();
 }
 
-thread_local std::vector<riscv::PageData> pagedata_cache;
-static riscv::PageData& loan_page(riscv::PageData::Initialization init)
+Script::~Script()
 {
-	auto& cache = pagedata_cache;
-	if (cache.empty()) {
-		riscv::PageData* pagedata = new riscv::PageData(init);
-		return *pagedata;
-	}
-
-	auto& pagedata = cache.back();
-	cache.pop_back();
-	if (init == riscv::PageData::INITIALIZED)
-		std::memset(pagedata.buffer8.data(), 0, pagedata.buffer8.size());
-
-	return pagedata;
+	/* Loaned pages go back to the pool of this thread */
+	auto& pool = PagePool::local();
+	for (auto* page : m_loaned_pages)
+		pool.release(page);
+	MemoryBudget::release(m_loaned_pages.size());
 }
 
-Script::~Script()
+bool Script::reset()
 {
-	auto& cache = pagedata_cache;
-	for (auto page : m_loaned_pages)
-		cache.push_back(*page);
+	/* Only forks can be reset to their parent */
+	if (m_parent == nullptr)
+		return false;
+	try {
+		auto& mem = machine().memory;
+		/* Drop every page, keeping the allocations of the page table.
+		   Pages are installed again from the parent on first access. */
+		mem.pages().clear();
+		mem.invalidate_reset_cache();
+		mem.mmap_address() = m_parent->memory.mmap_address();
+
+		auto& pool = PagePool::local();
+		for (auto* page : m_loaned_pages)
+			pool.release(page);
+		MemoryBudget::release(m_loaned_pages.size());
+		m_loaned_pages.clear();
+
+		machine().cpu.registers() = m_parent->cpu.registers();
+		machine().transfer_arena_from(*m_parent);
+
+		m_is_paused = false;
+		m_is_async  = false;
+		m_suspend_ms = 0;
+		m_async_instructions = 0;
+		m_spent_instructions = 0;
+		m_http = {};
+		m_route_params = {};
+		m_cache_control = {};
+		m_call_stats = {};
+		m_regex.clear();
+		m_fetches.clear();
+		m_waiting = nullptr;
+		this->prefault();
+		return true;
+	} catch (const std::exception& e) {
+		LogWriter::error(std::string("Script::reset() exception: ") + e.what() + "\n");
+		return false;
+	}
 }
 
 void Script::machine_initialize()
@@ -95,21 +179,25 @@ void Script::machine_setup(machine_t& machine, bool init)
 		machine.memory.set_page_fault_handler(
 		[] (riscv::Memory<MARCH>& mem, gaddr_t pageno, bool init) -> riscv::Page& {
 			//printf("Creating page %zu @ 0x%lX\n", pageno, long(pageno * 4096u));
-			riscv::PageData& pagedata = loan_page(init ?
-				riscv::PageData::INITIALIZED : riscv::PageData::UNINITIALIZED);
 			auto& script = *mem.machine().template get_userdata<Script>();
-			script.m_loaned_pages.push_back(&pagedata);
+			riscv::PageData* pagedata = script.loan_page(pageno, init ?
+				riscv::PageData::INITIALIZED : riscv::PageData::UNINITIALIZED);
+			if (script.m_recording)
+				script.m_written_pages.push_back(pageno);
 			// Create new read-write attribute page with loaned data
 			auto& page = mem.allocate_page(pageno, riscv::PageAttributes{
 				.is_cow = false,    // We are creating a new page, not a COW page
 				.non_owning = true, // We don't own the page
-			}, &pagedata);
+			}, pagedata);
 			return page;
 		});
 		machine.memory.set_page_readf_handler(
 		[] (const riscv::Memory<MARCH>& mem, gaddr_t pageno) -> const riscv::Page& {
 			//printf("Reading page %zu @ 0x%lX\n", pageno, long(pageno * 4096u));
 			Script& script = *mem.machine().template get_userdata<Script>();
+			script.m_call_stats.cow_reads++;
+			if (script.m_recording)
+				script.m_read_pages.push_back(pageno);
 			const riscv::Page& foreign_page = script.m_parent->memory.get_pageno(pageno);
 			// Install the page as a non-owning, COW page
 			riscv::PageAttributes attr = foreign_page.attr;
@@ -117,6 +205,19 @@ void Script::machine_setup(machine_t& machine, bool init)
 			attr.is_cow = true;
 			return const_cast<riscv::Memory<MARCH>&>(mem).allocate_page(pageno, attr, foreign_page.page());
 		});
+		machine.memory.set_page_write_handler(
+		[] (riscv::Memory<MARCH>& mem, gaddr_t pageno, riscv::Page& page) {
+			/* A write to a page shared with the parent: the copy is
+			   loaned and charged like any other page of the fork. It is
+			   not recorded, as the working set shares the page instead. */
+			Script& script = *mem.machine().template get_userdata<Script>();
+			riscv::PageData* pagedata = script.loan_page(pageno, riscv::PageData::UNINITIALIZED);
+			std::memcpy(pagedata->buffer8.data(), page.data(), riscv::Page::SIZE);
+			page.new_data(pagedata);
+			page.attr.is_cow = false;
+			page.attr.write = true;
+			page.attr.non_owning = true;
+		});
 	}
 	else
 	{
@@ -126,91 +227,150 @@ void Script::machine_setup(machine_t& machine, bool init)
 			{ "LC_CTYPE=C", "LC_ALL=C", "USER=groot" });
 
 		// add system call interface
-	#ifdef ENABLE_TIMING
-		TIMING_LOCATION(t0);
-	#endif
 		auto heap_base = machine.memory.mmap_allocate(vrm()->config.max_heap);
 		machine.setup_native_heap(NATIVE_SYSCALLS_BASE,
 			heap_base, vrm()->config.max_heap);
-
-	#ifdef ENABLE_TIMING
-		TIMING_LOCATION(t1);
-	#endif
 		machine.setup_native_memory(NATIVE_SYSCALLS_BASE+5);
-	#ifdef ENABLE_TIMING
-		TIMING_LOCATION(t2);
-	#endif
-
-		Script::setup_syscall_interface();
-
-		// FIXME: EBREAK is used as a stop mechanism
-		machine.install_syscall_handler(riscv::SYSCALL_EBREAK,
-			[] (auto& m) {
-				m.stop();
-			});
-		machine.on_unhandled_syscall =
-			[] (auto&, size_t number) {
-				printf("VM unhandled system call: %zu\n", number);
-			};
-	#ifdef ENABLE_TIMING
-		TIMING_LOCATION(t3);
-		printf("Time spent setting up arena: %ld ns, nat.mem: %ld ns, syscalls: %ld ns\n",
-			nanodiff(t0, t1), nanodiff(t1, t2), nanodiff(t2, t3));
-	#endif
+
+		/* The handlers are shared by every machine, and tenants
+		   can be initialized on several threads at once */
+		static std::once_flag handlers_installed;
+		std::call_once(handlers_installed, [] {
+			Script::setup_syscall_interface();
+
+			// FIXME: EBREAK is used as a stop mechanism
+			machine_t::install_syscall_handler(riscv::SYSCALL_EBREAK,
+				[] (auto& m) {
+					m.stop();
+				});
+			machine_t::on_unhandled_syscall =
+				[] (auto&, size_t number) {
+					LogWriter::error("VM unhandled system call: "
+						+ std::to_string(number) + "\n");
+				};
+		});
 	}
 }
 
-void Script::handle_exception(gaddr_t address)
+/* Every page written by a fork comes from the pool of the thread, and
+   counts against the memory budget and the dirty limit of the fork */
+riscv::PageData* Script::loan_page(gaddr_t pageno, riscv::PageData::Initialization init)
 {
-	try {
-		throw;
-	}
-	catch (const riscv::MachineException& e) {
-		if constexpr (VERBOSE_ERRORS) {
-		fprintf(stderr, "Script exception: %s (data: 0x%lX)\n", e.what(), long(e.data()));
-		fprintf(stderr, ">>> Machine registers:\n[PC\t%08lX] %s\n",
-			(long) machine().cpu.pc(),
-			machine().cpu.registers().to_string().c_str());
-		}
+	const size_t dirty_limit = MemoryBudget::fork_dirty_pages();
+	if (UNLIKELY(dirty_limit != 0 && m_loaned_pages.size() >= dirty_limit))
+		throw riscv::MachineException(riscv::OUT_OF_MEMORY,
+			"Fork dirty-page limit reached", pageno);
+	if (UNLIKELY(!MemoryBudget::charge()))
+		throw riscv::MachineException(riscv::OUT_OF_MEMORY,
+			"Sandbox memory budget exhausted", pageno);
+	riscv::PageData* pagedata = PagePool::local().allocate(init);
+	m_loaned_pages.push_back(pagedata);
+	m_call_stats.page_faults++;
+	return pagedata;
+}
+
+void Script::prefault()
+{
+	const auto& ws = m_inst.working_set;
+	m_read_pages.clear();
+	m_written_pages.clear();
+	m_recording = !ws.ready();
+	if (m_recording)
+		return;
+
+	auto& mem = machine().memory;
+	for (const auto& page : ws.shared_pages())
+		mem.allocate_page(page.pageno, page.attr, page.data);
+	auto& pool = PagePool::local();
+	for (const auto pageno : ws.fresh_pages()) {
+		/* The rest will fault in, and fail there if need be */
+		if (!MemoryBudget::charge())
+			break;
+		riscv::PageData* pagedata = pool.allocate(riscv::PageData::INITIALIZED);
+		m_loaned_pages.push_back(pagedata);
+		mem.allocate_page(pageno, riscv::PageAttributes{
+			.is_cow = false,
+			.non_owning = true,
+		}, pagedata);
 	}
-	catch (const std::exception& e) {
-		if constexpr (VERBOSE_ERRORS) {
-			fprintf(stderr, "Script exception: %s\n", e.what());
-		}
+	m_call_stats.prefaulted = ws.shared_pages().size() + m_loaned_pages.size();
+}
+
+void Script::learn_working_set()
+{
+	if (!m_recording)
+		return;
+	m_inst.working_set.learn(*m_parent, m_read_pages, m_written_pages);
+	m_recording = false;
+}
+
+std::unique_ptr<ErrorReport> Script::error_report(ErrorReport::Kind kind, gaddr_t address) const
+{
+	auto report = std::make_unique<ErrorReport>();
+	report->kind = kind;
+	report->tenant = this->name();
+	report->frames[0].addr = machine().cpu.pc();
+	report->frames[1].addr = machine().cpu.reg(1); /* RA */
+	report->frames[2].addr = address;
+	/* Symbols are resolved by the writer, from the program the fork
+	   keeps alive. The main VM has nobody to keep it alive. */
+	report->program = m_inst_ref;
+	if (report->program == nullptr) {
+		for (auto& frame : report->frames)
+			frame.symbol = machine().memory.lookup(frame.addr).name;
 	}
-	if constexpr (VERBOSE_ERRORS) {
-		printf("Program page: %s\n", machine().memory.get_page_info(machine().cpu.pc()).c_str());
-		printf("Stack page: %s\n", machine().memory.get_page_info(machine().cpu.reg(2)).c_str());
+	return report;
+}
 
-		auto callsite = machine().memory.lookup(address);
-		fprintf(stderr, "Function call: %s\n", callsite.name.c_str());
-		this->print_backtrace(address);
+void Script::handle_exception(gaddr_t address)
+{
+	m_call_stats.exception = true;
+	if constexpr (VERBOSE_ERRORS) {
+		/* Guests can fail on purpose, as often as they like */
+		if (!vrm()->log_limiter.take())
+			return;
+		auto report = error_report(ErrorReport::EXCEPTION, address);
+		try {
+			throw;
+		}
+		catch (const riscv::MachineException& e) {
+			report->message = e.what();
+			report->has_data = true;
+			report->data = e.data();
+		}
+		catch (const std::exception& e) {
+			report->message = e.what();
+		}
+		report->registers = machine().cpu.registers();
+		report->program_page = machine().memory.get_page_info(machine().cpu.pc());
+		report->stack_page = machine().memory.get_page_info(machine().cpu.reg(2));
+		LogWriter::report(std::move(report));
 	}
 }
 void Script::handle_timeout(gaddr_t address)
 {
+	m_call_stats.timeout = true;
 	if constexpr (VERBOSE_ERRORS) {
-		auto callsite = machine().memory.lookup(address);
-		fprintf(stderr, "Script hit max instructions for: %s\n",
-			callsite.name.c_str());
+		if (!vrm()->log_limiter.take())
+			return;
+		LogWriter::report(error_report(ErrorReport::TIMEOUT, address));
 	}
 }
 void Script::print_backtrace(const gaddr_t addr)
 {
-	machine().memory.print_backtrace(
-		[] (const std::string_view line) {
-			printf("-> %.*s\n", (int)line.size(), line.begin());
-		});
-	auto origin = machine().memory.lookup(addr);
-	printf("-> [-] 0x%08lx + 0x%.3x: %s\n",
-			(long) origin.address,
-			origin.offset, origin.name.c_str());
+	if (!vrm()->log_limiter.take())
+		return;
+	LogWriter::report(error_report(ErrorReport::BACKTRACE, addr));
 }
 
 uint64_t Script::max_instructions() const noexcept
 {
 	return vrm()->config.max_instructions;
 }
+uint64_t Script::remaining_instructions() const noexcept
+{
+	return max_instructions() - std::min(m_spent_instructions, max_instructions());
+}
 const std::string& Script::name() const noexcept
 {
 	return vrm()->config.name;
@@ -220,6 +380,115 @@ const std::string& Script::group() const noexcept
 	return vrm()->config.group;
 }
 
+Script::AsyncStatus Script::async_call(gaddr_t address, uint64_t slice)
+{
+	try {
+		m_is_async = true;
+		m_async_instructions = 0;
+		machine().cpu.reset_stack_pointer();
+		machine().setup_call();
+		machine().cpu.jump(address);
+	} catch (const std::exception& e) {
+		this->handle_exception(address);
+		return AsyncStatus::Failed;
+	}
+	return this->async_resume(slice);
+}
+
+Script::AsyncStatus Script::async_resume(uint64_t slice)
+{
+	try {
+		m_is_paused = false;
+		m_suspend_ms = 0;
+		/* The wait system call returns the status of the response */
+		if (m_waiting != nullptr) {
+			machine().cpu.reg(10) = m_waiting->result->status;
+			m_waiting = nullptr;
+		}
+		const uint64_t budget = remaining_instructions() - m_async_instructions;
+		machine().simulate<false>(std::min(slice, budget));
+		m_async_instructions += machine().instruction_counter();
+
+		if (machine().stopped())
+			return m_is_paused ? AsyncStatus::Suspended : AsyncStatus::Finished;
+		/* The slice ran out, so let others run before continuing */
+		if (m_async_instructions < remaining_instructions())
+			return AsyncStatus::Suspended;
+		this->handle_timeout(machine().cpu.pc());
+	} catch (const std::exception& e) {
+		this->handle_exception(machine().cpu.pc());
+	}
+	return AsyncStatus::Failed;
+}
+
+void Script::suspend(uint32_t ms)
+{
+	m_is_paused  = true;
+	m_suspend_ms = ms;
+	machine().stop();
+}
+
+int Script::start_fetch(const Upstreams::Request& request)
+{
+	if (m_fetches.size() >= MAX_FETCHES)
+		return -1;
+	auto fetch = vrm()->upstreams.fetch(request);
+	if (fetch == nullptr)
+		return -1;
+	m_fetches.push_back(std::move(fetch));
+	return m_fetches.size() - 1;
+}
+const Fetch* Script::fetch(uint32_t handle) const noexcept
+{
+	if (handle >= m_fetches.size())
+		return nullptr;
+	return m_fetches[handle].get();
+}
+bool Script::wait_fetch(uint32_t handle)
+{
+	auto& fetch = m_fetches.at(handle);
+	if (fetch->done)
+		return true;
+	m_waiting = fetch;
+	this->suspend(0);
+	return false;
+}
+
+int Script::compile_regex(std::string_view pattern)
+{
+	const int idx = m_regex.compile(pattern,
+		(m_parent != nullptr) ? RegexTable::FORK_LIMITS : RegexTable::MAIN_LIMITS);
+	if (idx < 0 || m_parent == nullptr)
+		return idx;
+	return FORK_REGEX_BASE + idx;
+}
+const re2::RE2* Script::regex(uint32_t handle) const noexcept
+{
+	if (handle >= FORK_REGEX_BASE)
+		return (m_parent != nullptr) ? m_regex.get(handle - FORK_REGEX_BASE) : nullptr;
+	/* The shared patterns of the main VM */
+	const Script& main = (m_parent != nullptr) ? m_inst.script : *this;
+	return main.m_regex.get(handle);
+}
+bool Script::free_regex(uint32_t handle)
+{
+	/* Forks cannot free the shared patterns */
+	if (m_parent == nullptr)
+		return m_regex.free(handle);
+	if (handle >= FORK_REGEX_BASE)
+		return m_regex.free(handle - FORK_REGEX_BASE);
+	return false;
+}
+
+bool Script::add_route(unsigned methods, std::string_view pattern, gaddr_t func)
+{
+	/* The table is read by every thread once the program is live,
+	   and only the main VM runs before that */
+	if (m_parent != nullptr)
+		return false;
+	return m_routes.add(methods, pattern, func);
+}
+
 Script::gaddr_t Script::guest_alloc(size_t len)
 {
 	return machine().arena().malloc(len);
@@ -233,17 +502,3 @@ std::string Script::symbol_name(gaddr_t address) const
 	auto callsite = machine().memory.lookup(address);
 	return callsite.name;
 }
-
-#ifdef ENABLE_TIMING
-timespec time_now()
-{
-	timespec t;
-	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
-	return t;
-}
-long nanodiff(timespec start_time, timespec end_time)
-{
-	assert(end_time.tv_sec == 0); /* We should never use seconds */
-	return end_time.tv_nsec - start_time.tv_nsec;
-}
-#endif
@@ -3,8 +3,17 @@
 #include <functional>
 #include <libriscv/machine.hpp>
 #include <optional>
+#include "log_writer.hpp"
+#include "regex_table.hpp"
+#include "route_table.hpp"
+#include "upstream.hpp"
 struct TenantInstance;
+struct ElfBinary;
 struct MachineInstance;
+namespace drogon {
+	class HttpRequest;
+	class HttpResponse;
+}
 
 class Script {
 public:
@@ -22,6 +31,19 @@ public:
 
 	std::optional<sgaddr_t> resume(uint64_t cycles);
 
+	/* Asynchronous calls run in slices of instructions, and the guest
+	   can suspend itself in between with ECALL_YIELD. The caller keeps
+	   resuming until the call is no longer suspended. The instruction
+	   limit applies to the whole call, across every slice. */
+	enum class AsyncStatus { Finished, Suspended, Failed };
+	AsyncStatus async_call(gaddr_t addr, uint64_t slice);
+	AsyncStatus async_resume(uint64_t slice);
+	bool is_async() const noexcept { return m_is_async; }
+	uint64_t async_instructions() const noexcept { return m_async_instructions; }
+	/* How long the guest asked to sleep for, when suspended */
+	uint32_t suspend_ms() const noexcept { return m_suspend_ms; }
+	void suspend(uint32_t ms);
+
 	auto& machine() { return m_machine; }
 	const auto& machine() const { return m_machine; }
 
@@ -30,32 +52,106 @@ public:
 	void assign_instance(std::shared_ptr<MachineInstance>&& ref) { m_inst_ref = std::move(ref); }
 
 	uint64_t max_instructions() const noexcept;
+	/* What is left of max_instructions() for this request, after the
+	   calls that streamed its body. Every call of a fork shares it. */
+	uint64_t remaining_instructions() const noexcept;
 	const std::string& name() const noexcept;
 	const std::string& group() const noexcept;
 	bool is_paused() const noexcept { return m_is_paused; }
 
+	/* The HTTP transaction the guest can access through syscalls */
+	struct Http {
+		drogon::HttpRequest*  req  = nullptr;
+		drogon::HttpResponse* resp = nullptr;
+	};
+	auto& http() noexcept { return m_http; }
+	void set_http(const Http& http) noexcept { m_http = http; }
+	/* Captured by the route that matched, pointing into the path */
+	auto& route_params() noexcept { return m_route_params; }
+
+	/* How the guest wants the response cached, if at all */
+	struct CacheControl {
+		uint32_t ttl = 0;
+		std::vector<std::string> vary;
+	};
+	auto& cache_control() noexcept { return m_cache_control; }
+
+	/* Counted during calls into a fork, for the tenant metrics */
+	struct CallStats {
+		uint32_t page_faults = 0;
+		uint32_t cow_reads   = 0;
+		uint32_t prefaulted  = 0;
+		bool timeout   = false;
+		bool exception = false;
+	};
+	auto& call_stats() noexcept { return m_call_stats; }
+	/* Hands the pages faulted in during this request to the working
+	   set of the program, while it is still learning */
+	void learn_working_set();
+
+	/* Regex handles below FORK_REGEX_BASE refer to the patterns
+	   compiled by the main VM, which are shared by every fork. */
+	static constexpr uint32_t FORK_REGEX_BASE = 0x10000;
+	int compile_regex(std::string_view pattern);
+	const re2::RE2* regex(uint32_t handle) const noexcept;
+	bool free_regex(uint32_t handle);
+
+	/* Outbound requests of this call, by handle. Waiting for one that
+	   has not completed suspends the fork until it does. */
+	static constexpr size_t MAX_FETCHES = 16;
+	int start_fetch(const Upstreams::Request&);
+	const Fetch* fetch(uint32_t handle) const noexcept;
+	/* Returns false if the fork was suspended to wait */
+	bool wait_fetch(uint32_t handle);
+	/* What a suspended fork is waiting for, if not a timer */
+	Fetch* waiting_fetch() noexcept { return m_waiting.get(); }
+
+	/* Routes can only be added by the main VM, during initialization */
+	bool add_route(unsigned methods, std::string_view pattern, gaddr_t func);
+	const RouteTable& routes() const noexcept { return m_routes; }
+
 	gaddr_t guest_alloc(size_t len);
 
+	/* Feeds the request body to func in chunks, through a window of
+	   guest memory. See on_body_chunk. Returns false if the guest
+	   failed, and adds the instructions used to the counter. */
+	bool stream_body(gaddr_t func, gaddr_t window, size_t window_size,
+		uint64_t& instructions);
+
 	std::string symbol_name(gaddr_t address) const;
 	gaddr_t resolve_address(std::string_view name) const;
 	riscv::Memory<MARCH>::Callsite callsite(gaddr_t addr) const { return machine().memory.lookup(addr); }
 
+	/* Queued for the log writer, like exceptions and timeouts */
 	void print_backtrace(const gaddr_t addr);
 
 	bool reset(); // true if the reset was successful
 
-	Script(const std::vector<uint8_t>&, const TenantInstance*, const MachineInstance&);
+	Script(const ElfBinary&, const TenantInstance*, const MachineInstance&);
 	Script(const Script& source, const TenantInstance*, const MachineInstance&);
+	/* A main VM with a private copy of the memory of another, in pages
+	   first touched by the calling thread. See MachineInstance::replicate. */
+	struct Replica {};
+	Script(Replica, const Script& primary, const MachineInstance&);
 	~Script();
 
 private:
 	void handle_exception(gaddr_t);
 	void handle_timeout(gaddr_t);
+	std::unique_ptr<ErrorReport> error_report(ErrorReport::Kind, gaddr_t) const;
 	bool install_binary(const std::string& file, bool shared = true);
 	void machine_initialize();
 	void machine_setup(machine_t&, bool init);
 	void setup_virtual_memory(bool init);
+	void prefault();
+	riscv::PageData* loan_page(gaddr_t pageno, riscv::PageData::Initialization);
 	static void setup_syscall_interface();
+	static void setup_http_interface();
+	static void setup_regex_interface();
+	static void setup_kv_interface();
+	static void setup_fetch_interface();
+	static void setup_compress_interface();
+	static void setup_primitives_interface();
 
 	machine_t m_machine;
 	const struct TenantInstance* m_vrm = nullptr;
@@ -63,8 +159,24 @@ private:
 	const machine_t* m_parent = nullptr;
 
 	bool m_is_paused = false;
+	bool m_is_async  = false;
+	uint32_t m_suspend_ms = 0;
+	uint64_t m_async_instructions = 0;
+	uint64_t m_spent_instructions = 0;
+	Http m_http;
+	RouteParams m_route_params;
+	CacheControl m_cache_control;
+	CallStats m_call_stats;
+	RegexTable m_regex;
+	std::vector<std::shared_ptr<Fetch>> m_fetches;
+	std::shared_ptr<Fetch> m_waiting = nullptr;
+	RouteTable m_routes;
 
 	std::vector<riscv::PageData*> m_loaned_pages;
+	/* Faulted pages, recorded until the working set is ready */
+	bool m_recording = false;
+	std::vector<gaddr_t> m_read_pages;
+	std::vector<gaddr_t> m_written_pages;
 
 	/* Delete this last */
 	std::shared_ptr<MachineInstance> m_inst_ref = nullptr;
@@ -79,7 +191,7 @@ inline std::optional<Script::sgaddr_t> Script::call(gaddr_t address, Args&&... a
 		// setup calling convention
 		machine().setup_call(std::forward<Args>(args)...);
 		// execute function
-		machine().simulate_with<true>(max_instructions(), 0u, address);
+		machine().simulate_with<true>(remaining_instructions(), 0u, address);
 		// address-sized integer return value
 		return machine().return_value<sgaddr_t>();
 	}
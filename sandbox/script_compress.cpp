@@ -0,0 +1,68 @@
+#include "script_functions.hpp"
+#include "compression.hpp"
+#include "machine/syscalls.h"
+
+/**
+ * Native compression of guest buffers.
+ *
+ * The input is read in place from guest memory, one megabyte of pages
+ * at a time, and only the compressed result is copied back. Compressing
+ * in the guest would take orders of magnitude more instructions.
+ *
+ * The work is still charged as instructions per input byte, at about
+ * what each level costs natively, so that the instruction limit of a
+ * call also bounds how much it can compress. The best level is an
+ * order of magnitude slower, and is only for small inputs.
+**/
+static_assert(COMPRESS_BR == int(Encoding::Brotli));
+static_assert(COMPRESS_ZSTD == int(Encoding::Zstd));
+static_assert(COMPRESS_GZIP == int(Encoding::Gzip));
+
+static constexpr size_t MAX_SOURCE = 16ul << 20;
+static constexpr size_t MAX_BEST_SOURCE = 256ul << 10;
+static constexpr uint64_t FAST_PENALTY_PER_BYTE = 4;
+static constexpr uint64_t BEST_PENALTY_PER_BYTE = 64;
+static constexpr size_t GATHER_BYTES = 1ul << 20;
+
+APICALL(compress)
+{
+	/* Compresses src into dst, returns the compressed length, or -1
+	   if the encoding is not available or the result does not fit */
+	auto [flags, src_addr, src_len, dst_addr, dst_len] =
+		machine.sysargs<unsigned, gaddr_t, size_t, gaddr_t, size_t> ();
+	const unsigned encoding = flags & 0xFF;
+	const bool best = (flags & COMPRESS_BEST) != 0;
+	if (encoding == 0 || encoding >= unsigned(Encoding::Count)
+		|| src_len > (best ? MAX_BEST_SOURCE : MAX_SOURCE))
+	{
+		machine.set_result(-1);
+		return;
+	}
+	machine.penalize(src_len * (best ? BEST_PENALTY_PER_BYTE : FAST_PENALTY_PER_BYTE));
+	const auto level = best ? Compression::Level::Best : Compression::Level::Fast;
+
+	Compressor compressor(Encoding(encoding), level);
+	/* One more buffer for a range that doesn't start on a page */
+	std::array<riscv::vBuffer, GATHER_BYTES / 4096 + 1> buffers;
+	for (size_t offset = 0; offset < src_len && compressor.ok(); offset += GATHER_BYTES) {
+		const size_t len = std::min(GATHER_BYTES, src_len - offset);
+		const size_t cnt = machine.memory.gather_buffers_from_range(
+			buffers.size(), buffers.data(), src_addr + offset, len);
+		for (size_t i = 0; i < cnt; i++)
+			compressor.write(buffers[i].ptr, buffers[i].len);
+	}
+	std::string out;
+	if (!compressor.finish(out) || out.size() > dst_len) {
+		machine.set_result(-1);
+		return;
+	}
+	machine.copy_to_guest(dst_addr, out.data(), out.size());
+	machine.set_result(out.size());
+}
+
+void Script::setup_compress_interface()
+{
+	machine_t::install_syscall_handlers({
+		{ECALL_COMPRESS, compress},
+	});
+}
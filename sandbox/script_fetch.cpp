@@ -0,0 +1,122 @@
+#include "script_functions.hpp"
+#include "machine/syscalls.h"
+
+/**
+ * Outbound HTTP requests for the guest.
+ *
+ * A request is started with ECALL_FETCH, which returns a handle right
+ * away, so that a program can have several requests in flight. Waiting
+ * on a handle suspends the fork until the response has arrived, and
+ * only asynchronous tenants can be suspended.
+**/
+static constexpr size_t MAX_URL = 8192;
+static constexpr size_t MAX_HEADERS = 16384;
+
+static std::string guest_string(machine_t& machine, gaddr_t addr, size_t len)
+{
+	std::string result(len, '\0');
+	machine.copy_from_guest(result.data(), addr, len);
+	return result;
+}
+
+static const char* method_name(unsigned method)
+{
+	switch (method) {
+	case ROUTE_GET:     return "GET";
+	case ROUTE_POST:    return "POST";
+	case ROUTE_PUT:     return "PUT";
+	case ROUTE_DELETE:  return "DELETE";
+	case ROUTE_PATCH:   return "PATCH";
+	case ROUTE_HEAD:    return "HEAD";
+	case ROUTE_OPTIONS: return "OPTIONS";
+	default:            return nullptr;
+	}
+}
+
+/* The result of a completed request, or nullptr */
+static const FetchResult* get_result(machine_t& machine, uint32_t handle)
+{
+	const Fetch* fetch = get_script(machine).fetch(handle);
+	if (fetch == nullptr || !fetch->done)
+		return nullptr;
+	return fetch->result.get();
+}
+
+APICALL(fetch_start)
+{
+	/* Returns a handle, or -1 if the request was not allowed */
+	auto [method, url_addr, url_len, hdr_addr, hdr_len, body_addr, body_len] =
+		machine.sysargs<unsigned, gaddr_t, size_t, gaddr_t, size_t, gaddr_t, size_t> ();
+	auto& script = get_script(machine);
+	const char* name = method_name(method);
+	if (!script.is_async() || name == nullptr || url_len > MAX_URL
+		|| hdr_len > MAX_HEADERS || body_len > Upstreams::MAX_BODY)
+	{
+		machine.set_result(-1);
+		return;
+	}
+	Upstreams::Request request;
+	request.method = name;
+	request.url = guest_string(machine, url_addr, url_len);
+	request.headers = guest_string(machine, hdr_addr, hdr_len);
+	request.body = guest_string(machine, body_addr, body_len);
+	machine.set_result(script.start_fetch(request));
+}
+APICALL(fetch_wait)
+{
+	/* Returns the status of the response, or -1 if the request failed.
+	   Set again when the suspended fork is resumed. */
+	auto [handle] = machine.sysargs<uint32_t> ();
+	auto& script = get_script(machine);
+	if (script.fetch(handle) == nullptr) {
+		machine.set_result(-1);
+		return;
+	}
+	if (script.wait_fetch(handle))
+		machine.set_result(get_result(machine, handle)->status);
+}
+APICALL(fetch_body)
+{
+	/* Copies the body into buf, returns the full length of the
+	   body or -1 if the request has not completed */
+	auto [handle, buf_addr, buf_len] = machine.sysargs<uint32_t, gaddr_t, size_t> ();
+	const auto* result = get_result(machine, handle);
+	if (result == nullptr) {
+		machine.set_result(-1);
+		return;
+	}
+	const auto& body = result->body;
+	machine.copy_to_guest(buf_addr, body.data(), std::min(body.size(), buf_len));
+	machine.set_result(body.size());
+}
+APICALL(fetch_header)
+{
+	/* Copies the value of a response header into buf, returns the
+	   full length of the value or -1 if not found */
+	auto [handle, name_addr, name_len, buf_addr, buf_len] =
+		machine.sysargs<uint32_t, gaddr_t, size_t, gaddr_t, size_t> ();
+	const auto* result = get_result(machine, handle);
+	if (result == nullptr || name_len > 256) {
+		machine.set_result(-1);
+		return;
+	}
+	const auto name = guest_string(machine, name_addr, name_len);
+	for (const auto& [key, value] : result->headers) {
+		if (key == name) {
+			machine.copy_to_guest(buf_addr, value.data(), std::min(value.size(), buf_len));
+			machine.set_result(value.size());
+			return;
+		}
+	}
+	machine.set_result(-1);
+}
+
+void Script::setup_fetch_interface()
+{
+	machine_t::install_syscall_handlers({
+		{ECALL_FETCH, fetch_start},
+		{ECALL_FETCH_WAIT, fetch_wait},
+		{ECALL_FETCH_BODY, fetch_body},
+		{ECALL_FETCH_HEADER, fetch_header},
+	});
+}
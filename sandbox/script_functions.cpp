@@ -1,15 +1,8 @@
 #include "script_functions.hpp"
 #include <libriscv/native_heap.hpp>
 #include "machine/syscalls.h"
-
-//#define ENABLE_TIMING
-#define TIMING_LOCATION(x) \
-	asm("" ::: "memory"); \
-	auto x = time_now();  \
-	asm("" ::: "memory");
-
-inline timespec time_now();
-inline long nanodiff(timespec start_time, timespec end_time);
+#include "log_writer.hpp"
+#include "tenant_instance.hpp"
 
 APICALL(self_test)
 {
@@ -19,25 +12,36 @@ APICALL(assertion_failed)
 	auto [expr, file, line, func] =
 		machine.sysargs<std::string, std::string, int, std::string> ();
 
-	fprintf(stderr, ">>> assertion failed: %s in %s:%d, function %s\n",
+	char text[512];
+	const int len = snprintf(text, sizeof(text),
+		">>> assertion failed: %s in %s:%d, function %s\n",
 		expr.c_str(), file.c_str(), line, func.c_str());
+	LogWriter::error({text, std::min<size_t>(len, sizeof(text) - 1)});
 	machine.stop();
 }
 APICALL(print)
 {
 	auto [buffer] = machine.sysargs<riscv::Buffer> ();
-	auto string = buffer.to_string();
-
-	printf(">>> %s: %.*s", get_script(machine).name().c_str(),
-		(int) string.size(), string.c_str());
-	machine.set_result(string.size());
+	auto& script = get_script(machine);
+	/* Dropped output still counts as written, for the guest */
+	machine.set_result(buffer.size());
+	if (!script.vrm()->log_limiter.take())
+		return;
+	if (buffer.is_sequential()) {
+		LogWriter::write(script.name(), {buffer.c_str(), buffer.size()});
+	} else {
+		/* Anything beyond this would be truncated by the writer */
+		char text[LogWriter::MAX_MESSAGE];
+		const size_t len = buffer.copy_to(text, sizeof(text));
+		LogWriter::write(script.name(), {text, len});
+	}
 }
 APICALL(write_log)
 {
 	auto [string] = machine.sysargs<std::string> ();
+	auto& script = get_script(machine);
 
-	printf(">>> %s: %.*s", get_script(machine).name().c_str(),
-		(int)string.size(), string.c_str());
+	LogWriter::write(script.vrm()->log_limiter, script.name(), string);
 	machine.set_result(string.size());
 }
 
@@ -55,25 +59,24 @@ APICALL(set_decision)
 {
 }
 
-APICALL(create_response)
+APICALL(yield)
 {
-	machine.stop();
+	/* Suspends an asynchronous request for at least the given number
+	   of milliseconds, and returns 0 when resumed. Synchronous
+	   requests cannot be suspended, and get -1 back right away. */
+	auto [ms] = machine.sysargs<uint32_t> ();
+	auto& script = get_script(machine);
+	if (!script.is_async()) {
+		machine.set_result(-1);
+		return;
+	}
+	machine.set_result(0);
+	script.suspend(ms);
 }
 
-APICALL(regex_compile)
-{
-}
-APICALL(regex_match)
-{
-}
-APICALL(regex_subst)
-{
-}
-APICALL(regex_subst_hdr)
-{
-}
-APICALL(regex_delete)
+APICALL(create_response)
 {
+	machine.stop();
 }
 
 void Script::setup_syscall_interface()
@@ -84,26 +87,15 @@ void Script::setup_syscall_interface()
 		{ECALL_PRINT, print},
 		{ECALL_LOG, write_log},
 
-		{ECALL_REGEX_COMPILE, regex_compile},
-		{ECALL_REGEX_MATCH, regex_match},
-		{ECALL_REGEX_SUBST, regex_subst},
-		{ECALL_REGSUB_HDR, regex_subst_hdr},
-		{ECALL_REGEX_FREE, regex_delete},
-
 		{ECALL_MY_NAME, my_name},
 		{ECALL_SET_DECISION, set_decision},
 		{ECALL_CREATE_RESPONSE, create_response},
+		{ECALL_YIELD, yield},
 	});
-}
-
-timespec time_now()
-{
-	timespec t;
-	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
-	return t;
-}
-long nanodiff(timespec start_time, timespec end_time)
-{
-	assert(end_time.tv_sec == 0); /* We should never use seconds */
-	return end_time.tv_nsec - start_time.tv_nsec;
+	Script::setup_regex_interface();
+	Script::setup_http_interface();
+	Script::setup_kv_interface();
+	Script::setup_fetch_interface();
+	Script::setup_compress_interface();
+	Script::setup_primitives_interface();
 }
@@ -13,6 +13,15 @@ inline auto& get_script(machine_t& m) {
 	return *m.get_userdata<Script> ();
 }
 
+inline const re2::RE2& get_regex(machine_t& machine, uint32_t handle)
+{
+	const auto* re = get_script(machine).regex(handle);
+	if (UNLIKELY(re == nullptr))
+		throw riscv::MachineException(riscv::ILLEGAL_OPERATION,
+			"Invalid regex handle", handle);
+	return *re;
+}
+
 template <typename... T>
 constexpr auto make_array(T&&... t) -> std::array<std::common_type_t<T...>, sizeof...(t)>
 {
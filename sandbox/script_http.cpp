@@ -0,0 +1,530 @@
+#include "script_functions.hpp"
+#include <cctype>
+#include <drogon/HttpRequest.h>
+#include <drogon/HttpResponse.h>
+#include <re2/re2.h>
+#include "machine/syscalls.h"
+
+/**
+ * Request and response access for the guest.
+ *
+ * Field names are passed together with their CRC32, which the guest API
+ * computes at compile-time. Common header names are found through the
+ * hash, and only used when the name read from the guest is the same.
+ * Values are copied directly from drogon's strings into guest memory.
+ * Values written by the guest are limited to MAX_FIELD_VALUE, and may
+ * not contain CR, LF or NUL.
+**/
+static constexpr size_t MAX_FIELD_NAME = 256;
+static constexpr size_t MAX_FIELD_VALUE = 16384;
+
+static const std::unordered_map<uint32_t, std::string> known_fields = [] {
+	std::unordered_map<uint32_t, std::string> fields;
+	for (const char* name : {
+		":method", ":path", ":query",
+		"accept", "accept-encoding", "accept-language", "authorization",
+		"cache-control", "connection", "content-encoding", "content-length",
+		"content-type", "cookie", "date", "etag", "expires", "host",
+		"if-modified-since", "if-none-match", "last-modified", "location",
+		"origin", "pragma", "range", "referer", "server", "set-cookie",
+		"user-agent", "vary", "x-forwarded-for", "x-forwarded-proto",
+		"x-real-ip", "x-request-id" })
+	{
+		fields.try_emplace(crc32(name), name);
+	}
+	return fields;
+}();
+
+/* Header names are case-insensitive and stored lower-case by drogon,
+   while query parameters and cookies are case-sensitive. */
+static const std::string& field_name(machine_t& machine, int where,
+	uint32_t hash, gaddr_t addr, size_t len, std::string& storage)
+{
+	if (UNLIKELY(len == 0 || len > MAX_FIELD_NAME))
+		throw riscv::MachineException(riscv::ILLEGAL_OPERATION,
+			"Invalid HTTP field name length", len);
+
+	char buffer[MAX_FIELD_NAME];
+	machine.copy_from_guest(buffer, addr, len);
+	if (where == HTTP_REQ || where == HTTP_RESP) {
+		for (size_t i = 0; i < len; i++)
+			buffer[i] = std::tolower((unsigned char) buffer[i]);
+		/* The hash comes from the guest, and may not be of this name */
+		auto it = known_fields.find(hash);
+		if (it != known_fields.end() && it->second == std::string_view(buffer, len))
+			return it->second;
+	}
+	storage.assign(buffer, len);
+	return storage;
+}
+
+template <typename Map>
+static std::optional<std::string_view> find_in(const Map& map, const std::string& name)
+{
+	auto it = map.find(name);
+	if (it != map.end())
+		return std::string_view(it->second);
+	return std::nullopt;
+}
+
+static std::optional<std::string_view> find_field(Script& script, int where, const std::string& name)
+{
+	const auto* req  = script.http().req;
+	const auto* resp = script.http().resp;
+	switch (where) {
+	case HTTP_REQ:
+		if (req == nullptr) break;
+		if (name[0] == ':') {
+			if (name == ":method") return std::string_view(req->methodString());
+			if (name == ":path")   return std::string_view(req->path());
+			if (name == ":query")  return std::string_view(req->query());
+			break;
+		}
+		return find_in(req->headers(), name);
+	case HTTP_RESP:
+		if (resp == nullptr) break;
+		return find_in(resp->headers(), name);
+	case HTTP_QUERY:
+		if (req == nullptr) break;
+		return find_in(req->parameters(), name);
+	case HTTP_COOKIE:
+		if (req == nullptr) break;
+		return find_in(req->cookies(), name);
+	}
+	return std::nullopt;
+}
+
+/* Calls func(name, value) for every field in a list */
+template <typename Func>
+static void for_each_field(Script& script, int where, Func func)
+{
+	const auto* req  = script.http().req;
+	const auto* resp = script.http().resp;
+	switch (where) {
+	case HTTP_REQ:
+		if (req != nullptr)
+			for (const auto& it : req->headers()) func(it.first, it.second);
+		break;
+	case HTTP_RESP:
+		if (resp != nullptr)
+			for (const auto& it : resp->headers()) func(it.first, it.second);
+		break;
+	case HTTP_QUERY:
+		if (req != nullptr)
+			for (const auto& it : req->parameters()) func(it.first, it.second);
+		break;
+	case HTTP_COOKIE:
+		if (req != nullptr)
+			for (const auto& it : req->cookies()) func(it.first, it.second);
+		break;
+	}
+}
+
+/* CR and LF would end the header early and start one of the guest's
+   choosing, and NUL is cut off by some peers, so none of them are
+   allowed in a name or value that the guest writes. */
+static bool valid_field(std::string_view text) noexcept
+{
+	return text.find_first_of(std::string_view("\r\n\0", 3)) == std::string_view::npos;
+}
+
+/* Only the request and response headers can be modified */
+static bool set_field(Script& script, int where, const std::string& name, const std::string& value)
+{
+	if (UNLIKELY(name[0] == ':'))
+		return false;
+	if (UNLIKELY(value.size() > MAX_FIELD_VALUE || !valid_field(name) || !valid_field(value)))
+		return false;
+	if (where == HTTP_REQ && script.http().req != nullptr) {
+		script.http().req->addHeader(name, value);
+		return true;
+	}
+	if (where == HTTP_RESP && script.http().resp != nullptr) {
+		script.http().resp->addHeader(name, value);
+		return true;
+	}
+	return false;
+}
+static bool unset_field(Script& script, int where, const std::string& name)
+{
+	if (where == HTTP_REQ && script.http().req != nullptr) {
+		script.http().req->removeHeader(name);
+		return true;
+	}
+	if (where == HTTP_RESP && script.http().resp != nullptr) {
+		script.http().resp->removeHeader(name);
+		return true;
+	}
+	return false;
+}
+
+static std::string guest_string(machine_t& machine, gaddr_t addr, size_t len)
+{
+	std::string result(len, '\0');
+	machine.copy_from_guest(result.data(), addr, len);
+	return result;
+}
+
+APICALL(foreach_field)
+{
+	/* Writes "name: value\n" for every field, returns the full length */
+	auto [where, dst, dstlen] = machine.sysargs<int, gaddr_t, size_t> ();
+	auto& script = get_script(machine);
+
+	size_t total = 0;
+	for_each_field(script, where,
+		[&] (const std::string& name, const std::string& value) {
+			const std::string_view parts[] = { name, ": ", value, "\n" };
+			for (const auto part : parts) {
+				if (total < dstlen) {
+					const size_t len = std::min(part.size(), dstlen - total);
+					machine.copy_to_guest(dst + total, part.data(), len);
+				}
+				total += part.size();
+			}
+		});
+	machine.set_result(total);
+}
+APICALL(field_get)
+{
+	/* Copies the value into the buffer, returns the full length or -1 */
+	auto [where, hash, name_addr, name_len, dst, dstlen] =
+		machine.sysargs<int, uint32_t, gaddr_t, size_t, gaddr_t, size_t> ();
+	auto& script = get_script(machine);
+
+	std::string storage;
+	const auto& name = field_name(machine, where, hash, name_addr, name_len, storage);
+	const auto value = find_field(script, where, name);
+	if (value) {
+		machine.copy_to_guest(dst, value->data(), std::min(value->size(), dstlen));
+		machine.set_result(value->size());
+	} else {
+		machine.set_result(-1);
+	}
+}
+APICALL(field_retrieve)
+{
+	/* Allocates the value on the heap, pointer and length in A0, A1 */
+	auto [where, hash, name_addr, name_len] =
+		machine.sysargs<int, uint32_t, gaddr_t, size_t> ();
+	auto& script = get_script(machine);
+
+	std::string storage;
+	const auto& name = field_name(machine, where, hash, name_addr, name_len, storage);
+	const auto value = find_field(script, where, name);
+	if (value) {
+		const gaddr_t addr = machine.arena().malloc(value->size()+1);
+		if (addr != 0x0) {
+			machine.copy_to_guest(addr, value->data(), value->size());
+			machine.memory.write<uint8_t>(addr + value->size(), 0);
+		}
+		machine.cpu.reg(11) = value->size();
+		machine.cpu.reg(10) = addr;
+	} else {
+		machine.cpu.reg(11) = 0;
+		machine.cpu.reg(10) = 0x0;
+	}
+}
+APICALL(field_append)
+{
+	/* Appends to a list-valued header, separated by comma */
+	auto [where, hash, name_addr, name_len, val_addr, val_len] =
+		machine.sysargs<int, uint32_t, gaddr_t, size_t, gaddr_t, size_t> ();
+	auto& script = get_script(machine);
+
+	std::string storage;
+	const auto& name = field_name(machine, where, hash, name_addr, name_len, storage);
+	std::string value;
+	if (const auto old = find_field(script, where, name); old && !old->empty()) {
+		if (UNLIKELY(old->size() + 2 + val_len > MAX_FIELD_VALUE)) {
+			machine.set_result(-1);
+			return;
+		}
+		value.reserve(old->size() + 2 + val_len);
+		value.append(*old).append(", ");
+	}
+	if (UNLIKELY(val_len > MAX_FIELD_VALUE)) {
+		machine.set_result(-1);
+		return;
+	}
+	value += guest_string(machine, val_addr, val_len);
+	machine.set_result(set_field(script, where, name, value) ? 0 : -1);
+}
+APICALL(field_set)
+{
+	auto [where, hash, name_addr, name_len, val_addr, val_len] =
+		machine.sysargs<int, uint32_t, gaddr_t, size_t, gaddr_t, size_t> ();
+	auto& script = get_script(machine);
+
+	if (UNLIKELY(val_len > MAX_FIELD_VALUE)) {
+		machine.set_result(-1);
+		return;
+	}
+	std::string storage;
+	const auto& name = field_name(machine, where, hash, name_addr, name_len, storage);
+	const auto value = guest_string(machine, val_addr, val_len);
+	machine.set_result(set_field(script, where, name, value) ? 0 : -1);
+}
+APICALL(field_copy)
+{
+	/* Copies one field from one list to another */
+	auto [src, dst, hash, name_addr, name_len] =
+		machine.sysargs<int, int, uint32_t, gaddr_t, size_t> ();
+	auto& script = get_script(machine);
+
+	std::string storage;
+	const auto& name = field_name(machine, src, hash, name_addr, name_len, storage);
+	const auto value = find_field(script, src, name);
+	if (value) {
+		machine.set_result(set_field(script, dst, name, std::string(*value)) ? 0 : -1);
+	} else {
+		machine.set_result(-1);
+	}
+}
+APICALL(field_unset)
+{
+	auto [where, hash, name_addr, name_len] =
+		machine.sysargs<int, uint32_t, gaddr_t, size_t> ();
+	auto& script = get_script(machine);
+
+	std::string storage;
+	const auto& name = field_name(machine, where, hash, name_addr, name_len, storage);
+	machine.set_result(unset_field(script, where, name) ? 0 : -1);
+}
+
+APICALL(http_rollback)
+{
+	/* Removes every header from the response, and resets the status.
+	   The request has no saved state to roll back to. */
+	auto [where] = machine.sysargs<int> ();
+	auto& script = get_script(machine);
+	auto* resp = script.http().resp;
+	if (where != HTTP_RESP || resp == nullptr) {
+		machine.set_result(-1);
+		return;
+	}
+	std::vector<std::string> names;
+	for (const auto& it : resp->headers())
+		names.push_back(it.first);
+	for (const auto& name : names)
+		resp->removeHeader(name);
+	resp->setStatusCode(drogon::k200OK);
+	machine.set_result(0);
+}
+APICALL(http_copy)
+{
+	/* Copies every field from one list to another */
+	auto [src, dst] = machine.sysargs<int, int> ();
+	auto& script = get_script(machine);
+
+	std::vector<std::pair<std::string, std::string>> fields;
+	for_each_field(script, src,
+		[&] (const std::string& name, const std::string& value) {
+			fields.emplace_back(name, value);
+		});
+	for (const auto& field : fields) {
+		if (!set_field(script, dst, field.first, field.second)) {
+			machine.set_result(-1);
+			return;
+		}
+	}
+	machine.set_result(fields.size());
+}
+APICALL(http_set_status)
+{
+	/* Returns the previous status code */
+	auto [status] = machine.sysargs<int> ();
+	auto* resp = get_script(machine).http().resp;
+	if (resp == nullptr || status < 100 || status > 999) {
+		machine.set_result(-1);
+		return;
+	}
+	const int previous = resp->statusCode();
+	resp->setStatusCode((drogon::HttpStatusCode) status);
+	machine.set_result(previous);
+}
+APICALL(http_find)
+{
+	/* Returns the length of the value, or -1 if not found */
+	auto [where, hash, name_addr, name_len] =
+		machine.sysargs<int, uint32_t, gaddr_t, size_t> ();
+	auto& script = get_script(machine);
+
+	std::string storage;
+	const auto& name = field_name(machine, where, hash, name_addr, name_len, storage);
+	const auto value = find_field(script, where, name);
+	machine.set_result(value ? (long) value->size() : -1L);
+}
+
+APICALL(regex_subst_hdr)
+{
+	/* Substitutes in the value of a field, returns the number of
+	   substitutions or -1 if the field was not found or the value
+	   would grow beyond MAX_FIELD_VALUE. */
+	auto [handle, where_flags, hash, name_addr, name_len, repl_addr, repl_len] =
+		machine.sysargs<uint32_t, int, uint32_t, gaddr_t, size_t, gaddr_t, size_t> ();
+	auto& script = get_script(machine);
+	const auto& re = get_regex(machine, handle);
+	const int where = where_flags & ~REGEX_GLOBAL;
+
+	std::string storage;
+	const auto& name = field_name(machine, where, hash, name_addr, name_len, storage);
+	const auto old = find_field(script, where, name);
+	if (!old || repl_len > MAX_FIELD_VALUE) {
+		machine.set_result(-1);
+		return;
+	}
+	const auto replacement = guest_string(machine, repl_addr, repl_len);
+	std::string value;
+	const int count = RegexTable::replace(value, *old, re,
+		replacement, where_flags & REGEX_GLOBAL, MAX_FIELD_VALUE);
+
+	if (count < 0 || (count > 0 && !set_field(script, where, name, value))) {
+		machine.set_result(-1);
+		return;
+	}
+	machine.set_result(count);
+}
+APICALL(http_unset_re)
+{
+	/* Removes every field with a name matching the pattern,
+	   returns the number of fields removed. */
+	auto [where, handle] = machine.sysargs<int, uint32_t> ();
+	auto& script = get_script(machine);
+	const auto& re = get_regex(machine, handle);
+
+	std::vector<std::string> names;
+	for_each_field(script, where,
+		[&] (const std::string& name, const std::string&) {
+			if (re2::RE2::PartialMatch(name, re))
+				names.push_back(name);
+		});
+	for (const auto& name : names) {
+		if (!unset_field(script, where, name)) {
+			machine.set_result(-1);
+			return;
+		}
+	}
+	machine.set_result(names.size());
+}
+
+APICALL(http_cache_control)
+{
+	/* Makes the response cacheable for ttl seconds, varying on a
+	   comma-separated list of request headers. A zero TTL disables. */
+	auto [ttl, vary_addr, vary_len] = machine.sysargs<uint32_t, gaddr_t, size_t> ();
+	auto& cc = get_script(machine).cache_control();
+	if (UNLIKELY(vary_len > MAX_FIELD_NAME * 4))
+		throw riscv::MachineException(riscv::ILLEGAL_OPERATION,
+			"Cache vary list too long", vary_len);
+
+	cc.ttl = ttl;
+	cc.vary.clear();
+	std::string vary = guest_string(machine, vary_addr, vary_len);
+	size_t start = 0;
+	while (start < vary.size()) {
+		size_t end = vary.find(',', start);
+		if (end == std::string::npos) end = vary.size();
+		std::string name;
+		for (size_t i = start; i < end; i++) {
+			if (vary[i] != ' ' && vary[i] != '\t')
+				name += std::tolower((unsigned char) vary[i]);
+		}
+		if (!name.empty())
+			cc.vary.push_back(std::move(name));
+		start = end + 1;
+	}
+	machine.set_result(0);
+}
+
+APICALL(route_add)
+{
+	/* Routes method and path patterns to a function, instead of
+	   on_client_request. Only during initialization. */
+	auto [methods, addr, len, func] =
+		machine.sysargs<unsigned, gaddr_t, size_t, gaddr_t> ();
+	if (UNLIKELY(len > RouteTable::MAX_PATTERN_LENGTH)) {
+		machine.set_result(-1);
+		return;
+	}
+	const std::string pattern = guest_string(machine, addr, len);
+	machine.set_result(get_script(machine).add_route(methods, pattern, func) ? 0 : -1);
+}
+APICALL(route_param)
+{
+	/* Copies the nth parameter of the route into buf, returns the
+	   full length of the value or -1 if there is no such parameter */
+	auto [idx, buf_addr, buf_len] = machine.sysargs<unsigned, gaddr_t, size_t> ();
+	const auto& params = get_script(machine).route_params();
+	if (idx >= params.count) {
+		machine.set_result(-1);
+		return;
+	}
+	const auto value = params.values[idx];
+	machine.copy_to_guest(buf_addr, value.data(), std::min(value.size(), buf_len));
+	machine.set_result(value.size());
+}
+
+void Script::setup_http_interface()
+{
+	machine_t::install_syscall_handlers({
+		{ECALL_FOREACH_FIELD, foreach_field},
+		{ECALL_FIELD_GET, field_get},
+		{ECALL_FIELD_RETRIEVE, field_retrieve},
+		{ECALL_FIELD_APPEND, field_append},
+		{ECALL_FIELD_SET, field_set},
+		{ECALL_FIELD_COPY, field_copy},
+		{ECALL_FIELD_UNSET, field_unset},
+
+		{ECALL_HTTP_ROLLBACK, http_rollback},
+		{ECALL_HTTP_COPY, http_copy},
+		{ECALL_HTTP_SET_STATUS, http_set_status},
+		{ECALL_HTTP_UNSET_RE, http_unset_re},
+		{ECALL_HTTP_FIND, http_find},
+		{ECALL_REGSUB_HDR, regex_subst_hdr},
+
+		{ECALL_CACHE_CONTROL, http_cache_control},
+		{ECALL_ROUTE_ADD, route_add},
+		{ECALL_ROUTE_PARAM, route_param},
+	});
+}
+
+bool Script::stream_body(gaddr_t func, gaddr_t window, size_t window_size,
+	uint64_t& instructions)
+{
+	/* The guest is called with (data, len, last) for every chunk, and
+	   returns how many bytes it consumed. Unconsumed bytes are moved to
+	   the front of the window and handed over again with the next chunk,
+	   so the window is all the memory a body ever uses. Returning a
+	   negative value (or not consuming anything from a full window)
+	   stops the upload, and on_client_request is called as usual.
+	   The chunks and the request itself share one instruction budget. */
+	const std::string_view body = m_http.req->body();
+	std::vector<char> rest;
+	size_t buffered = 0;
+	size_t offset = 0;
+	while (true) {
+		const size_t n = std::min(window_size - buffered, body.size() - offset);
+		machine().copy_to_guest(window + buffered, body.data() + offset, n);
+		offset += n;
+		buffered += n;
+		const bool last = (offset == body.size());
+
+		const auto consumed = this->call(func, window, buffered, int(last));
+		m_spent_instructions += machine().instruction_counter();
+		instructions += machine().instruction_counter();
+		if (UNLIKELY(!consumed))
+			return false;
+		if (last || *consumed < 0 || (*consumed == 0 && buffered == window_size))
+			return true;
+		if (UNLIKELY(size_t(*consumed) > buffered))
+			return false;
+
+		buffered -= *consumed;
+		if (buffered > 0) {
+			rest.resize(buffered);
+			machine().copy_from_guest(rest.data(), window + *consumed, buffered);
+			machine().copy_to_guest(window, rest.data(), buffered);
+		}
+	}
+}
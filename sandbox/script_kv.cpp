@@ -0,0 +1,99 @@
+#include "script_functions.hpp"
+#include "kv_store.hpp"
+#include "tenant_instance.hpp"
+#include "machine/syscalls.h"
+
+/**
+ * The tenant's key-value store, for the guest.
+ *
+ * Keys are copied out of the guest, and values are read in place when
+ * they are sequential in host memory. Values are copied straight from
+ * the store into guest memory, while the RCU read guard is held.
+**/
+static KVStore& get_store(machine_t& machine)
+{
+	return get_script(machine).vrm()->kv;
+}
+
+/* Returns an empty view when the key is too long */
+static std::string_view guest_key(machine_t& machine, gaddr_t addr, size_t len,
+	std::array<char, KVStore::MAX_KEY>& storage)
+{
+	if (UNLIKELY(len > storage.size()))
+		return {};
+	machine.copy_from_guest(storage.data(), addr, len);
+	return {storage.data(), len};
+}
+
+APICALL(kv_get)
+{
+	/* Copies the value into buf, returns the full length of
+	   the value or -1 if the key doesn't exist */
+	auto [key_addr, key_len, buf_addr, buf_len] =
+		machine.sysargs<gaddr_t, size_t, gaddr_t, size_t> ();
+	std::array<char, KVStore::MAX_KEY> storage;
+	const auto key = guest_key(machine, key_addr, key_len, storage);
+	long result = -1;
+	get_store(machine).read(key, [&] (std::string_view value) {
+		machine.copy_to_guest(buf_addr, value.data(), std::min(value.size(), buf_len));
+		result = value.size();
+	});
+	machine.set_result(result);
+}
+APICALL(kv_set)
+{
+	auto [key_addr, key_len, val_addr, val_len] =
+		machine.sysargs<gaddr_t, size_t, gaddr_t, size_t> ();
+	std::array<char, KVStore::MAX_KEY> storage;
+	const auto key = guest_key(machine, key_addr, key_len, storage);
+	if (UNLIKELY(key.empty() || val_len > KVStore::MAX_VALUE)) {
+		machine.set_result(-1);
+		return;
+	}
+	const auto buffer = machine.memory.rvbuffer(val_addr, val_len, KVStore::MAX_VALUE);
+	bool result;
+	if (buffer.is_sequential()) {
+		result = get_store(machine).set(key, {buffer.data(), buffer.size()});
+	} else {
+		result = get_store(machine).set(key, buffer.to_string());
+	}
+	machine.set_result(result ? 0 : -1);
+}
+APICALL(kv_del)
+{
+	auto [key_addr, key_len] = machine.sysargs<gaddr_t, size_t> ();
+	std::array<char, KVStore::MAX_KEY> storage;
+	const auto key = guest_key(machine, key_addr, key_len, storage);
+	machine.set_result(get_store(machine).erase(key) ? 0 : -1);
+}
+APICALL(kv_incr)
+{
+	/* Writes the new value to the result address, returns -1
+	   if the store is full or the key is invalid */
+	auto [key_addr, key_len, delta, result_addr] =
+		machine.sysargs<gaddr_t, size_t, int64_t, gaddr_t> ();
+	std::array<char, KVStore::MAX_KEY> storage;
+	const auto key = guest_key(machine, key_addr, key_len, storage);
+	if (UNLIKELY(key.empty())) {
+		machine.set_result(-1);
+		return;
+	}
+	const auto value = get_store(machine).increment(key, delta);
+	if (!value) {
+		machine.set_result(-1);
+		return;
+	}
+	if (result_addr != 0x0)
+		machine.copy_to_guest(result_addr, &*value, sizeof(int64_t));
+	machine.set_result(0);
+}
+
+void Script::setup_kv_interface()
+{
+	machine_t::install_syscall_handlers({
+		{ECALL_KV_GET, kv_get},
+		{ECALL_KV_SET, kv_set},
+		{ECALL_KV_DEL, kv_del},
+		{ECALL_KV_INCR, kv_incr},
+	});
+}
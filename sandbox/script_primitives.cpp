@@ -0,0 +1,153 @@
+#include "script_functions.hpp"
+#include "primitives.hpp"
+#include "machine/syscalls.h"
+
+/**
+ * String, checksum and encoding primitives for the guest.
+ *
+ * These are loops over every byte, which cost a few instructions per
+ * byte when emulated, and a fraction of a nanosecond natively. Inputs
+ * are read in place when they are sequential in host memory, and the
+ * output is copied back when it fits. bench/primitives.cpp compares
+ * the two per byte. Input bytes are still charged as an instruction
+ * each, so that the instruction limit of a call bounds the work.
+**/
+static constexpr size_t MAX_SOURCE = 16ul << 20;
+static constexpr size_t GATHER_BYTES = 1ul << 20;
+static constexpr uint64_t PENALTY_PER_BYTE = 1;
+
+/* Copied only when the range isn't sequential in host memory */
+static std::string_view guest_view(machine_t& machine, gaddr_t addr, size_t len,
+	std::string& storage)
+{
+	const auto buffer = machine.memory.rvbuffer(addr, len, MAX_SOURCE);
+	if (buffer.is_sequential())
+		return {buffer.data(), buffer.size()};
+	storage = buffer.to_string();
+	return storage;
+}
+
+/* Returns the length of the output, or -1 if it doesn't fit */
+static void output(machine_t& machine, const std::string& out, gaddr_t dst_addr, size_t dst_len)
+{
+	if (out.size() > dst_len) {
+		machine.set_result(-1);
+		return;
+	}
+	machine.copy_to_guest(dst_addr, out.data(), out.size());
+	machine.set_result(out.size());
+}
+
+APICALL(find)
+{
+	/* Returns the offset of needle in haystack, or -1 */
+	auto [hay_addr, hay_len, needle_addr, needle_len] =
+		machine.sysargs<gaddr_t, size_t, gaddr_t, size_t> ();
+	if (hay_len > MAX_SOURCE || needle_len > MAX_SOURCE) {
+		machine.set_result(-1);
+		return;
+	}
+	machine.penalize((hay_len + needle_len) * PENALTY_PER_BYTE);
+	std::string hay_storage, needle_storage;
+	const auto haystack = guest_view(machine, hay_addr, hay_len, hay_storage);
+	const auto needle = guest_view(machine, needle_addr, needle_len, needle_storage);
+	const size_t pos = primitives::find(haystack, needle);
+	machine.set_result((pos != primitives::npos) ? long(pos) : -1L);
+}
+APICALL(checksum)
+{
+	/* Continues from crc, which is 0 to start with. Pages are read
+	   in place, one megabyte at a time. */
+	auto [poly, addr, len, crc] = machine.sysargs<unsigned, gaddr_t, size_t, uint32_t> ();
+	if (poly > CRC32_C || len > MAX_SOURCE) {
+		machine.set_result(-1);
+		return;
+	}
+	machine.penalize(len * PENALTY_PER_BYTE);
+	std::array<riscv::vBuffer, GATHER_BYTES / 4096 + 1> buffers;
+	for (size_t offset = 0; offset < len; offset += GATHER_BYTES) {
+		const size_t cnt = machine.memory.gather_buffers_from_range(
+			buffers.size(), buffers.data(), addr + offset, std::min(GATHER_BYTES, len - offset));
+		for (size_t i = 0; i < cnt; i++) {
+			const void* data = buffers[i].ptr;
+			crc = (poly == CRC32_C)
+				? crc32<0x82F63B78>(data, buffers[i].len, crc)
+				: crc32(data, buffers[i].len, crc);
+		}
+	}
+	machine.set_result(crc);
+}
+APICALL(base64_encode)
+{
+	auto [src_addr, src_len, dst_addr, dst_len] =
+		machine.sysargs<gaddr_t, size_t, gaddr_t, size_t> ();
+	if (src_len > MAX_SOURCE || primitives::base64_length(src_len) > dst_len) {
+		machine.set_result(-1);
+		return;
+	}
+	machine.penalize(src_len * PENALTY_PER_BYTE);
+	std::string storage, out;
+	primitives::base64_encode(guest_view(machine, src_addr, src_len, storage), out);
+	output(machine, out, dst_addr, dst_len);
+}
+APICALL(base64_decode)
+{
+	/* -1 also for invalid input */
+	auto [src_addr, src_len, dst_addr, dst_len] =
+		machine.sysargs<gaddr_t, size_t, gaddr_t, size_t> ();
+	std::string storage, out;
+	if (src_len <= MAX_SOURCE)
+		machine.penalize(src_len * PENALTY_PER_BYTE);
+	if (src_len > MAX_SOURCE
+		|| !primitives::base64_decode(guest_view(machine, src_addr, src_len, storage), out))
+	{
+		machine.set_result(-1);
+		return;
+	}
+	output(machine, out, dst_addr, dst_len);
+}
+APICALL(url_decode)
+{
+	/* -1 also for an invalid escape */
+	auto [src_addr, src_len, dst_addr, dst_len, form] =
+		machine.sysargs<gaddr_t, size_t, gaddr_t, size_t, int> ();
+	std::string storage, out;
+	if (src_len <= MAX_SOURCE)
+		machine.penalize(src_len * PENALTY_PER_BYTE);
+	if (src_len > MAX_SOURCE
+		|| !primitives::url_decode(guest_view(machine, src_addr, src_len, storage), out, form != 0))
+	{
+		machine.set_result(-1);
+		return;
+	}
+	output(machine, out, dst_addr, dst_len);
+}
+APICALL(escape)
+{
+	auto [kind, src_addr, src_len, dst_addr, dst_len] =
+		machine.sysargs<unsigned, gaddr_t, size_t, gaddr_t, size_t> ();
+	if (kind > ESCAPE_JSON || src_len > MAX_SOURCE) {
+		machine.set_result(-1);
+		return;
+	}
+	machine.penalize(src_len * PENALTY_PER_BYTE);
+	std::string storage, out;
+	const auto data = guest_view(machine, src_addr, src_len, storage);
+	if (kind == ESCAPE_HTML)
+		primitives::escape_html(data, out);
+	else
+		primitives::escape_json(data, out);
+	output(machine, out, dst_addr, dst_len);
+}
+
+void Script::setup_primitives_interface()
+{
+	machine_t::install_syscall_handlers({
+		{ECALL_FIND, find},
+		{ECALL_CRC32, checksum},
+		{ECALL_BASE64_ENCODE, base64_encode},
+		{ECALL_BASE64_DECODE, base64_decode},
+		{ECALL_URL_DECODE, url_decode},
+		{ECALL_ESCAPE, escape},
+	});
+}
@@ -0,0 +1,102 @@
+#include "script_functions.hpp"
+#include <re2/re2.h>
+#include "machine/syscalls.h"
+
+/**
+ * Regular expressions for the guest.
+ *
+ * Patterns compiled during on_init belong to the main VM and are shared
+ * by every fork, so requests only pay for matching. Subjects are matched
+ * directly in guest memory when they are sequential.
+**/
+static constexpr size_t MAX_SUBJECT = 16ul << 20;
+
+/* Views the guest string without copying, unless it spans pages
+   that are not sequential in host memory. */
+struct GuestView {
+	GuestView(machine_t& machine, gaddr_t addr, size_t len)
+		: buffer{machine.memory.rvbuffer(addr, len, MAX_SUBJECT)}
+	{
+		if (buffer.is_sequential()) {
+			view = {buffer.data(), buffer.size()};
+		} else {
+			storage = buffer.to_string();
+			view = storage;
+		}
+	}
+	re2::StringPiece piece() const noexcept { return {view.data(), view.size()}; }
+
+	riscv::Buffer buffer;
+	std::string storage;
+	std::string_view view;
+};
+
+APICALL(regex_compile)
+{
+	/* Returns a handle, or -1 if the pattern is invalid */
+	auto [addr, len] = machine.sysargs<gaddr_t, size_t> ();
+	if (UNLIKELY(len > RegexTable::MAX_PATTERN_LENGTH)) {
+		machine.set_result(-1);
+		return;
+	}
+	std::string pattern(len, '\0');
+	machine.copy_from_guest(pattern.data(), addr, len);
+	machine.set_result(get_script(machine).compile_regex(pattern));
+}
+APICALL(regex_match)
+{
+	/* Returns 1 if the pattern matches anywhere in the subject */
+	auto [handle, addr, len] = machine.sysargs<uint32_t, gaddr_t, size_t> ();
+	const auto& re = get_regex(machine, handle);
+	GuestView subject { machine, addr, len };
+	machine.set_result(re2::RE2::PartialMatch(subject.piece(), re) ? 1 : 0);
+}
+APICALL(regex_subst)
+{
+	/* Substitutes the first (or every) match, and allocates the result
+	   on the heap with pointer and length in A0, A1. A0 is zero when
+	   nothing was substituted. \0..\9 in the replacement refer to
+	   the capture groups. Returns -1 in A0 if the result would not
+	   fit in the free memory of the heap. */
+	auto [handle, addr, len, repl_addr, repl_len, flags] =
+		machine.sysargs<uint32_t, gaddr_t, size_t, gaddr_t, size_t, int> ();
+	const auto& re = get_regex(machine, handle);
+	GuestView subject { machine, addr, len };
+	GuestView replacement { machine, repl_addr, repl_len };
+
+	const size_t max_size = std::min(MAX_SUBJECT, machine.arena().bytes_free());
+	std::string result;
+	const int count = RegexTable::replace(result, subject.view, re,
+		replacement.view, flags & REGEX_GLOBAL, max_size);
+	if (count < 0) {
+		machine.cpu.reg(11) = 0;
+		machine.set_result(-1);
+		return;
+	}
+
+	gaddr_t dst = 0x0;
+	if (count > 0) {
+		dst = machine.arena().malloc(result.size()+1);
+		if (dst != 0x0) {
+			machine.copy_to_guest(dst, result.data(), result.size());
+			machine.memory.write<uint8_t>(dst + result.size(), 0);
+		}
+	}
+	machine.cpu.reg(11) = (dst != 0x0) ? result.size() : 0;
+	machine.cpu.reg(10) = dst;
+}
+APICALL(regex_delete)
+{
+	auto [handle] = machine.sysargs<uint32_t> ();
+	machine.set_result(get_script(machine).free_regex(handle) ? 0 : -1);
+}
+
+void Script::setup_regex_interface()
+{
+	machine_t::install_syscall_handlers({
+		{ECALL_REGEX_COMPILE, regex_compile},
+		{ECALL_REGEX_MATCH, regex_match},
+		{ECALL_REGEX_SUBST, regex_subst},
+		{ECALL_REGEX_FREE, regex_delete},
+	});
+}
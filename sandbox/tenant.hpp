@@ -1,6 +1,7 @@
 #pragma once
 #include <cstdint>
 #include <string>
+#include <vector>
 
 struct TenantConfig
 {
@@ -10,4 +11,21 @@ struct TenantConfig
 	uint64_t     max_instructions;
 	uint64_t     max_memory;
 	uint64_t     max_heap;
+	/* Response cache memory, 0 disables caching */
+	uint64_t     max_cache_bytes = 0;
+	/* Requests can be suspended by the guest, see ECALL_YIELD */
+	bool         async_requests = false;
+	/* Requests suspended at the same time across all threads, 0 is unlimited */
+	uint32_t     max_suspended_requests = 256;
+	/* CPU budget shared by all threads, 0 is unlimited */
+	uint64_t     max_instructions_per_sec = 0;
+	uint64_t     max_cpu_us_per_sec = 0;
+	/* Guest log lines shared by all threads, 0 is unlimited */
+	uint64_t     max_log_lines_per_sec = 0;
+	/* Key-value store memory, 0 disables the store */
+	uint64_t     max_kv_bytes = 0;
+	/* Origins that ECALL_FETCH may reach, like "http://127.0.0.1:8082" */
+	std::vector<std::string> upstreams {};
+	/* Upstream requests in flight across all threads, 0 is unlimited */
+	uint32_t     max_upstream_requests = 0;
 };
@@ -1,32 +1,61 @@
 #include "tenant_instance.hpp"
 #include "machine_instance.hpp"
+#include "numa.hpp"
+#include "sandbox_pool.hpp"
+#include "translation_cache.hpp"
+#include "machine/syscalls.h"
+#include <drogon/HttpRequest.h>
 #include <stdexcept>
 
-//#define ENABLE_TIMING
-#define TIMING_LOCATION(x) \
-	asm("" ::: "memory"); \
-	auto x = time_now();  \
-	asm("" ::: "memory");
-
-
-inline timespec time_now();
-inline long nanodiff(timespec start_time, timespec end_time);
-std::vector<uint8_t> file_loader(const std::string& file);
-
 TenantInstance::TenantInstance(const TenantConfig& conf)
-	: config{conf}
+	: config{conf}, cache{conf.max_cache_bytes},
+	  governor{{conf.max_instructions_per_sec, conf.max_cpu_us_per_sec}},
+	  /* Ten seconds of lines can be logged in a burst */
+	  log_limiter{conf.max_log_lines_per_sec, 10 * conf.max_log_lines_per_sec},
+	  kv{conf.max_kv_bytes},
+	  upstreams{{conf.upstreams, conf.max_upstream_requests}}
 {
+	BinaryTable::SharedBinary shared_elf;
 	try {
-		auto shared_elf = std::make_shared<std::vector<uint8_t>>(file_loader(conf.filename));
-		this->machine =
-			std::make_shared<MachineInstance> (std::move(shared_elf), this);
+		shared_elf = BinaryTable::load(conf.filename);
+		auto program =
+			std::make_shared<MachineInstance> (shared_elf, this);
+		if (Numa::replicate())
+			program->replicate();
+		this->machine = std::move(program);
 	} catch (const std::exception& e) {
 		fprintf(stderr,
 			"Exception when creating machine '%s': %s",
 			conf.name.c_str(), e.what());
 		machine = nullptr;
+		/* Don't let a bad translation fail the next attempt too */
+		if (shared_elf != nullptr)
+			TranslationCache::invalidate(*shared_elf);
+	}
+}
+bool TenantInstance::reload(SharedMachine& replaced)
+{
+	BinaryTable::SharedBinary shared_elf;
+	try {
+		shared_elf = BinaryTable::load(config.filename);
+		/* Runs on_init before anyone can see the new program */
+		auto program =
+			std::make_shared<MachineInstance> (shared_elf, this);
+		if (Numa::replicate())
+			program->replicate();
+		/* In-flight forks keep the old program alive */
+		replaced = std::atomic_exchange(&this->machine, std::move(program));
+		return true;
+	} catch (const std::exception& e) {
+		fprintf(stderr,
+			"Exception when reloading machine '%s': %s\n",
+			config.name.c_str(), e.what());
+		if (shared_elf != nullptr)
+			TranslationCache::invalidate(*shared_elf);
+		return false;
 	}
 }
+
 TenantInstance::~TenantInstance()
 {
 	SharedMachine release = nullptr;
@@ -36,14 +65,23 @@ TenantInstance::~TenantInstance()
 
 TenantInstance::SharedMachine TenantInstance::get_current_instance() const
 {
-	return std::atomic_load(&this->machine);
+	auto program = std::atomic_load(&this->machine);
+	/* Forks read the pages of the replica on their own node */
+	if (program != nullptr && !program->replicas.empty()) {
+		const size_t node = Numa::current_node();
+		if (node < program->replicas.size() && program->replicas[node] != nullptr)
+			return program->replicas[node];
+	}
+	return program;
+}
+
+TenantInstance::SharedMachine TenantInstance::current_program() const
+{
+	return this->get_current_instance();
 }
 
 Script* TenantInstance::vmfork()
 {
-#ifdef ENABLE_TIMING
-	TIMING_LOCATION(t0);
-#endif
 	SharedMachine program = this->get_current_instance();
 	/* First-time tenants could have no program */
 	if (UNLIKELY(program == nullptr))
@@ -55,89 +93,207 @@ Script* TenantInstance::vmfork()
 		return script;
 
 	} catch (const std::exception& e) {
-		fprintf(stderr,
-			"VM '%s' exception: %s", program->script.name().c_str(), e.what());
+		LogWriter::error("VM '" + program->script.name() + "' exception: "
+			+ e.what() + "\n");
 		return nullptr;
 	}
-#ifdef ENABLE_TIMING
-	TIMING_LOCATION(t1);
-	printf("Time spent in initialization: %ld ns\n", nanodiff(t0, t1));
-#endif
 }
 
-TenantInstance::ForkCall::ForkCall(const Script& script, TenantInstance* tenant, MachineInstance& inst)
-	: script{script, tenant, inst}, cnt{0}
+TenantInstance::ForkCall::ForkCall(std::unique_ptr<Script> s)
+	: script{std::move(s)}
 {
 	/* No initialization */
 }
+TenantInstance::ForkCall::~ForkCall()
+{
+	SandboxPool::local().release(std::move(script));
+}
+
+TenantInstance::ForkCallPtr TenantInstance::forkcall(Script::gaddr_t addr, const Script::Http& http)
+{
+	SharedMachine program = this->get_current_instance();
+	if (UNLIKELY(program == nullptr))
+		throw std::runtime_error("No program loaded");
 
-TenantInstance::ForkCall TenantInstance::forkcall(Script::gaddr_t addr,
-	size_t bufcnt, riscv::vBuffer buffers[])
+	return this->forkcall(std::move(program), addr, http);
+}
+TenantInstance::ForkCallPtr TenantInstance::forkcall(const Script::Http& http)
 {
 	SharedMachine program = this->get_current_instance();
 	if (UNLIKELY(program == nullptr))
 		throw std::runtime_error("No program loaded");
 
-	ForkCall result(program->script, this, *program);
-	Script& script = result.script;
-	script.assign_instance(std::move(program));
+	/* The entry address belongs to the program we are forking,
+	   which matters when the program is being hot-swapped. */
+	const auto addr = program->entry_address;
+	return this->forkcall(std::move(program), addr, http);
+}
+TenantInstance::ForkCallPtr TenantInstance::forkcall(SharedMachine program,
+	Script::gaddr_t addr, const Script::Http& http, const RouteParams& params)
+{
+	const uint64_t t0 = metrics::now();
+	auto result = std::make_unique<ForkCall>(
+		SandboxPool::local().acquire(*this, std::move(program)));
+	Script& script = *result->script;
+	/* Give the guest access to the request and response */
+	script.set_http(http);
+	script.route_params() = params;
 
 	/* Call into the virtual machine */
-#ifdef ENABLE_TIMING
-	TIMING_LOCATION(t2);
-#endif
-	script.call(addr);
-	TIMING_LOCATION(t3);
-	#ifdef ENABLE_TIMING
-	printf("Time spent in forkcall(): %ld ns\n", nanodiff(t2, t3));
-#endif
-
-	// TODO: perform check to see if the result
-	// is forging a response
-	Script::machine_t& machine = script.machine();
-	//const auto [type, data] = machine.sysargs<riscv::Buffer, riscv::Buffer> ();
-	auto cnt_addr = machine.cpu.reg(12);
-	auto cnt_len  = machine.cpu.reg(13);
-	result.cnt = machine.memory.gather_buffers_from_range(bufcnt, buffers, cnt_addr, cnt_len);
+	const uint64_t t1 = metrics::now();
+	result->fork_ticks = t1 - t0;
+	this->stream_body(*result);
+	const auto retval = script.call(addr);
+	const uint64_t t2 = metrics::now();
+
+	result->exec_ticks = t2 - t1;
+	this->record(*result, script.machine().instruction_counter());
+	if (UNLIKELY(!retval))
+		throw std::runtime_error("Request failed in " + config.name);
+
+	this->gather(*result);
 	return result;
 }
 
-Script::gaddr_t TenantInstance::lookup(const char* name) const {
-	SharedMachine program = this->get_current_instance();
-	if (LIKELY(program != nullptr))
-		return program->lookup(name);
-	return 0x0;
+TenantInstance::Dispatch TenantInstance::dispatch(unsigned method, std::string_view path) const
+{
+	Dispatch result;
+	result.program = this->get_current_instance();
+	if (UNLIKELY(result.program == nullptr))
+		throw std::runtime_error("No program loaded");
+
+	const auto& routes = result.program->script.routes();
+	if (routes.empty()) {
+		result.addr = result.program->entry_address;
+		return result;
+	}
+	auto match = routes.match(method, path);
+	/* HEAD is served by GET, unless it has a route of its own */
+	if (match.func == 0x0 && method == ROUTE_HEAD && (match.allow & ROUTE_GET))
+		match = routes.match(ROUTE_GET, path);
+
+	if (match.func != 0x0) {
+		result.addr = match.func;
+		result.params = match.params;
+	} else {
+		result.status = (match.allow != 0) ? 405 : 404;
+		result.allow = match.allow;
+	}
+	return result;
+}
+TenantInstance::ForkCallPtr TenantInstance::forkcall(const Dispatch& d, const Script::Http& http)
+{
+	return this->forkcall(d.program, d.addr, http, d.params);
+}
+
+TenantInstance::ForkCallPtr TenantInstance::async_forkcall(const Dispatch& d, const Script::Http& http)
+{
+	const uint64_t t0 = metrics::now();
+	auto result = std::make_unique<ForkCall>(
+		SandboxPool::local().acquire(*this, d.program));
+	Script& script = *result->script;
+	script.set_http(http);
+	script.route_params() = d.params;
+
+	const uint64_t t1 = metrics::now();
+	result->fork_ticks = t1 - t0;
+	this->stream_body(*result);
+	result->status = script.async_call(d.addr, ASYNC_SLICE);
+	result->exec_ticks = metrics::now() - t1;
+
+	this->async_done(*result);
+	return result;
 }
+void TenantInstance::async_resume(ForkCall& fc)
+{
+	const uint64_t t0 = metrics::now();
+	fc.status = fc.script->async_resume(ASYNC_SLICE);
+	fc.exec_ticks += metrics::now() - t0;
 
-#include <unistd.h>
-std::vector<uint8_t> file_loader(const std::string& filename)
+	this->async_done(fc);
+}
+void TenantInstance::async_done(ForkCall& fc)
 {
-    size_t size = 0;
-    FILE* f = fopen(filename.c_str(), "rb");
-    if (f == NULL) throw std::runtime_error("Could not open file: " + filename);
+	if (fc.status == Script::AsyncStatus::Suspended)
+		return;
+	this->record(fc, fc.script->async_instructions());
+	if (UNLIKELY(fc.status == Script::AsyncStatus::Failed))
+		throw std::runtime_error("Request failed in " + config.name);
+	this->gather(fc);
+}
 
-    fseek(f, 0, SEEK_END);
-    size = ftell(f);
-    fseek(f, 0, SEEK_SET);
+void TenantInstance::stream_body(ForkCall& fc)
+{
+	Script& script = *fc.script;
+	const auto& program = script.instance();
+	const auto* req = script.http().req;
+	if (program.body_chunk_address == 0x0 || req == nullptr || req->body().empty())
+		return;
 
-    std::vector<uint8_t> result(size);
-    if (size != fread(result.data(), 1, size, f))
-    {
-        fclose(f);
-        throw std::runtime_error("Error when reading from file: " + filename);
-    }
-    fclose(f);
-    return result;
+	if (UNLIKELY(!script.stream_body(program.body_chunk_address,
+		program.body_window, MachineInstance::BODY_WINDOW, fc.body_instructions)))
+	{
+		this->record(fc, 0);
+		throw std::runtime_error("Request body failed in " + config.name);
+	}
 }
 
-timespec time_now()
+void TenantInstance::record(const ForkCall& fc, uint64_t instructions)
 {
-	timespec t;
-	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
-	return t;
+	instructions += fc.body_instructions;
+	fc.script->learn_working_set();
+	const auto& stats = fc.script->call_stats();
+	this->metrics.record({
+		.fork_ticks   = fc.fork_ticks,
+		.exec_ticks   = fc.exec_ticks,
+		.instructions = instructions,
+		.page_faults  = stats.page_faults,
+		.cow_reads    = stats.cow_reads,
+		.prefaulted   = stats.prefaulted,
+		.timeout      = stats.timeout,
+		.exception    = stats.exception,
+	});
+	this->governor.charge(instructions, fc.fork_ticks + fc.exec_ticks);
 }
-long nanodiff(timespec start_time, timespec end_time)
+
+void TenantInstance::gather(ForkCall& fc)
 {
-	assert(end_time.tv_sec == 0); /* We should never use seconds */
-	return end_time.tv_nsec - start_time.tv_nsec;
+	/* The guest returns (content-type, body) in A0..A3. The body is
+	   gathered as a list of buffers pointing into guest memory, which
+	   stays valid for as long as the ForkCall is alive. */
+	Script::machine_t& machine = fc.script->machine();
+	const auto type_addr = machine.cpu.reg(10);
+	const auto type_len  = machine.cpu.reg(11);
+	const auto body_addr = machine.cpu.reg(12);
+	const auto body_len  = machine.cpu.reg(13);
+
+	if (type_len > 0 && type_len <= ForkCall::MAX_CONTENT_TYPE) {
+		fc.content_type.resize(type_len);
+		machine.copy_from_guest(fc.content_type.data(), type_addr, type_len);
+	}
+	if (body_len > config.max_memory)
+		throw std::runtime_error("Response body is larger than guest memory");
+	if (body_len > 0) {
+		const size_t pages = ((body_addr + body_len - 1) >> riscv::Page::SHIFT)
+			- (body_addr >> riscv::Page::SHIFT) + 1;
+		fc.buffers.resize(pages);
+		fc.cnt = machine.memory.gather_buffers_from_range(
+			fc.buffers.size(), fc.buffers.data(), body_addr, body_len);
+	}
+	fc.length = body_len;
+	fc.body_addr = body_addr;
+
+	/* The pages were just read in, and are copy-on-write until the
+	   fork writes to them, which makes them private pages instead */
+	fc.static_body = body_len > 0;
+	const auto last = (body_addr + body_len - 1) >> riscv::Page::SHIFT;
+	for (auto pageno = body_addr >> riscv::Page::SHIFT; fc.static_body && pageno <= last; pageno++)
+		fc.static_body = machine.memory.get_pageno(pageno).attr.is_cow;
+}
+
+Script::gaddr_t TenantInstance::lookup(const char* name) const {
+	SharedMachine program = this->get_current_instance();
+	if (LIKELY(program != nullptr))
+		return program->lookup(name);
+	return 0x0;
 }
@@ -1,31 +1,104 @@
 #pragma once
+#include "cpu_governor.hpp"
+#include "kv_store.hpp"
+#include "log_writer.hpp"
+#include "metrics.hpp"
+#include "response_cache.hpp"
 #include "script.hpp"
 #include "tenant.hpp"
 struct MachineInstance;
 
-struct TenantInstance
+struct TenantInstance : public std::enable_shared_from_this<TenantInstance>
 {
 	using SharedMachine = std::shared_ptr<MachineInstance>;
+	/* Instructions run by an asynchronous request before yielding */
+	static constexpr uint64_t ASYNC_SLICE = 250'000;
 
 	struct ForkCall {
-		Script script;
-		size_t cnt;
+		static constexpr size_t MAX_CONTENT_TYPE = 256;
 
-		ForkCall(const Script& script, TenantInstance* tenant, MachineInstance& inst);
+		/* Pooled sandbox, which is reset and reused afterwards */
+		std::unique_ptr<Script> script;
+		/* The response body, gathered from guest memory, with
+		   room for one buffer per page that the body spans */
+		std::vector<riscv::vBuffer> buffers;
+		size_t cnt = 0;
+		size_t length = 0;
+		std::string content_type;
+		/* Static bodies are in pages shared with the main VM, and can
+		   be served from the precompressed copies of the program */
+		Script::gaddr_t body_addr = 0x0;
+		bool static_body = false;
+		/* Asynchronous calls are suspended until finished */
+		Script::AsyncStatus status = Script::AsyncStatus::Finished;
+		uint64_t fork_ticks = 0;
+		uint64_t exec_ticks = 0;
+		/* Spent in on_body_chunk, before the entry function */
+		uint64_t body_instructions = 0;
+
+		ForkCall(std::unique_ptr<Script>);
+		~ForkCall();
+	};
+	using ForkCallPtr = std::unique_ptr<ForkCall>;
+	ForkCallPtr forkcall(Script::gaddr_t addr, const Script::Http& = {});
+	/* Fork and call the cached entry function of the current program */
+	ForkCallPtr forkcall(const Script::Http& = {});
+
+	/* Where a request goes in the current program. Programs that
+	   registered routes are dispatched by method and path, without
+	   forking when nothing matches, and the others always go to
+	   on_client_request. */
+	struct Dispatch {
+		SharedMachine program;
+		Script::gaddr_t addr = 0x0;
+		/* 0 when dispatched, otherwise 404 or 405 */
+		int status = 0;
+		/* ROUTE_* methods of the path, for a 405 */
+		unsigned allow = 0;
+		RouteParams params;
 	};
-	ForkCall forkcall(Script::gaddr_t addr, size_t cnt, riscv::vBuffer[]);
+	Dispatch dispatch(unsigned method, std::string_view path) const;
+	ForkCallPtr forkcall(const Dispatch&, const Script::Http&);
+	/* Start the dispatched function in a fork that the guest can suspend.
+	   While the status is Suspended, async_resume() must be called
+	   again later. Failures throw, like forkcall. */
+	ForkCallPtr async_forkcall(const Dispatch&, const Script::Http&);
+	void async_resume(ForkCall&);
 	Script* vmfork();
 	bool no_program_loaded() const noexcept { return this->machine == nullptr; }
+	SharedMachine current_program() const;
 
 	Script::gaddr_t lookup(const char* name) const;
 
+	/* Load and initialize the program again, then swap it in. The
+	   current program keeps serving if the new one fails. The old
+	   program is handed back, so that the caller decides where it
+	   is destroyed. */
+	bool reload(SharedMachine& replaced);
+
 	TenantInstance(const TenantConfig&);
 	~TenantInstance();
 
 	const TenantConfig config;
+	ResponseCache cache;
+	TenantMetrics metrics;
+	CpuGovernor governor;
+	/* Taken by const guest calls, which are not allowed anything else */
+	mutable LogLimiter log_limiter;
+	/* Shared by every request, and kept across program reloads */
+	mutable KVStore kv;
+	mutable Upstreams upstreams;
+	/* Asynchronous requests that are suspended right now */
+	std::atomic<uint32_t> suspended_requests {0};
 
 private:
 	inline SharedMachine get_current_instance() const;
+	ForkCallPtr forkcall(SharedMachine, Script::gaddr_t addr, const Script::Http&,
+		const RouteParams& = {});
+	void stream_body(ForkCall&);
+	void record(const ForkCall&, uint64_t instructions);
+	void gather(ForkCall&);
+	void async_done(ForkCall&);
 
 	/* Hot-swappable machine */
 	SharedMachine machine = nullptr;
@@ -0,0 +1,178 @@
+#include "tenant_manifest.hpp"
+#include "tenant_instance.hpp"
+#include "tenant_registry.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <stdexcept>
+#include <thread>
+#include <json/json.h>
+
+static TenantConfig default_config()
+{
+	TenantConfig config;
+	config.group = "Tenants";
+	config.max_instructions = 2'000'000ull;
+	config.max_memory = 64'000'000ull;
+	config.max_heap   = 8'000'000ull;
+	return config;
+}
+
+static std::runtime_error error(const std::string& where, const std::string& what)
+{
+	return std::runtime_error("Tenant manifest: " + where + ": " + what);
+}
+
+static uint64_t read_uint(const Json::Value& value, const std::string& where)
+{
+	if (!value.isUInt64())
+		throw error(where, "expected an unsigned integer");
+	return value.asUInt64();
+}
+static std::string read_string(const Json::Value& value, const std::string& where)
+{
+	if (!value.isString())
+		throw error(where, "expected a string");
+	return value.asString();
+}
+static std::vector<std::string> read_strings(const Json::Value& value, const std::string& where)
+{
+	if (!value.isArray())
+		throw error(where, "expected an array of strings");
+	std::vector<std::string> result;
+	for (const auto& element : value)
+		result.push_back(read_string(element, where));
+	return result;
+}
+
+/* Applies the fields of a JSON object to the config, and the keys */
+static void read_fields(const Json::Value& object, TenantConfig& config,
+	std::vector<std::string>* keys, const std::string& where)
+{
+	if (!object.isObject())
+		throw error(where, "expected an object");
+	for (const auto& field : object.getMemberNames()) {
+		const auto& value = object[field];
+		const std::string path = where + "." + field;
+		if (field == "name")
+			config.name = read_string(value, path);
+		else if (field == "group")
+			config.group = read_string(value, path);
+		else if (field == "filename")
+			config.filename = read_string(value, path);
+		else if (field == "max_instructions")
+			config.max_instructions = read_uint(value, path);
+		else if (field == "max_memory")
+			config.max_memory = read_uint(value, path);
+		else if (field == "max_heap")
+			config.max_heap = read_uint(value, path);
+		else if (field == "max_cache_bytes")
+			config.max_cache_bytes = read_uint(value, path);
+		else if (field == "async_requests") {
+			if (!value.isBool())
+				throw error(path, "expected true or false");
+			config.async_requests = value.asBool();
+		}
+		else if (field == "max_suspended_requests")
+			config.max_suspended_requests = read_uint(value, path);
+		else if (field == "max_instructions_per_sec")
+			config.max_instructions_per_sec = read_uint(value, path);
+		else if (field == "max_cpu_us_per_sec")
+			config.max_cpu_us_per_sec = read_uint(value, path);
+		else if (field == "max_log_lines_per_sec")
+			config.max_log_lines_per_sec = read_uint(value, path);
+		else if (field == "max_kv_bytes")
+			config.max_kv_bytes = read_uint(value, path);
+		else if (field == "upstreams")
+			config.upstreams = read_strings(value, path);
+		else if (field == "max_upstream_requests")
+			config.max_upstream_requests = read_uint(value, path);
+		else if (field == "keys" && keys != nullptr)
+			*keys = read_strings(value, path);
+		else
+			throw error(path, "unknown field");
+	}
+}
+
+TenantManifest TenantManifest::load(const std::string& filename)
+{
+	std::ifstream file(filename);
+	if (!file)
+		throw error(filename, "could not be opened");
+	Json::CharReaderBuilder builder;
+	Json::Value root;
+	std::string errors;
+	if (!Json::parseFromStream(builder, file, &root, &errors))
+		throw error(filename, errors);
+	if (!root.isObject() || !root["tenants"].isArray())
+		throw error(filename, "expected an object with a \"tenants\" array");
+
+	TenantConfig defaults = default_config();
+	if (root.isMember("defaults"))
+		read_fields(root["defaults"], defaults, nullptr, "defaults");
+
+	TenantManifest manifest;
+	/* Registry keys, normalized, and the tenant that has each */
+	std::map<std::string, Json::ArrayIndex> taken;
+	const auto& tenants = root["tenants"];
+	for (Json::ArrayIndex i = 0; i < tenants.size(); i++) {
+		const std::string where = "tenants[" + std::to_string(i) + "]";
+		Entry entry { {}, defaults };
+		read_fields(tenants[i], entry.config, &entry.keys, where);
+		if (entry.config.name.empty() || entry.config.filename.empty())
+			throw error(where, "name and filename are required");
+		if (entry.keys.empty())
+			entry.keys.push_back("/" + entry.config.name);
+		for (const auto& key : entry.keys) {
+			const auto [it, inserted] = taken.try_emplace(TenantRegistry::normalize(key), i);
+			if (!inserted)
+				throw error(where + ".keys", "\"" + key + "\" is already used by tenants["
+					+ std::to_string(it->second) + "]");
+		}
+		manifest.tenants.push_back(std::move(entry));
+	}
+	return manifest;
+}
+
+TenantManifest::Startup TenantManifest::create(unsigned threads) const
+{
+	using clock = std::chrono::steady_clock;
+	const auto start = clock::now();
+
+	Startup startup;
+	startup.tenants.resize(this->tenants.size());
+	if (threads == 0)
+		threads = std::max(1u, std::thread::hardware_concurrency());
+	threads = std::min<size_t>(threads, this->tenants.size());
+
+	/* Each thread takes the next tenant until there are none left */
+	std::atomic<size_t> next { 0 };
+	auto work = [&] {
+		for (size_t i = next++; i < this->tenants.size(); i = next++) {
+			auto& result = startup.tenants[i];
+			result.entry = &this->tenants[i];
+			const auto t0 = clock::now();
+			try {
+				result.instance = std::make_shared<TenantInstance>(this->tenants[i].config);
+				result.ok = !result.instance->no_program_loaded();
+			} catch (const std::exception& e) {
+				fprintf(stderr, "Exception when creating tenant '%s': %s\n",
+					this->tenants[i].config.name.c_str(), e.what());
+				result.ok = false;
+			}
+			result.seconds = std::chrono::duration<double>(clock::now() - t0).count();
+		}
+	};
+	std::vector<std::thread> pool;
+	for (unsigned t = 0; t < threads; t++)
+		pool.emplace_back(work);
+	for (auto& thread : pool)
+		thread.join();
+
+	for (const auto& tenant : startup.tenants)
+		startup.failed += !tenant.ok;
+	startup.seconds = std::chrono::duration<double>(clock::now() - start).count();
+	return startup;
+}
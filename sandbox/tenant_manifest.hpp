@@ -0,0 +1,54 @@
+#pragma once
+#include <memory>
+#include <string>
+#include <vector>
+#include "tenant.hpp"
+struct TenantInstance;
+
+/**
+ * Every tenant of a node, described by a JSON manifest:
+ *
+ *   {
+ *     "defaults": { "max_instructions": 2000000, "max_memory": 64000000 },
+ *     "tenants": [
+ *       { "name": "shop", "filename": "programs/shop",
+ *         "keys": ["shop.example.com"], "max_cache_bytes": 16000000 }
+ *     ]
+ *   }
+ *
+ * Each tenant takes the fields of TenantConfig, on top of the defaults,
+ * and the registry keys that route to it, which default to "/name".
+ * Unknown fields are errors, so that typos don't go unnoticed, and so
+ * are keys that are the same to the registry as a key listed before.
+ *
+ * Loading and initializing programs is independent between tenants,
+ * so they are created in parallel, on one thread per core.
+**/
+struct TenantManifest
+{
+	struct Entry {
+		/* See TenantRegistry for the forms of keys */
+		std::vector<std::string> keys;
+		TenantConfig config;
+	};
+	std::vector<Entry> tenants;
+
+	/* Throws std::runtime_error describing the first problem */
+	static TenantManifest load(const std::string& filename);
+
+	struct Startup {
+		struct Tenant {
+			const Entry* entry;
+			/* Without a program when it failed to load */
+			std::shared_ptr<TenantInstance> instance;
+			double seconds;
+			bool ok;
+		};
+		/* In the order of the manifest */
+		std::vector<Tenant> tenants;
+		double seconds = 0.0;
+		size_t failed = 0;
+	};
+	/* Zero threads is one per core */
+	Startup create(unsigned threads = 0) const;
+};
@@ -0,0 +1,175 @@
+#include "tenant_registry.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include "tenant_instance.hpp"
+
+struct TenantRegistry::Table
+{
+	struct Entry {
+		size_t hash = 0;
+		std::string_view key;
+		TenantInstance* tenant = nullptr;
+	};
+
+	Table(std::map<std::string, SharedTenant> tenants)
+		: source{std::move(tenants)}
+	{
+		size_t capacity = 16;
+		while (capacity < source.size() * 2)
+			capacity <<= 1;
+		slots.resize(capacity);
+		mask = capacity - 1;
+
+		for (const auto& it : source) {
+			const std::string_view key = it.first;
+			const size_t hash = hash_key(key);
+			size_t idx = hash & mask;
+			while (slots[idx].tenant != nullptr)
+				idx = (idx + 1) & mask;
+			slots[idx] = {hash, key, it.second.get()};
+
+			if (key.empty())
+				default_tenant = it.second.get();
+			else if (key[0] == '/')
+				any_host_prefixes = true;
+			else if (key.find('/') != std::string_view::npos)
+				host_prefixes = true;
+		}
+	}
+
+	static size_t hash_key(std::string_view key) noexcept {
+		return std::hash<std::string_view>{}(key);
+	}
+
+	TenantInstance* find(std::string_view key) const noexcept {
+		const size_t hash = hash_key(key);
+		for (size_t idx = hash & mask;; idx = (idx + 1) & mask) {
+			const auto& entry = slots[idx];
+			if (entry.tenant == nullptr)
+				return nullptr;
+			if (entry.hash == hash && entry.key == key)
+				return entry.tenant;
+		}
+	}
+
+	/* The table owns the tenants, and the entries point into it */
+	const std::map<std::string, SharedTenant> source;
+	std::vector<Entry> slots;
+	size_t mask = 0;
+	TenantInstance* default_tenant = nullptr;
+	bool host_prefixes = false;
+	bool any_host_prefixes = false;
+};
+
+TenantRegistry::TenantRegistry()
+	: m_table(rcu::domain(), new Table({}))
+{
+}
+TenantRegistry::~TenantRegistry()
+{
+	rcu::domain().synchronize();
+}
+
+TenantInstance* TenantRegistry::find(std::string_view host, std::string_view path) const noexcept
+{
+	const Table* table = m_table.load();
+
+	/* Lower-case host without port, followed by the first path segment */
+	static constexpr size_t MAX_KEY = 256;
+	char key[MAX_KEY];
+	size_t hostlen = 0;
+	for (const char c : host) {
+		if (c == ':' || hostlen == MAX_KEY) break;
+		key[hostlen++] = (c >= 'A' && c <= 'Z') ? c + 32 : c;
+	}
+	std::string_view segment;
+	if (table->host_prefixes || table->any_host_prefixes) {
+		const size_t end = path.find_first_of("/?", 1);
+		segment = path.substr(0, end);
+	}
+
+	if (table->host_prefixes && hostlen > 0
+		&& hostlen + segment.size() <= MAX_KEY && segment.size() > 1)
+	{
+		std::memcpy(&key[hostlen], segment.data(), segment.size());
+		auto* tenant = table->find({key, hostlen + segment.size()});
+		if (tenant != nullptr) return tenant;
+	}
+	if (hostlen > 0) {
+		auto* tenant = table->find({key, hostlen});
+		if (tenant != nullptr) return tenant;
+	}
+	if (table->any_host_prefixes && segment.size() > 1) {
+		auto* tenant = table->find(segment);
+		if (tenant != nullptr) return tenant;
+	}
+	return table->default_tenant;
+}
+
+/* Keys are stored the way find() builds them: the host part lower-case
+   and without port, and the path prefix as given */
+std::string TenantRegistry::normalize(std::string_view key)
+{
+	const size_t slash = std::min(key.find('/'), key.size());
+	std::string_view host = key.substr(0, slash);
+	host = host.substr(0, host.find(':'));
+	std::string result;
+	result.reserve(key.size());
+	for (const char c : host)
+		result += (c >= 'A' && c <= 'Z') ? c + 32 : c;
+	result += key.substr(slash);
+	return result;
+}
+
+void TenantRegistry::publish(std::map<std::string, SharedTenant> tenants)
+{
+	/* Building the table can take a while with many tenants,
+	   but readers keep using the old one in the meantime. */
+	m_table.update(new Table(std::move(tenants)));
+}
+
+void TenantRegistry::insert(const std::string& key, SharedTenant tenant)
+{
+	std::lock_guard<std::mutex> lock(m_write_mtx);
+	auto tenants = m_table.load()->source;
+	tenants.insert_or_assign(normalize(key), std::move(tenant));
+	this->publish(std::move(tenants));
+}
+void TenantRegistry::insert(const std::vector<std::pair<std::string, SharedTenant>>& list)
+{
+	std::lock_guard<std::mutex> lock(m_write_mtx);
+	auto tenants = m_table.load()->source;
+	for (const auto& it : list)
+		tenants.insert_or_assign(normalize(it.first), it.second);
+	this->publish(std::move(tenants));
+}
+bool TenantRegistry::erase(const std::string& key)
+{
+	std::lock_guard<std::mutex> lock(m_write_mtx);
+	auto tenants = m_table.load()->source;
+	if (tenants.erase(normalize(key)) == 0)
+		return false;
+	this->publish(std::move(tenants));
+	return true;
+}
+
+TenantRegistry::SharedTenant TenantRegistry::get(const std::string& key) const
+{
+	auto guard = this->read();
+	const auto& source = m_table.load()->source;
+	auto it = source.find(normalize(key));
+	if (it != source.end())
+		return it->second;
+	return nullptr;
+}
+std::map<std::string, TenantRegistry::SharedTenant> TenantRegistry::snapshot() const
+{
+	auto guard = this->read();
+	return m_table.load()->source;
+}
+size_t TenantRegistry::size() const
+{
+	auto guard = this->read();
+	return m_table.load()->source.size();
+}
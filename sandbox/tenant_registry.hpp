@@ -0,0 +1,57 @@
+#pragma once
+#include "rcu.hpp"
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+struct TenantInstance;
+
+/**
+ * Routes requests to tenants by Host header and/or first path segment.
+ *
+ * Keys are one of:
+ *   "example.com"       all requests for a host
+ *   "example.com/shop"  requests for a host where the path starts with /shop
+ *   "/shop"             requests for any host where the path starts with /shop
+ *   ""                  the default tenant
+ * The most specific match wins, in the order host/prefix, host, /prefix, default.
+ * Host names are matched case-insensitively and without port, and keys
+ * are stored the same way, so "Shop.example.com:8080" is "shop.example.com".
+ *
+ * The lookup table is immutable and published through RCU, so lookups
+ * never take a lock. Inserting and erasing tenants builds a new table
+ * on the calling thread, and old tenants are destroyed once no reader
+ * can see them anymore.
+**/
+class TenantRegistry
+{
+public:
+	using SharedTenant = std::shared_ptr<TenantInstance>;
+
+	/* The returned tenant is only valid while the guard is held */
+	auto read() const { return rcu::domain().read(); }
+	TenantInstance* find(std::string_view host, std::string_view path) const noexcept;
+
+	void insert(const std::string& key, SharedTenant tenant);
+	void insert(const std::vector<std::pair<std::string, SharedTenant>>& tenants);
+	bool erase(const std::string& key);
+
+	/* The form a key is stored in, where keys that are the same
+	   to the registry are equal */
+	static std::string normalize(std::string_view key);
+
+	/* Safe outside of a read guard */
+	SharedTenant get(const std::string& key) const;
+	std::map<std::string, SharedTenant> snapshot() const;
+	size_t size() const;
+
+	TenantRegistry();
+	~TenantRegistry();
+
+private:
+	struct Table;
+	void publish(std::map<std::string, SharedTenant>);
+
+	mutable std::mutex m_write_mtx;
+	rcu::Pointer<Table> m_table;
+};
@@ -0,0 +1,190 @@
+#include "translation_cache.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <filesystem>
+#include <vector>
+#include <sys/stat.h>
+#include "binary_table.hpp"
+#include "crc32.hpp"
+namespace fs = std::filesystem;
+
+/* Bump when the layout of cached files changes */
+static constexpr uint32_t CACHE_VERSION = 2;
+
+static std::mutex cache_mtx;
+static TranslationCache::Config cache_config;
+static std::string fingerprint;
+static std::atomic<bool>     cache_enabled { false };
+static std::atomic<uint64_t> cache_hits { 0 };
+static std::atomic<uint64_t> cache_misses { 0 };
+static std::atomic<uint64_t> cache_evictions { 0 };
+
+/* Identifies this build of the server. Translations are native code
+   built against the libriscv we are linked with, so a different
+   executable must never load them. */
+static std::string build_fingerprint()
+{
+	char buffer[256];
+	struct stat st {};
+	stat("/proc/self/exe", &st);
+	const int len = snprintf(buffer, sizeof(buffer), "%u %s %ld %ld.%ld",
+		CACHE_VERSION, __VERSION__, (long)st.st_size,
+		(long)st.st_mtim.tv_sec, (long)st.st_mtim.tv_nsec);
+	snprintf(buffer, sizeof(buffer), "%08X", crc32(buffer, len));
+	return buffer;
+}
+
+/* <fingerprint>-<sha256>-<options>- followed by the checksum of the
+   execute segment that libriscv appends, and .so */
+static bool is_translation(const std::string& name)
+{
+	if (name.size() < 12 || name[8] != '-')
+		return false;
+	if (name.compare(name.size() - 3, 3, ".so") != 0)
+		return false;
+	return std::all_of(name.begin(), name.begin() + 8, [] (char c) {
+		return isxdigit((unsigned char)c);
+	});
+}
+
+std::string TranslationCache::key(const ElfBinary& elf)
+{
+	return fingerprint + "-" + elf.key + "-";
+}
+
+void TranslationCache::configure(const Config& config)
+{
+	std::unique_lock<std::mutex> lock(cache_mtx);
+	cache_config = config;
+	cache_enabled = false;
+	if (config.directory.empty())
+		return;
+	if (fingerprint.empty())
+		fingerprint = build_fingerprint();
+
+	std::error_code ec;
+	fs::create_directories(config.directory, ec);
+	if (!fs::is_directory(config.directory, ec)) {
+		fprintf(stderr, "Translation cache disabled, could not create '%s'\n",
+			config.directory.c_str());
+		return;
+	}
+	/* Remove what other builds of the server left behind */
+	for (const auto& entry : fs::directory_iterator(config.directory, ec)) {
+		const auto name = entry.path().filename().string();
+		if (is_translation(name) && name.compare(0, 8, fingerprint) != 0)
+			fs::remove(entry.path(), ec);
+	}
+	trim(lock, config.max_bytes);
+	cache_enabled = true;
+}
+
+bool TranslationCache::enabled()
+{
+	return cache_enabled.load(std::memory_order_relaxed);
+}
+
+std::string TranslationCache::prepare(const ElfBinary& elf, const Options& options)
+{
+	if (!enabled())
+		return "";
+	char suffix[64];
+	snprintf(suffix, sizeof(suffix), "m%llxa%d-",
+		(unsigned long long)options.memory_max, options.use_memory_arena ? 1 : 0);
+	const std::string key = TranslationCache::key(elf) + suffix;
+
+	std::unique_lock<std::mutex> lock(cache_mtx);
+	std::error_code ec;
+	bool found = false;
+	for (const auto& entry : fs::directory_iterator(cache_config.directory, ec)) {
+		const auto name = entry.path().filename().string();
+		if (name.compare(0, key.size(), key) == 0) {
+			/* The modification time is what eviction goes by */
+			fs::last_write_time(entry.path(), fs::file_time_type::clock::now(), ec);
+			found = true;
+		}
+	}
+	if (found) {
+		cache_hits++;
+	} else {
+		cache_misses++;
+		trim(lock, cache_config.max_bytes);
+	}
+	return (fs::path(cache_config.directory) / key).string();
+}
+
+void TranslationCache::invalidate(const ElfBinary& elf)
+{
+	if (!enabled())
+		return;
+	const std::string key = TranslationCache::key(elf);
+
+	std::lock_guard<std::mutex> lock(cache_mtx);
+	std::error_code ec;
+	std::vector<fs::path> matches;
+	for (const auto& entry : fs::directory_iterator(cache_config.directory, ec)) {
+		if (entry.path().filename().string().compare(0, key.size(), key) == 0)
+			matches.push_back(entry.path());
+	}
+	for (const auto& path : matches)
+		fs::remove(path, ec);
+}
+
+/* Evicts the least recently used translations until the directory is
+   below max_bytes. Programs that already loaded a translation keep
+   their mapping of it. */
+void TranslationCache::trim(std::unique_lock<std::mutex>&, uint64_t max_bytes)
+{
+	struct File {
+		fs::path path;
+		fs::file_time_type mtime;
+		uint64_t size;
+	};
+	std::vector<File> files;
+	uint64_t total = 0;
+	std::error_code ec;
+	for (const auto& entry : fs::directory_iterator(cache_config.directory, ec)) {
+		if (!is_translation(entry.path().filename().string()))
+			continue;
+		const uint64_t size = entry.file_size(ec);
+		if (ec) continue;
+		files.push_back({entry.path(), entry.last_write_time(ec), size});
+		total += size;
+	}
+	if (total <= max_bytes)
+		return;
+
+	std::sort(files.begin(), files.end(),
+		[] (const File& a, const File& b) { return a.mtime < b.mtime; });
+	for (const auto& file : files) {
+		if (total <= max_bytes)
+			break;
+		if (fs::remove(file.path, ec)) {
+			total -= file.size;
+			cache_evictions++;
+		}
+	}
+}
+
+TranslationCache::Stats TranslationCache::stats()
+{
+	Stats stats {
+		cache_hits.load(), cache_misses.load(), cache_evictions.load(), 0, 0
+	};
+	if (!enabled())
+		return stats;
+
+	std::lock_guard<std::mutex> lock(cache_mtx);
+	std::error_code ec;
+	for (const auto& entry : fs::directory_iterator(cache_config.directory, ec)) {
+		if (!is_translation(entry.path().filename().string()))
+			continue;
+		const uint64_t size = entry.file_size(ec);
+		if (ec) continue;
+		stats.files++;
+		stats.bytes += size;
+	}
+	return stats;
+}
@@ -0,0 +1,62 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+struct ElfBinary;
+
+/**
+ * Persistent cache of binary translations, shared by every tenant.
+ *
+ * The native code that libriscv generates for a program is kept in a
+ * directory, under the content key (SHA-256) of the ELF, the machine
+ * options that the code depends on and a fingerprint of the running
+ * server binary. A tenant that starts (or
+ * reloads) a program that was translated before loads the cached code
+ * instead of translating it again.
+ *
+ * Translations made by a different build of the server are deleted
+ * when the cache is configured, as their code may not match this
+ * build of libriscv. Otherwise the least recently used translations
+ * are evicted once the directory grows beyond its size cap.
+**/
+class TranslationCache
+{
+public:
+	struct Config {
+		/* An empty directory disables the cache */
+		std::string directory;
+		uint64_t max_bytes = 256'000'000ull;
+	};
+	/* The machine options that vary between tenants and change the
+	   generated code. Options that every tenant gets the same are
+	   covered by the fingerprint of the server binary. */
+	struct Options {
+		uint64_t memory_max;
+		bool     use_memory_arena;
+	};
+	struct Stats {
+		uint64_t hits;      /* Programs with a cached translation */
+		uint64_t misses;    /* Programs that had to be translated */
+		uint64_t evictions; /* Translations deleted to stay below the cap */
+		uint64_t files;
+		uint64_t bytes;
+	};
+
+	/* Creates the directory and removes stale translations */
+	static void configure(const Config&);
+	static bool enabled();
+	static Stats stats();
+
+	/* The file prefix translations of this ELF with these options are
+	   stored under, or an empty string when the cache is disabled.
+	   Existing translations are marked as recently used, and room is
+	   made for a new one if not. */
+	static std::string prepare(const ElfBinary&, const Options&);
+	/* Deletes every translation of this ELF, with any options */
+	static void invalidate(const ElfBinary&);
+
+private:
+	static std::string key(const ElfBinary&);
+	static void trim(std::unique_lock<std::mutex>&, uint64_t max_bytes);
+};
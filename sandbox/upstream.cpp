@@ -0,0 +1,269 @@
+#include "upstream.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <unordered_map>
+#include <drogon/HttpClient.h>
+#include <trantor/EventLoop.h>
+using namespace drogon;
+
+/* Identified by a number that is never reused, like CpuGovernor,
+   so that stale thread-local state can never be found again. Threads
+   tell that a tenant is gone by their weak reference to its Shared. */
+static std::atomic<uint64_t> upstreams_counter { 1 };
+static std::vector<uint16_t> refused_ports;
+
+struct Upstreams::Shared
+{
+	std::atomic<uint64_t> inflight { 0 };
+	std::atomic<uint64_t> requests { 0 };
+	std::atomic<uint64_t> coalesced { 0 };
+	std::atomic<uint64_t> rejected { 0 };
+	std::atomic<uint64_t> failed { 0 };
+};
+
+/* The clients and in-flight GETs of one tenant on one IO thread */
+struct Local
+{
+	std::weak_ptr<Upstreams::Shared> owner;
+	std::unordered_map<std::string, std::vector<HttpClientPtr>> clients;
+	std::unordered_map<std::string, std::vector<std::shared_ptr<Fetch>>> pending;
+};
+static thread_local std::unordered_map<uint64_t, Local> locals;
+static thread_local size_t sweep_at = 64;
+
+static Local& local(uint64_t id, const std::shared_ptr<Upstreams::Shared>& shared)
+{
+	auto it = locals.find(id);
+	if (it != locals.end())
+		return it->second;
+	/* The clients of destroyed tenants are closed on their own thread,
+	   whenever the map has doubled */
+	if (locals.size() >= sweep_at) {
+		for (auto entry = locals.begin(); entry != locals.end(); ) {
+			if (entry->second.owner.expired()) entry = locals.erase(entry);
+			else ++entry;
+		}
+		sweep_at = std::max<size_t>(64, 2 * locals.size());
+	}
+	auto& state = locals[id];
+	state.owner = shared;
+	return state;
+}
+
+void Fetch::complete(std::shared_ptr<const FetchResult> res)
+{
+	this->done = true;
+	this->result = std::move(res);
+	auto callback = std::move(this->on_done);
+	this->on_done = nullptr;
+	if (callback)
+		callback();
+}
+
+Upstreams::Upstreams(const Config& config)
+	: m_id{upstreams_counter.fetch_add(1, std::memory_order_relaxed)},
+	  m_config{config}, m_shared{std::make_shared<Shared>()}
+{
+}
+Upstreams::~Upstreams()
+{
+}
+
+static bool parse_method(const std::string& name, HttpMethod& method)
+{
+	static const std::pair<const char*, HttpMethod> methods[] = {
+		{"GET", Get}, {"POST", Post}, {"PUT", Put}, {"DELETE", Delete},
+		{"PATCH", Patch}, {"HEAD", Head}, {"OPTIONS", Options},
+	};
+	for (const auto& [str, m] : methods) {
+		if (name == str) {
+			method = m;
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Splits "http://host:port/path?query" into origin and path */
+static bool split_url(std::string_view url, std::string_view& origin, std::string& path)
+{
+	const size_t scheme = url.find("://");
+	if (scheme == std::string_view::npos)
+		return false;
+	const size_t end = url.find_first_of("/?", scheme + 3);
+	origin = url.substr(0, end);
+	path = (end == std::string_view::npos) ? "/" : std::string(url.substr(end));
+	if (path[0] == '?')
+		path.insert(path.begin(), '/');
+	return true;
+}
+
+void Upstreams::refuse_ports(std::vector<uint16_t> ports)
+{
+	refused_ports = std::move(ports);
+}
+
+/* The port of "scheme://host[:port]", or -1 for anything unusual,
+   like user info, which is never needed for an allowed origin */
+static int origin_port(std::string_view origin)
+{
+	const size_t scheme = origin.find("://");
+	const auto authority = origin.substr(scheme + 3);
+	if (authority.find('@') != std::string_view::npos)
+		return -1;
+	const size_t colon = authority.rfind(':');
+	if (colon == std::string_view::npos || authority.find(']', colon) != std::string_view::npos)
+		return (origin.substr(0, scheme) == "https") ? 443 : 80;
+	int port = 0;
+	const auto digits = authority.substr(colon + 1);
+	const auto [end, ec] = std::from_chars(digits.data(), digits.data() + digits.size(), port);
+	if (ec != std::errc() || end != digits.data() + digits.size() || port <= 0 || port > 65535)
+		return -1;
+	return port;
+}
+
+static bool refused(std::string_view origin)
+{
+	const int port = origin_port(origin);
+	return port < 0 || std::find(refused_ports.begin(), refused_ports.end(), port) != refused_ports.end();
+}
+
+static std::string_view trim(std::string_view s)
+{
+	while (!s.empty() && std::isspace((unsigned char) s.front())) s.remove_prefix(1);
+	while (!s.empty() && std::isspace((unsigned char) s.back())) s.remove_suffix(1);
+	return s;
+}
+
+/* Adds "name: value" lines, except for those the client manages */
+static bool add_headers(HttpRequest& req, std::string_view lines)
+{
+	while (!lines.empty()) {
+		const size_t nl = lines.find('\n');
+		const auto line = trim(lines.substr(0, nl));
+		lines = (nl == std::string_view::npos) ? std::string_view{} : lines.substr(nl + 1);
+		if (line.empty())
+			continue;
+		const size_t colon = line.find(':');
+		if (colon == std::string_view::npos || colon == 0)
+			return false;
+		std::string name {trim(line.substr(0, colon))};
+		std::transform(name.begin(), name.end(), name.begin(),
+			[] (unsigned char c) { return std::tolower(c); });
+		if (name == "host" || name == "content-length" || name == "connection"
+			|| name == "transfer-encoding")
+			continue;
+		req.addHeader(name, std::string(trim(line.substr(colon + 1))));
+	}
+	return true;
+}
+
+std::shared_ptr<Fetch> Upstreams::fetch(const Request& request)
+{
+	auto* loop = trantor::EventLoop::getEventLoopOfCurrentThread();
+	HttpMethod method;
+	std::string_view origin;
+	std::string path;
+	if (loop == nullptr || !parse_method(request.method, method)
+		|| !split_url(request.url, origin, path)
+		|| std::find(m_config.origins.begin(), m_config.origins.end(), origin) == m_config.origins.end()
+		|| refused(origin))
+	{
+		m_shared->rejected.fetch_add(1, std::memory_order_relaxed);
+		return nullptr;
+	}
+
+	auto fetch = std::make_shared<Fetch>();
+	auto& state = local(m_id, m_shared);
+	std::string key;
+	if (method == Get && request.body.empty()) {
+		key = request.url + '\n' + request.headers;
+		auto it = state.pending.find(key);
+		if (it != state.pending.end()) {
+			it->second.push_back(fetch);
+			m_shared->coalesced.fetch_add(1, std::memory_order_relaxed);
+			return fetch;
+		}
+	}
+
+	auto req = HttpRequest::newHttpRequest();
+	req->setMethod(method);
+	/* The path comes with its query, already encoded by the guest */
+	req->setPathEncode(false);
+	req->setPath(path);
+	if (!add_headers(*req, request.headers)) {
+		m_shared->rejected.fetch_add(1, std::memory_order_relaxed);
+		return nullptr;
+	}
+	if (!request.body.empty())
+		req->setBody(request.body);
+
+	/* Reserve a slot of the tenant-wide limit */
+	const uint64_t inflight = m_shared->inflight.fetch_add(1, std::memory_order_relaxed);
+	if (m_config.max_concurrent != 0 && inflight >= m_config.max_concurrent) {
+		m_shared->inflight.fetch_sub(1, std::memory_order_relaxed);
+		m_shared->rejected.fetch_add(1, std::memory_order_relaxed);
+		return nullptr;
+	}
+	m_shared->requests.fetch_add(1, std::memory_order_relaxed);
+
+	/* The least busy keep-alive client, or a new one while there is room */
+	auto& clients = state.clients[std::string(origin)];
+	HttpClientPtr client = nullptr;
+	size_t queued = SIZE_MAX;
+	for (const auto& c : clients) {
+		if (c->requestsBufferSize() < queued) {
+			client = c;
+			queued = c->requestsBufferSize();
+		}
+	}
+	if (client == nullptr || (queued > 0 && clients.size() < CLIENTS_PER_ORIGIN)) {
+		client = HttpClient::newHttpClient(std::string(origin), loop);
+		clients.push_back(client);
+	}
+
+	if (!key.empty())
+		state.pending[key].push_back(fetch);
+	client->sendRequest(req,
+		[shared = m_shared, id = m_id, key, fetch] (ReqResult result, const HttpResponsePtr& resp)
+		{
+			shared->inflight.fetch_sub(1, std::memory_order_relaxed);
+			auto res = std::make_shared<FetchResult>();
+			if (result == ReqResult::Ok && resp != nullptr && resp->body().size() <= MAX_BODY) {
+				res->status = resp->statusCode();
+				res->body = std::string(resp->body());
+				for (const auto& it : resp->headers())
+					res->headers.emplace_back(it.first, it.second);
+			} else {
+				shared->failed.fetch_add(1, std::memory_order_relaxed);
+			}
+			if (key.empty()) {
+				fetch->complete(std::move(res));
+				return;
+			}
+			/* Everyone that coalesced onto this request. The callback
+			   holds on to Shared, so the state has not been swept. */
+			auto& pending = locals.at(id).pending;
+			auto it = pending.find(key);
+			if (it == pending.end())
+				return;
+			auto waiters = std::move(it->second);
+			pending.erase(it);
+			for (auto& waiter : waiters)
+				waiter->complete(res);
+		}, m_config.timeout);
+	return fetch;
+}
+
+Upstreams::Stats Upstreams::stats() const noexcept
+{
+	return {
+		.requests  = m_shared->requests.load(std::memory_order_relaxed),
+		.coalesced = m_shared->coalesced.load(std::memory_order_relaxed),
+		.rejected  = m_shared->rejected.load(std::memory_order_relaxed),
+		.failed    = m_shared->failed.load(std::memory_order_relaxed),
+		.inflight  = m_shared->inflight.load(std::memory_order_relaxed),
+	};
+}
@@ -0,0 +1,98 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+/* The response to an outbound request, shared by coalesced requests */
+struct FetchResult
+{
+	/* The HTTP status, or -1 when the request failed */
+	int status = -1;
+	std::string body;
+	/* Names are lower-case */
+	std::vector<std::pair<std::string, std::string>> headers;
+};
+
+/* One outbound request of a fork, completed on its event loop */
+struct Fetch
+{
+	bool done = false;
+	std::shared_ptr<const FetchResult> result;
+	/* Called once when done, typically to resume the fork */
+	std::function<void()> on_done;
+
+	void complete(std::shared_ptr<const FetchResult>);
+};
+
+/**
+ * Outbound HTTP requests of one tenant, to the origins it is allowed
+ * to reach.
+ *
+ * Requests are sent with drogon's HttpClient on the event loop of the
+ * calling IO thread, and complete there, so that a suspended fork is
+ * resumed on the thread it belongs to. Each thread keeps a small pool
+ * of keep-alive clients per origin, and picks the least busy one.
+ * Identical GETs that are in flight on the same thread are coalesced
+ * onto one upstream request. The number of upstream requests in flight
+ * is limited per tenant, across every thread.
+ *
+ * Responses larger than MAX_BODY fail, but HttpClient has no limit of
+ * its own, so they are only rejected after the whole body has been
+ * received into memory. Origins have to be trusted not to send huge
+ * responses, as they are chosen by the operator.
+**/
+class Upstreams
+{
+public:
+	static constexpr size_t CLIENTS_PER_ORIGIN = 4;
+	/* Checked once the body has been received, see above */
+	static constexpr size_t MAX_BODY = 16ul << 20;
+
+	struct Config {
+		/* Allowed origins, like "http://127.0.0.1:8082" */
+		std::vector<std::string> origins;
+		/* Upstream requests in flight across all threads, 0 is unlimited */
+		size_t max_concurrent = 0;
+		double timeout = 10.0;
+	};
+	struct Request {
+		/* GET, POST, ... */
+		std::string method;
+		std::string url;
+		/* "name: value" lines */
+		std::string headers;
+		std::string body;
+	};
+	struct Stats {
+		uint64_t requests;
+		uint64_t coalesced;
+		uint64_t rejected; /* Not allowed, or over the limit */
+		uint64_t failed;
+		uint64_t inflight;
+	};
+
+	/* Starts the request on the event loop of this thread. Returns
+	   nullptr if the origin is not allowed, the request is invalid,
+	   or too many requests are in flight. */
+	std::shared_ptr<Fetch> fetch(const Request&);
+	/* Origins on these ports are refused for every tenant, whatever
+	   the host, like the ports the server itself listens on. Set once
+	   before any request is served. */
+	static void refuse_ports(std::vector<uint16_t>);
+	bool enabled() const noexcept { return !m_config.origins.empty(); }
+	Stats stats() const noexcept;
+
+	Upstreams(const Config&);
+	~Upstreams();
+
+	struct Shared;
+private:
+	const uint64_t m_id;
+	const Config m_config;
+	std::shared_ptr<Shared> m_shared;
+};
@@ -0,0 +1,59 @@
+#include "working_set.hpp"
+
+#include <algorithm>
+
+void WorkingSet::learn(const machine_t& main,
+	const std::vector<gaddr_t>& reads, const std::vector<gaddr_t>& writes)
+{
+	std::lock_guard<std::mutex> lock(m_mtx);
+	if (this->ready())
+		return;
+	/* A page can be read and then written in the same request */
+	std::vector<gaddr_t> pages;
+	pages.reserve(reads.size() + writes.size());
+	pages.insert(pages.end(), reads.begin(), reads.end());
+	pages.insert(pages.end(), writes.begin(), writes.end());
+	std::sort(pages.begin(), pages.end());
+	pages.erase(std::unique(pages.begin(), pages.end()), pages.end());
+
+	for (const auto pageno : pages)
+		m_counts[pageno]++;
+	if (++m_requests >= LEARN_REQUESTS)
+		this->build(main);
+}
+
+void WorkingSet::build(const machine_t& main)
+{
+	std::vector<std::pair<uint32_t, gaddr_t>> hot;
+	for (const auto& it : m_counts) {
+		if (it.second * 2 >= m_requests)
+			hot.emplace_back(it.second, it.first);
+	}
+	/* The most used pages, when there are too many */
+	if (hot.size() > MAX_PAGES) {
+		std::partial_sort(hot.begin(), hot.begin() + MAX_PAGES, hot.end(),
+			[] (const auto& a, const auto& b) { return a.first > b.first; });
+		hot.resize(MAX_PAGES);
+	}
+
+	const auto& pages = main.memory.pages();
+	for (const auto& [count, pageno] : hot) {
+		auto it = pages.find(pageno);
+		if (it == pages.end()) {
+			m_fresh.push_back(pageno);
+			continue;
+		}
+		/* Installed the same way as by the read fault handler. The main
+		   VM doesn't change after initialization, so the data stays. */
+		riscv::PageAttributes attr = it->second.attr;
+		attr.non_owning = true;
+		attr.is_cow = true;
+		m_shared.push_back({pageno, attr, it->second.page()});
+	}
+	std::sort(m_shared.begin(), m_shared.end(),
+		[] (const auto& a, const auto& b) { return a.pageno < b.pageno; });
+	std::sort(m_fresh.begin(), m_fresh.end());
+
+	m_counts.clear();
+	m_ready.store(true, std::memory_order_release);
+}
@@ -0,0 +1,60 @@
+#pragma once
+#include <libriscv/machine.hpp>
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * The pages that requests to a program usually touch.
+ *
+ * Forks record the pages they fault in during the first requests to
+ * a program. Pages touched by at least half of those requests become
+ * the working set, which later forks install in one pass when they
+ * are created or reset, instead of faulting them in one at a time:
+ * pages of the main VM from a prebuilt template of read-only copy-on-
+ * write pages, and pages the main VM doesn't have as zeroed pages
+ * from the page pool.
+ *
+ * Each program learns its own working set, so a hot reload starts
+ * learning again.
+**/
+class WorkingSet
+{
+public:
+	static constexpr int MARCH = riscv::RISCV64;
+	using gaddr_t = riscv::address_type<MARCH>;
+	using machine_t = riscv::Machine<MARCH>;
+
+	/* Requests that are recorded before the set is built */
+	static constexpr size_t LEARN_REQUESTS = 32;
+	static constexpr size_t MAX_PAGES = 1024;
+
+	struct TemplatePage {
+		gaddr_t pageno;
+		riscv::PageAttributes attr;
+		riscv::PageData* data;
+	};
+
+	bool ready() const noexcept { return m_ready.load(std::memory_order_acquire); }
+	/* Pages of the main VM, installed as they are */
+	const std::vector<TemplatePage>& shared_pages() const noexcept { return m_shared; }
+	/* Pages that only forks have, installed zeroed */
+	const std::vector<gaddr_t>& fresh_pages() const noexcept { return m_fresh; }
+
+	/* Records the pages one request read from the main VM, and the
+	   pages it created for writing. Thread-safe. */
+	void learn(const machine_t& main, const std::vector<gaddr_t>& reads,
+		const std::vector<gaddr_t>& writes);
+
+private:
+	void build(const machine_t& main);
+
+	std::mutex m_mtx;
+	size_t m_requests = 0;
+	std::unordered_map<gaddr_t, uint32_t> m_counts;
+
+	std::atomic<bool> m_ready { false };
+	std::vector<TemplatePage> m_shared;
+	std::vector<gaddr_t> m_fresh;
+};
@@ -1,35 +1,255 @@
 #include <drogon/drogon.h>
 #include <sandbox.hpp>
+#include <charconv>
+#include "request.hpp"
 using namespace drogon;
 
-static TenantInstance* guest = nullptr;
-static uint64_t addr = 0x0;
+static TenantRegistry registry;
+static ProgramWatcher* watcher = nullptr;
+
+/* Empty parameters are left alone, returns false if not a number */
+static bool parse_parameter(const std::string& value, uint64_t& result)
+{
+    if (value.empty())
+        return true;
+    const auto [end, ec] = std::from_chars(value.data(), value.data() + value.size(), result);
+    return ec == std::errc() && end == value.data() + value.size();
+}
+
+/* The public listener serves tenants. Administration and the stand-in
+   upstream have their own listeners on loopback, which tenants may not
+   fetch from, see Upstreams::refuse_ports. */
+static constexpr uint16_t PUBLIC_PORT   = 8080;
+static constexpr uint16_t ADMIN_PORT    = 8081;
+static constexpr uint16_t UPSTREAM_PORT = 8082;
+
+/* Requests to the admin listener */
+static HttpResponsePtr admin_request(const HttpRequestPtr& req)
+{
+    const auto &path = req->path();
+    auto response = HttpResponse::newHttpResponse();
+    if (path == "/_pagepool")
+    {
+        /* Page pool counters for each IO thread */
+        std::string body;
+        size_t thread = 0;
+        for (const auto& stats : PagePool::all_stats()) {
+            const uint64_t total = stats.hits + stats.misses;
+            char line[256];
+            snprintf(line, sizeof(line),
+                "thread %zu: hits=%lu misses=%lu hit_rate=%.3f overflow=%lu resident=%lu free=%lu in_use=%lu\n",
+                thread++, stats.hits, stats.misses,
+                total ? stats.hits / double(total) : 0.0,
+                stats.overflow, stats.resident, stats.free, stats.in_use);
+            body += line;
+        }
+        response->setContentTypeCode(CT_TEXT_PLAIN);
+        response->setBody(std::move(body));
+    }
+    else if (path == "/metrics")
+    {
+        /* Prometheus metrics for every tenant in the registry */
+        std::vector<std::shared_ptr<TenantInstance>> tenants;
+        for (const auto& it : registry.snapshot()) {
+            if (std::find(tenants.begin(), tenants.end(), it.second) == tenants.end())
+                tenants.push_back(it.second);
+        }
+        response->setContentTypeString("text/plain; version=0.0.4");
+        response->setBody(prometheus_metrics(tenants));
+    }
+    else if (path == "/_limits")
+    {
+        /* Adjust the CPU budget of a tenant by its registry key:
+           /_limits?tenant=key&instructions=N&cpu_us=N per second */
+        auto tenant = registry.get(req->getParameter("tenant"));
+        if (tenant == nullptr) {
+            response->setStatusCode(k404NotFound);
+            return response;
+        }
+        auto limits = tenant->governor.limits();
+        if (!parse_parameter(req->getParameter("instructions"), limits.instructions_per_sec)
+            || !parse_parameter(req->getParameter("cpu_us"), limits.cpu_us_per_sec))
+        {
+            response->setStatusCode(k400BadRequest);
+            return response;
+        }
+        tenant->governor.set_limits(limits);
+        response->setContentTypeCode(CT_TEXT_PLAIN);
+        response->setBody("instructions=" + std::to_string(limits.instructions_per_sec)
+            + " cpu_us=" + std::to_string(limits.cpu_us_per_sec) + "\n");
+    }
+    else if (path == "/_reload")
+    {
+        /* Reload the program of a tenant by its registry key */
+        auto tenant = registry.get(req->getParameter("tenant"));
+        if (tenant == nullptr) {
+            response->setStatusCode(k404NotFound);
+            return response;
+        }
+        watcher->reload(tenant);
+        response->setStatusCode(k202Accepted);
+    }
+    else
+    {
+        response->setStatusCode(k404NotFound);
+    }
+    return response;
+}
+
+/* A stand-in upstream for ECALL_FETCH, that describes the request it received */
+static HttpResponsePtr upstream_request(const HttpRequestPtr& req)
+{
+    std::string body = std::string(req->methodString()) + " " + req->path();
+    if (!req->query().empty())
+        body += "?" + req->query();
+    body += "\n";
+    for (const auto& it : req->headers())
+        body += it.first + ": " + it.second + "\n";
+    body += "\n";
+    body += req->body();
+    auto response = HttpResponse::newHttpResponse();
+    response->setContentTypeCode(CT_TEXT_PLAIN);
+    response->addHeader("x-upstream", "stand-in");
+    response->setBody(std::move(body));
+    return response;
+}
 
 int main(int argc, char** argv)
 {
 	if (argc < 2) {
-		fprintf(stderr, "%s [program]\n", argv[0]);
+		fprintf(stderr, "%s [program | manifest.json]\n", argv[0]);
 		exit(1);
 	}
-    guest = new TenantInstance({
-        .name = "Pythran",
-        .group = "Tenants",
-        .filename = std::string(argv[1]),
-        .max_instructions = 2'000'000ull,
-        .max_memory = 64'000'000ull,
-        .max_heap   = 8'000'000ull
+    /* 1GB for all forks together, and 16MB of dirty pages per fork */
+    MemoryBudget::configure({
+        .max_pages = 262144,
+        .fork_dirty_pages = 4096
+    });
+    /* Keep binary translations between restarts */
+    TranslationCache::configure({
+        .directory = "./translations",
+        .max_bytes = 512'000'000ull
+    });
+    /* One main VM per NUMA node, and IO threads pinned to cores,
+       unless DVM_NUMA=0. Must be decided before tenants are created. */
+    const char* numa = getenv("DVM_NUMA");
+    const bool use_numa = (numa == nullptr || std::string(numa) != "0");
+    Numa::configure({
+        .replicate = use_numa
     });
-    assert(!guest->no_program_loaded());
-    addr = guest->lookup("on_client_request");
-    assert(addr != 0x0);
+    /* Text bodies of at least 1KB are compressed when accepted */
+    Compression::configure({
+        .min_length = 1024
+    });
+    /* Guests must not reach the admin listener, or tenants through
+       the public one, whatever host name they use */
+    Upstreams::refuse_ports({PUBLIC_PORT, ADMIN_PORT});
+    watcher = new ProgramWatcher;
+
+    const std::string argument = argv[1];
+    if (argument.size() > 5 && argument.compare(argument.size() - 5, 5, ".json") == 0)
+    {
+        /* Every tenant of the manifest is initialized before listening */
+        TenantManifest manifest;
+        try {
+            manifest = TenantManifest::load(argument);
+        } catch (const std::exception& e) {
+            fprintf(stderr, "%s\n", e.what());
+            exit(1);
+        }
+        const auto startup = manifest.create();
+        std::vector<std::pair<std::string, std::shared_ptr<TenantInstance>>> entries;
+        for (const auto& tenant : startup.tenants) {
+            printf("%-24s %8.1f ms  %s\n", tenant.entry->config.name.c_str(),
+                tenant.seconds * 1e3, tenant.ok ? "ok" : "FAILED");
+            if (!tenant.ok)
+                continue;
+            for (const auto& key : tenant.entry->keys)
+                entries.emplace_back(key, tenant.instance);
+            watcher->watch(tenant.instance);
+        }
+        printf("Started %zu of %zu tenants in %.1f ms\n",
+            startup.tenants.size() - startup.failed, startup.tenants.size(),
+            startup.seconds * 1e3);
+        if (entries.empty())
+            exit(1);
+        registry.insert(entries);
+    }
+    else
+    {
+        auto guest = std::make_shared<TenantInstance>(TenantConfig{
+            .name = "Pythran",
+            .group = "Tenants",
+            .filename = std::string(argv[1]),
+            .max_instructions = 2'000'000ull,
+            .max_memory = 64'000'000ull,
+            .max_heap   = 8'000'000ull,
+            .max_cache_bytes = 16'000'000ull,
+            .max_log_lines_per_sec = 100,
+            .max_kv_bytes = 16'000'000ull
+        });
+        assert(!guest->no_program_loaded());
+        assert(guest->lookup("on_client_request") != 0x0);
+        /* Serve the test program on /z for any host */
+        registry.insert("/z", guest);
+        watcher->watch(guest);
+
+        /* The same program on /async, where it may suspend itself
+           and fetch from the stand-in upstream below */
+        auto async_guest = std::make_shared<TenantInstance>(TenantConfig{
+            .name = "Pythran async",
+            .group = "Tenants",
+            .filename = std::string(argv[1]),
+            .max_instructions = 2'000'000ull,
+            .max_memory = 64'000'000ull,
+            .max_heap   = 8'000'000ull,
+            .async_requests = true,
+            .max_log_lines_per_sec = 100,
+            .upstreams = {"http://127.0.0.1:" + std::to_string(UPSTREAM_PORT)},
+            .max_upstream_requests = 64
+        });
+        if (!async_guest->no_program_loaded()) {
+            registry.insert("/async", async_guest);
+            watcher->watch(async_guest);
+        }
+    }
 
     app().setLogPath("./")
         .setLogLevel(trantor::Logger::kWarn)
-        .addListener("0.0.0.0", 8080)
-        .addListener("0.0.0.0", 8080)
+        .addListener("0.0.0.0", PUBLIC_PORT)
+        .addListener("0.0.0.0", PUBLIC_PORT)
+        .addListener("127.0.0.1", ADMIN_PORT)
+        .addListener("127.0.0.1", UPSTREAM_PORT)
         .setThreadNum(0)
+        /* Bodies above 64KB are kept in temporary files, and tenants
+           with on_body_chunk receive them through a window */
+        .setClientMaxBodySize(64'000'000ull)
+        .setClientMaxMemoryBodySize(65536)
+        /* Responses are compressed by the sandbox, see response.cpp */
+        .enableGzip(false)
+        .enableBrotli(false)
+        .registerBeginningAdvice([] {
+            for (size_t i = 0; i < app().getThreadNum(); i++) {
+                /* Spread over the nodes, so that forks stay on one node.
+                   With a single node the scheduler is left to place them. */
+                if (Numa::replicate()) {
+                    app().getIOLoop(i)->queueInLoop([i] {
+                        Numa::pin_io_thread(i);
+                    });
+                }
+                /* Fork sandboxes ahead of bursts while the IO threads are idle */
+                app().getIOLoop(i)->runEvery(0.002, [] {
+                    SandboxPool::local().top_up(8);
+                });
+            }
+        })
         .registerSyncAdvice(
 		[] (const HttpRequestPtr &req) -> HttpResponsePtr {
+            const uint16_t port = req->localAddr().toPort();
+            if (port == ADMIN_PORT)
+                return admin_request(req);
+            if (port == UPSTREAM_PORT)
+                return upstream_request(req);
             const auto &path = req->path();
             if (path.length() == 1 && path[0] == '/')
             {
@@ -41,24 +261,33 @@ R"(	this is a very
 )");
                 return response;
             }
-            else if (path.length() == 2 && path[1] == 'z')
+            /* The tenant is only valid while the guard is held */
+            auto guard = registry.read();
+            TenantInstance* tenant = registry.find(req->getHeader("host"), path);
+            /* Asynchronous tenants and cached requests are served
+               by the pre-routing advice, which can wait */
+            if (tenant != nullptr && !tenant->config.async_requests
+                && !is_cacheable(*tenant, *req))
             {
-                auto resp = HttpResponse::newHttpResponse();
-
-				try {
-					constexpr size_t BUFMAX = 64;
-					std::array<riscv::vBuffer, BUFMAX> buffers;
-
-					auto res = guest->forkcall(addr, BUFMAX, buffers.data());
-
-					resp->setBody({buffers[0].ptr, buffers[0].len});
-				} catch (const std::exception& e) {
-					resp->setStatusCode(k500InternalServerError);
-					resp->setBody(e.what());
-				}
-                return resp;
+                return handle_request(*tenant, req);
             }
             return nullptr;
         })
+        .registerPreRoutingAdvice(
+        [] (const HttpRequestPtr &req, AdviceCallback &&callback, AdviceChainCallback &&chain) {
+            std::shared_ptr<TenantInstance> tenant = nullptr;
+            {
+                auto guard = registry.read();
+                TenantInstance* found = registry.find(req->getHeader("host"), req->path());
+                if (found != nullptr && (found->config.async_requests || is_cacheable(*found, *req)))
+                    tenant = found->shared_from_this();
+            }
+            if (tenant == nullptr)
+                chain();
+            else if (tenant->config.async_requests)
+                handle_request_async(std::move(tenant), req, std::move(callback));
+            else
+                handle_request_cached(std::move(tenant), req, std::move(callback));
+        })
         .run();
 }
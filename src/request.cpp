@@ -0,0 +1,380 @@
+#include "request.hpp"
+#include "response.hpp"
+#include <cmath>
+#include <machine/syscalls.h>
+#include <trantor/EventLoop.h>
+using namespace drogon;
+
+/* Requests suspended at the same time on one IO thread, where
+   each tenant also has its own max_suspended_requests */
+static constexpr size_t MAX_SUSPENDED = 4096;
+/* How long asynchronous requests wait for CPU budget */
+static constexpr auto ADMISSION_WAIT = std::chrono::seconds(1);
+/* How often queued requests check the memory budget again */
+static constexpr double MEMORY_RETRY = 0.005;
+/* Wall time an asynchronous request may take in total */
+static constexpr auto ASYNC_TIMEOUT = std::chrono::seconds(30);
+static thread_local size_t suspended_requests = 0;
+
+static std::string cache_key(const HttpRequestPtr& req)
+{
+	std::string key = req->getHeader("host");
+	key += req->path();
+	if (!req->query().empty()) {
+		key += '?';
+		key += req->query();
+	}
+	return key;
+}
+
+static CachedResponse gather_response(const HttpResponsePtr& resp,
+	const TenantInstance::ForkCall& fc)
+{
+	CachedResponse cached;
+	cached.status = resp->statusCode();
+	cached.content_type = fc.content_type;
+	for (const auto& it : resp->headers())
+		cached.headers.emplace_back(it.first, it.second);
+	cached.body.reserve(fc.length);
+	for (size_t i = 0; i < fc.cnt; i++)
+		cached.body.append(fc.buffers[i].ptr, fc.buffers[i].len);
+	precompress(cached, fc, *resp);
+	return cached;
+}
+
+/* Sandboxes are using up the memory budget of the server */
+static HttpResponsePtr overloaded()
+{
+	auto resp = HttpResponse::newHttpResponse();
+	resp->setStatusCode(k503ServiceUnavailable);
+	resp->addHeader("retry-after", "1");
+	return resp;
+}
+
+/* The tenant has used up its CPU budget */
+static HttpResponsePtr throttled(TenantInstance& tenant)
+{
+	auto resp = HttpResponse::newHttpResponse();
+	resp->setStatusCode(k429TooManyRequests);
+	const int seconds = std::ceil(tenant.governor.retry_after());
+	resp->addHeader("retry-after", std::to_string(std::max(seconds, 1)));
+	return resp;
+}
+
+static unsigned route_method(const HttpRequestPtr& req)
+{
+	switch (req->method()) {
+	case Get:     return ROUTE_GET;
+	case Post:    return ROUTE_POST;
+	case Put:     return ROUTE_PUT;
+	case Delete:  return ROUTE_DELETE;
+	case Patch:   return ROUTE_PATCH;
+	case Head:    return ROUTE_HEAD;
+	case Options: return ROUTE_OPTIONS;
+	default:      return 0;
+	}
+}
+
+/* No route of the program matched, answered without forking */
+static HttpResponsePtr not_routed(const TenantInstance::Dispatch& d)
+{
+	auto resp = HttpResponse::newHttpResponse();
+	if (d.status != 405) {
+		resp->setStatusCode(k404NotFound);
+		return resp;
+	}
+	static const std::pair<unsigned, const char*> methods[] = {
+		{ROUTE_GET, "GET"}, {ROUTE_HEAD, "HEAD"}, {ROUTE_POST, "POST"},
+		{ROUTE_PUT, "PUT"}, {ROUTE_DELETE, "DELETE"}, {ROUTE_PATCH, "PATCH"},
+		{ROUTE_OPTIONS, "OPTIONS"},
+	};
+	std::string allow;
+	for (const auto& [bit, name] : methods) {
+		if ((d.allow & bit) || (bit == ROUTE_HEAD && (d.allow & ROUTE_GET))) {
+			if (!allow.empty()) allow += ", ";
+			allow += name;
+		}
+	}
+	resp->setStatusCode(k405MethodNotAllowed);
+	resp->addHeader("allow", allow);
+	return resp;
+}
+
+HttpResponsePtr handle_request(TenantInstance& tenant, const HttpRequestPtr& req)
+{
+	auto resp = HttpResponse::newHttpResponse();
+	try {
+		const auto dispatch = tenant.dispatch(route_method(req), req->path());
+		if (dispatch.status != 0)
+			return not_routed(dispatch);
+
+		if (!MemoryBudget::admit())
+			return overloaded();
+		if (!tenant.governor.admit())
+			return throttled(tenant);
+		return create_response(resp, tenant.forkcall(dispatch, { req.get(), resp.get() }), *req);
+	} catch (const std::exception& e) {
+		resp->setStatusCode(k500InternalServerError);
+		resp->setBody(e.what());
+	}
+	return resp;
+}
+
+bool is_cacheable(const TenantInstance& tenant, const HttpRequest& req)
+{
+	return tenant.cache.enabled() && req.method() == Get;
+}
+
+/* Returns nullptr when the waiter was left on another request's fill */
+static HttpResponsePtr serve_cached(TenantInstance& tenant, const HttpRequestPtr& req,
+	ResponseCache::Waiter waiter)
+{
+	auto resp = HttpResponse::newHttpResponse();
+	try {
+		const auto dispatch = tenant.dispatch(route_method(req), req->path());
+		if (dispatch.status != 0)
+			return not_routed(dispatch);
+
+		const ResponseCache::HeaderLookup header =
+			[&req] (const std::string& name) -> std::string_view {
+				return req->getHeader(name);
+			};
+		auto lookup = tenant.cache.lookup(cache_key(req), header, std::move(waiter));
+		if (lookup.waiting)
+			return nullptr;
+		if (lookup.object != nullptr)
+			return create_response(lookup.object, *req);
+		/* Cache hits are free, but anything else runs the guest */
+		const bool memory = MemoryBudget::admit();
+		if (!memory || !tenant.governor.admit()) {
+			if (lookup.fill != nullptr)
+				lookup.fill->cancel();
+			return memory ? throttled(tenant) : overloaded();
+		}
+
+		auto fc = tenant.forkcall(dispatch, { req.get(), resp.get() });
+		const auto& cc = fc->script->cache_control();
+		/* Only plain successful responses are shared between clients.
+		   Without an insert the fill is dropped, and the key passes. */
+		if (lookup.fill != nullptr && cc.ttl > 0
+			&& resp->statusCode() == k200OK
+			&& resp->getHeader("set-cookie").empty())
+		{
+			auto object = lookup.fill->insert(header, cc.vary,
+				std::chrono::seconds(cc.ttl), gather_response(resp, *fc));
+			return create_response(object, *req);
+		}
+		return create_response(resp, std::move(fc), *req);
+	} catch (const std::exception& e) {
+		resp->setStatusCode(k500InternalServerError);
+		resp->setBody(e.what());
+	}
+	return resp;
+}
+
+void handle_request_cached(std::shared_ptr<TenantInstance> tenant,
+	const HttpRequestPtr& req, std::function<void(const HttpResponsePtr&)>&& callback)
+{
+	auto pending = std::make_shared<std::function<void(const HttpResponsePtr&)>>(std::move(callback));
+	/* A collapsed miss looks up again on this event loop, once the
+	   fill has finished, and then runs the guest itself on a miss */
+	auto* loop = trantor::EventLoop::getEventLoopOfCurrentThread();
+	ResponseCache::Waiter waiter = [loop, tenant, req, pending] {
+		loop->queueInLoop([tenant, req, pending] {
+			(*pending)(serve_cached(*tenant, req, nullptr));
+		});
+	};
+	auto resp = serve_cached(*tenant, req, std::move(waiter));
+	if (resp != nullptr)
+		(*pending)(resp);
+}
+
+/* Counts a request against MAX_SUSPENDED and the limit of its tenant,
+   from when it first waits on the event loop, for admission or for
+   the guest, until it has been answered */
+struct SuspendedSlot
+{
+	explicit SuspendedSlot(std::shared_ptr<TenantInstance> t) : tenant{std::move(t)}
+	{
+		suspended_requests++;
+		tenant->suspended_requests.fetch_add(1, std::memory_order_relaxed);
+	}
+	~SuspendedSlot()
+	{
+		suspended_requests--;
+		tenant->suspended_requests.fetch_sub(1, std::memory_order_relaxed);
+	}
+	SuspendedSlot(const SuspendedSlot&) = delete;
+	SuspendedSlot& operator=(const SuspendedSlot&) = delete;
+
+	const std::shared_ptr<TenantInstance> tenant;
+};
+using SuspendedSlotPtr = std::shared_ptr<SuspendedSlot>;
+
+/* Answers the request when it can't wait on this thread */
+static HttpResponsePtr suspension_full(TenantInstance& tenant)
+{
+	if (suspended_requests >= MAX_SUSPENDED)
+		return overloaded();
+	const uint32_t max_tenant = tenant.config.max_suspended_requests;
+	if (max_tenant != 0 && tenant.suspended_requests.load(std::memory_order_relaxed) >= max_tenant)
+		return throttled(tenant);
+	return nullptr;
+}
+
+struct AsyncRequest : public std::enable_shared_from_this<AsyncRequest>
+{
+	using Callback = std::function<void(const HttpResponsePtr&)>;
+
+	AsyncRequest(std::shared_ptr<TenantInstance> t, HttpRequestPtr rq,
+		HttpResponsePtr rs, TenantInstance::ForkCallPtr f, Callback&& cb,
+		SuspendedSlotPtr s)
+		: tenant{std::move(t)}, req{std::move(rq)}, resp{std::move(rs)},
+		  fc{std::move(f)}, callback{std::move(cb)},
+		  slot{s ? std::move(s) : std::make_shared<SuspendedSlot>(tenant)},
+		  deadline{std::chrono::steady_clock::now() + ASYNC_TIMEOUT}
+	{
+	}
+
+	/* Answers 504 and releases the fork when out of time */
+	bool expired()
+	{
+		if (std::chrono::steady_clock::now() < deadline)
+			return false;
+		fc = nullptr;
+		resp->setStatusCode(k504GatewayTimeout);
+		callback(resp);
+		return true;
+	}
+
+	/* Resume on the same event loop, so that the fork goes
+	   back to the sandbox pool of this thread. */
+	void schedule()
+	{
+		if (this->expired())
+			return;
+		/* Waiting for a response from upstream, which completes
+		   on this event loop and resumes the fork from there */
+		if (auto* fetch = fc->script->waiting_fetch(); fetch != nullptr) {
+			fetch->on_done = [self = shared_from_this()] { self->step(); };
+			return;
+		}
+		auto* loop = trantor::EventLoop::getEventLoopOfCurrentThread();
+		const uint32_t ms = fc->script->suspend_ms();
+		if (ms == 0) {
+			loop->queueInLoop([self = shared_from_this()] { self->step(); });
+			return;
+		}
+		/* Sleeping past the deadline only holds on to the fork */
+		const double left = std::chrono::duration<double>(
+			deadline - std::chrono::steady_clock::now()).count();
+		loop->runAfter(std::min(ms / 1000.0, left),
+			[self = shared_from_this()] {
+				if (!self->expired())
+					self->step();
+			});
+	}
+
+	void step()
+	{
+		try {
+			tenant->async_resume(*fc);
+			if (fc->status == Script::AsyncStatus::Suspended) {
+				this->schedule();
+				return;
+			}
+			callback(create_response(resp, std::move(fc), *req));
+			return;
+		} catch (const std::exception& e) {
+			resp->setStatusCode(k500InternalServerError);
+			resp->setBody(e.what());
+		}
+		fc = nullptr;
+		callback(resp);
+	}
+
+	/* The fork must be released while the tenant is still alive */
+	std::shared_ptr<TenantInstance> tenant;
+	HttpRequestPtr  req;
+	HttpResponsePtr resp;
+	TenantInstance::ForkCallPtr fc;
+	Callback callback;
+	SuspendedSlotPtr slot;
+	std::chrono::steady_clock::time_point deadline;
+};
+
+static void start_async(std::shared_ptr<TenantInstance> tenant,
+	const HttpRequestPtr& req, std::function<void(const HttpResponsePtr&)>&& callback,
+	std::chrono::steady_clock::time_point admission_deadline, SuspendedSlotPtr slot)
+{
+	auto resp = HttpResponse::newHttpResponse();
+	TenantInstance::Dispatch dispatch;
+	try {
+		dispatch = tenant->dispatch(route_method(req), req->path());
+	} catch (const std::exception& e) {
+		resp->setStatusCode(k500InternalServerError);
+		resp->setBody(e.what());
+		callback(resp);
+		return;
+	}
+	if (dispatch.status != 0) {
+		callback(not_routed(dispatch));
+		return;
+	}
+
+	/* Over-budget tenants are put back on the event loop until
+	   there is budget again, while other tenants keep running.
+	   The same goes for everyone while memory is running low. */
+	const bool memory = MemoryBudget::admit();
+	if (!memory || !tenant->governor.admit()) {
+		if (std::chrono::steady_clock::now() >= admission_deadline) {
+			callback(overloaded());
+			return;
+		}
+		/* Waiting takes a slot, like a suspended request */
+		if (slot == nullptr) {
+			if (auto full = suspension_full(*tenant); full != nullptr) {
+				callback(full);
+				return;
+			}
+			slot = std::make_shared<SuspendedSlot>(tenant);
+		}
+		const double delay = memory
+			? std::max(tenant->governor.retry_after(), 0.001) : MEMORY_RETRY;
+		auto* loop = trantor::EventLoop::getEventLoopOfCurrentThread();
+		loop->runAfter(delay,
+			[tenant = std::move(tenant), req, callback = std::move(callback),
+			 admission_deadline, slot = std::move(slot)] () mutable {
+				start_async(std::move(tenant), req, std::move(callback),
+					admission_deadline, std::move(slot));
+			});
+		return;
+	}
+
+	try {
+		auto fc = tenant->async_forkcall(dispatch, { req.get(), resp.get() });
+		if (fc->status != Script::AsyncStatus::Suspended) {
+			callback(create_response(resp, std::move(fc), *req));
+			return;
+		}
+		auto request = std::make_shared<AsyncRequest>(std::move(tenant),
+			req, resp, std::move(fc), std::move(callback), std::move(slot));
+		request->schedule();
+		return;
+	} catch (const std::exception& e) {
+		resp->setStatusCode(k500InternalServerError);
+		resp->setBody(e.what());
+	}
+	callback(resp);
+}
+
+void handle_request_async(std::shared_ptr<TenantInstance> tenant,
+	const HttpRequestPtr& req, std::function<void(const HttpResponsePtr&)>&& callback)
+{
+	if (auto full = suspension_full(*tenant); full != nullptr) {
+		callback(full);
+		return;
+	}
+	start_async(std::move(tenant), req, std::move(callback),
+		std::chrono::steady_clock::now() + ADMISSION_WAIT, nullptr);
+}
@@ -0,0 +1,37 @@
+#pragma once
+#include <drogon/HttpRequest.h>
+#include <drogon/HttpResponse.h>
+#include <sandbox.hpp>
+
+/**
+ * Serves a request with a tenant, without the response cache.
+**/
+extern drogon::HttpResponsePtr handle_request(
+	TenantInstance& tenant, const drogon::HttpRequestPtr& req);
+
+/**
+ * Whether a request goes through the tenant's response cache, with
+ * handle_request_cached(), as it may have to wait for another request.
+**/
+extern bool is_cacheable(const TenantInstance& tenant, const drogon::HttpRequest& req);
+
+/**
+ * Serves a GET request through the tenant's response cache. Requests
+ * are looked up by host, path and query, and only the request that
+ * misses calls into the guest. Concurrent misses are parked on it,
+ * without blocking the event loop, and are resumed on their own
+ * event loop when it has finished. The callback is called once.
+**/
+extern void handle_request_cached(std::shared_ptr<TenantInstance> tenant,
+	const drogon::HttpRequestPtr& req,
+	std::function<void(const drogon::HttpResponsePtr&)>&& callback);
+
+/**
+ * Serves a request with a tenant that can suspend its requests.
+ * The fork is kept alive while suspended, and resumed later from
+ * the event loop of the calling thread. The callback is called
+ * once the guest has finished.
+**/
+extern void handle_request_async(std::shared_ptr<TenantInstance> tenant,
+	const drogon::HttpRequestPtr& req,
+	std::function<void(const drogon::HttpResponsePtr&)>&& callback);
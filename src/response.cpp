@@ -0,0 +1,254 @@
+#include "response.hpp"
+#include <machine_instance.hpp>
+#include <trantor/EventLoop.h>
+#include <trantor/net/TcpConnection.h>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+using namespace drogon;
+
+/* Chunked encoding is not worth it for small bodies */
+static constexpr size_t STREAM_THRESHOLD = 16384;
+/* Larger bodies are streamed from guest memory, and the connection
+   is closed when the client hasn't read anything for this long */
+static constexpr std::chrono::seconds WRITE_TIMEOUT {10};
+
+struct BodyStream
+{
+	BodyStream(TenantInstance::ForkCallPtr f) : fc{std::move(f)} {}
+
+	size_t read(char* dst, size_t len)
+	{
+		/* A null buffer means the stream is closed */
+		if (dst == nullptr) {
+			fc = nullptr;
+			return 0;
+		}
+		last_read = std::chrono::steady_clock::now();
+		size_t total = 0;
+		while (fc != nullptr && index < fc->cnt && total < len)
+		{
+			const auto& buffer = fc->buffers[index];
+			const size_t bytes = std::min(len - total, buffer.len - offset);
+			std::memcpy(dst + total, buffer.ptr + offset, bytes);
+			total  += bytes;
+			offset += bytes;
+			if (offset == buffer.len) {
+				index++;
+				offset = 0;
+			}
+		}
+		/* Release the sandbox as soon as everything is written */
+		if (fc != nullptr && index == fc->cnt)
+			fc = nullptr;
+		return total;
+	}
+
+	TenantInstance::ForkCallPtr fc;
+	/* Closed when the client stops reading */
+	std::weak_ptr<trantor::TcpConnection> connection;
+	size_t index  = 0;
+	size_t offset = 0;
+	std::chrono::steady_clock::time_point last_read = std::chrono::steady_clock::now();
+};
+
+/* Aborts the connection when the client stops reading, instead of
+   holding on to the sandbox for as long as the connection lasts. The
+   final chunk is never sent, so the client can tell that the body is
+   incomplete. */
+static void watch_stream(std::weak_ptr<BodyStream> weak, trantor::EventLoop* loop)
+{
+	loop->runAfter(WRITE_TIMEOUT.count(), [weak, loop] {
+		auto stream = weak.lock();
+		if (stream == nullptr || stream->fc == nullptr)
+			return;
+		if (std::chrono::steady_clock::now() - stream->last_read < WRITE_TIMEOUT) {
+			watch_stream(std::move(weak), loop);
+			return;
+		}
+		if (auto connection = stream->connection.lock())
+			connection->forceClose();
+		stream->fc = nullptr;
+	});
+}
+
+/* Streams a body from host memory, which may be shared with other responses */
+struct SharedStream
+{
+	size_t read(char* dst, size_t len)
+	{
+		if (dst == nullptr) {
+			body = nullptr;
+			return 0;
+		}
+		const size_t bytes = std::min(len, body->size() - offset);
+		std::memcpy(dst, body->data() + offset, bytes);
+		offset += bytes;
+		return bytes;
+	}
+
+	PrecompressedBodies::Body body;
+	size_t offset = 0;
+};
+
+/* Whether a body should be compressed for clients that accept it */
+static bool compressible(const HttpResponse& resp, std::string_view content_type, size_t length)
+{
+	/* The guest may have compressed it already */
+	return length >= Compression::min_length()
+		&& Compression::compressible(content_type)
+		&& resp.getHeader("content-encoding").empty();
+}
+
+/* Caches store one object for every encoding */
+static void add_vary(const HttpResponsePtr& resp)
+{
+	const std::string vary = resp->getHeader("vary");
+	std::string lower(vary.size(), '\0');
+	std::transform(vary.begin(), vary.end(), lower.begin(), ::tolower);
+	if (vary.empty())
+		resp->addHeader("vary", "Accept-Encoding");
+	else if (lower.find("accept-encoding") == std::string::npos && vary != "*")
+		resp->addHeader("vary", vary + ", Accept-Encoding");
+}
+
+/* Static bodies are compressed once for the program, at the best
+   level when they are small, and everything else on every request at
+   a fast level. So are static bodies the program has no room for. */
+static PrecompressedBodies::Body compress_body(const TenantInstance::ForkCall& fc, Encoding encoding)
+{
+	auto& precompressed = fc.script->instance().precompressed;
+	bool keep = false;
+	if (fc.static_body) {
+		auto body = precompressed.get(fc.body_addr, fc.length, encoding);
+		if (body != nullptr) {
+			Compression::count_precompressed();
+			return body;
+		}
+		keep = precompressed.has_room(fc.length);
+	}
+	const bool best = keep && fc.length <= PrecompressedBodies::MAX_BEST_LENGTH;
+	Compressor compressor(encoding,
+		best ? Compression::Level::Best : Compression::Level::Fast);
+	for (size_t i = 0; i < fc.cnt; i++)
+		compressor.write(fc.buffers[i].ptr, fc.buffers[i].len);
+	std::string out;
+	if (!compressor.finish(out))
+		return nullptr;
+	if (keep)
+		return precompressed.insert(fc.body_addr, fc.length, encoding, std::move(out));
+	return std::make_shared<const std::string>(std::move(out));
+}
+
+/* Keeps the status and headers the guest set on the original */
+static HttpResponsePtr stream_response(const HttpResponsePtr& resp,
+	std::function<size_t(char*, size_t)> read, const std::string& content_type)
+{
+	auto sresp = HttpResponse::newStreamResponse(std::move(read), "", CT_NONE, content_type);
+	sresp->setStatusCode(resp->statusCode());
+	for (const auto& it : resp->headers())
+		sresp->addHeader(it.first, it.second);
+	return sresp;
+}
+
+static HttpResponsePtr host_response(HttpResponsePtr resp,
+	PrecompressedBodies::Body body, const std::string& content_type)
+{
+	if (body->size() <= STREAM_THRESHOLD) {
+		resp->setBody(*body);
+		if (!content_type.empty())
+			resp->setContentTypeString(content_type);
+		return resp;
+	}
+	auto stream = std::make_shared<SharedStream>();
+	stream->body = std::move(body);
+	return stream_response(resp,
+		[stream] (char* buffer, size_t len) -> size_t {
+			return stream->read(buffer, len);
+		}, content_type);
+}
+
+static HttpResponsePtr compressed_response(HttpResponsePtr resp,
+	PrecompressedBodies::Body body, Encoding encoding, const std::string& content_type)
+{
+	resp->addHeader("content-encoding", Compression::name(encoding));
+	return host_response(std::move(resp), std::move(body), content_type);
+}
+
+HttpResponsePtr create_response(HttpResponsePtr resp, TenantInstance::ForkCallPtr fc,
+	const HttpRequest& req)
+{
+	if (compressible(*resp, fc->content_type, fc->length))
+	{
+		add_vary(resp);
+		const auto encoding = Compression::negotiate(req.getHeader("accept-encoding"));
+		if (encoding != Encoding::Identity) {
+			auto body = compress_body(*fc, encoding);
+			/* The sandbox is released right away, as nothing
+			   points into guest memory any more */
+			if (body != nullptr)
+				return compressed_response(std::move(resp), std::move(body), encoding, fc->content_type);
+		}
+	}
+
+	if (fc->length <= STREAM_THRESHOLD)
+	{
+		std::string body;
+		body.reserve(fc->length);
+		for (size_t i = 0; i < fc->cnt; i++)
+			body.append(fc->buffers[i].ptr, fc->buffers[i].len);
+		resp->setBody(std::move(body));
+		if (!fc->content_type.empty())
+			resp->setContentTypeString(fc->content_type);
+		return resp;
+	}
+
+	/* Sent straight out of guest memory, without a copy */
+	const std::string content_type = std::move(fc->content_type);
+	auto stream = std::make_shared<BodyStream>(std::move(fc));
+	stream->connection = req.getConnectionPtr();
+	auto* loop = trantor::EventLoop::getEventLoopOfCurrentThread();
+	if (loop != nullptr)
+		watch_stream(stream, loop);
+	return stream_response(resp,
+		[stream] (char* buffer, size_t len) -> size_t {
+			return stream->read(buffer, len);
+		}, content_type);
+}
+
+void precompress(CachedResponse& cached, const TenantInstance::ForkCall& fc,
+	const HttpResponse& resp)
+{
+	if (!compressible(resp, fc.content_type, fc.length))
+		return;
+	for (size_t i = 1; i < size_t(Encoding::Count); i++) {
+		if (!Compression::available(Encoding(i)))
+			continue;
+		auto body = compress_body(fc, Encoding(i));
+		if (body != nullptr)
+			cached.encoded.emplace_back(Encoding(i), *body);
+	}
+}
+
+HttpResponsePtr create_response(const ResponseCache::Object& object, const HttpRequest& req)
+{
+	auto resp = HttpResponse::newHttpResponse();
+	resp->setStatusCode((HttpStatusCode) object->status);
+	for (const auto& it : object->headers)
+		resp->addHeader(it.first, it.second);
+	if (!object->content_type.empty())
+		resp->setContentTypeString(object->content_type);
+	if (!object->encoded.empty()) {
+		add_vary(resp);
+		const auto encoding = Compression::negotiate(req.getHeader("accept-encoding"));
+		for (const auto& [enc, body] : object->encoded) {
+			if (enc == encoding) {
+				resp->addHeader("content-encoding", Compression::name(enc));
+				resp->setBody(body);
+				return resp;
+			}
+		}
+	}
+	resp->setBody(object->body);
+	return resp;
+}
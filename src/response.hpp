@@ -0,0 +1,37 @@
+#pragma once
+#include <drogon/HttpRequest.h>
+#include <drogon/HttpResponse.h>
+#include <sandbox.hpp>
+
+/**
+ * Turns a finished forkcall into the HTTP response.
+ *
+ * Small bodies are appended into the response directly from the
+ * gathered guest buffers. Larger bodies are streamed to the socket
+ * straight out of guest memory, and the ForkCall is kept alive until
+ * the last segment has been sent. A client that hasn't read anything
+ * for 10 seconds has its connection closed, which releases the
+ * sandbox and leaves the chunked body visibly unterminated.
+ *
+ * Text-like bodies are compressed with the encoding negotiated from
+ * Accept-Encoding, unless the guest set a Content-Encoding itself.
+ * Static bodies, in pages the fork shares with the main VM, are
+ * compressed once per program and then served to every fork. Only
+ * those up to 256KB are compressed at the best level, as it happens
+ * on the IO thread.
+**/
+extern drogon::HttpResponsePtr create_response(drogon::HttpResponsePtr resp,
+	TenantInstance::ForkCallPtr fc, const drogon::HttpRequest& req);
+
+/**
+ * Adds compressed copies of the body to a response that is about
+ * to be cached, one for every available encoding.
+**/
+extern void precompress(CachedResponse&, const TenantInstance::ForkCall&,
+	const drogon::HttpResponse&);
+
+/**
+ * Creates a response from a cached object.
+**/
+extern drogon::HttpResponsePtr create_response(const ResponseCache::Object&,
+	const drogon::HttpRequest& req);